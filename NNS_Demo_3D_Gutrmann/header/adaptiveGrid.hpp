@@ -0,0 +1,58 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef ADAPTIVE_GRID_H
+#define ADAPTIVE_GRID_H
+
+#include <sort.hpp>
+#include <vector>
+
+// Two level grid for clustered particles: the NNS grid (cell = cutoff) with dense cells split into
+// split^3 subcells. The particles of a split cell are sorted by subcell inside the cell's range, so
+// cellStart/cellEnd stay valid and a query only scans the subcells whose box is within the cutoff
+// Cells are split when they hold more than denseThreshold particles, and only if enough of the
+// particles are in such cells (denseFraction), otherwise the grid stays uniform and costs nothing extra
+// Open domains only
+class AdaptiveGrid {
+public:
+    NNS coarse;
+
+    // Settings
+    int denseThreshold;      // Split cells with more particles than this
+    float targetPerSubcell;  // split = round(cbrt(count / targetPerSubcell)), clamped to 2 - maxSplit
+    int maxSplit;            // At most 8
+    float minDenseFraction;  // Fraction of particles in dense cells needed to split at all
+
+    // Per-cell occupancy statistics of the last build
+    int occupiedCells;
+    int maxOccupancy;
+    float meanOccupancy;     // Over occupied cells
+    float denseFraction;     // Particles in cells above denseThreshold
+    bool refined;            // Dense cells were split in the last build
+    int splitCells;
+
+    // Split cells in cell order, splitIndex[cell] is -1 for cells that are not split
+    std::vector<int> splitIndex;
+    std::vector<int> splitCell;
+    std::vector<int> splitCount;     // split per axis
+    std::vector<float3> splitOrigin; // Lower corner of the cell
+    // Subcell k (x + y * split + z * split^2) of split cell s is sorted indexes
+    // subOffsets[subBase[s] + k] to subOffsets[subBase[s] + k + 1] - 1
+    std::vector<int> subBase;
+    std::vector<uint32_t> subOffsets;
+
+    void init(int count, int dimx, int dimy, int dimz, int cell, int buffer);
+
+    // NNS::build, occupancy statistics, then splitting of the dense cells if worth it
+    void build(std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    void printStats();
+
+private:
+    void computeStatistics();
+    void refine(std::vector<float>& sortedLoc);
+};
+
+#endif // ADAPTIVE_GRID_H
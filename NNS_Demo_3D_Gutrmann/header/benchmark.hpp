@@ -0,0 +1,48 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Per-stage timing of the NNS with std::sort and radix sort across particle counts,
+// plus the fused counting sort (NNS::build)
+// Density is kept close to the main performance test (3600 particles in 60^3)
+void benchmarkKvSort(int cellSize, int gridBuffer);
+
+// Timing of the grid build and the neighbor kernels with row-major, Morton and Hilbert cell IDs
+// Uses large grids where cellStart/cellEnd and the sorted data no longer fit in cache
+void benchmarkCellOrder(int cellSize, int gridBuffer);
+
+// Memory and timing of the dense grid (NNS) against the sparse hashed grid (SparseGrid)
+// The particle count is fixed while the domain grows, so most cells are empty
+void benchmarkSparseGrid(int cellSize, int gridBuffer);
+
+// k nearest neighbor queries on the grid against brute force for several k
+void benchmarkKnn(int cellSize, int gridBuffer);
+
+// Subcell grid with 1, 2 and 3 cells per cutoff at increasing densities, and the autotuner's choice
+void benchmarkSubcellGrid(int cellSize, int gridBuffer);
+
+// Dense grid (NNS) against the adaptive grid on uniform and clustered particles
+void benchmarkAdaptiveGrid(int cellSize, int gridBuffer);
+
+// countNeighbors threaded over particles (static) against cost balanced cell chunks (dynamic) on uniform
+// and clustered particles, with the load imbalance of the cost model
+void benchmarkSchedule(int cellSize, int gridBuffer);
+
+// Grid build plus moving 4 particle fields to sorted order: one NNS::reorder style loop per field,
+// the fused gather of ParticleStore and its stay sorted mode, with the memory of each
+void benchmarkParticleStore(int cellSize, int gridBuffer);
+
+// countNeighbors and the SoA SIMD kernel against 4x4 and 8x8 cluster pair lists (ClusterPairList) from a
+// quarter to 4 particles per cell, per frame of moving particles with the lists reused within the skin (and
+// rebuilt every frame for comparison), with the distance tests of each and the share of them that are neighbors
+void benchmarkClusterPairs(int cellSize, int gridBuffer, float skin);
+
+// Moving particles: NNS::updateIncremental against a full hash, kvSort and findCellStartEnd per frame, at
+// step sizes from almost no particles changing cell to most of them, in each cell order
+void benchmarkIncremental(int cellSize, int gridBuffer);
+
+#endif // BENCHMARK_H
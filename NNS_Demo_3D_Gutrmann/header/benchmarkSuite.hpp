@@ -0,0 +1,84 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef BENCHMARK_SUITE_H
+#define BENCHMARK_SUITE_H
+
+#include <sort.hpp>
+#include <string>
+#include <vector>
+
+// Stages of the NNS timed by the suite
+enum BenchStage {
+    STAGE_HASH,
+    STAGE_KV_SORT,
+    STAGE_FIND_CELL_START_END,
+    STAGE_REORDER,
+    STAGE_COUNT_NEIGHBORS,
+    STAGE_COUNT_NEIGHBORS_N2,
+    STAGE_COUNT
+};
+
+const char* benchStageName(BenchStage stage);
+
+// Wall clock statistics of one stage in milliseconds
+struct StageStats {
+    int repetitions;
+    double min;
+    double mean;
+    double median;
+    double p10;
+    double p90;
+    double max;
+};
+
+// One point of the sweep and its results
+struct BenchResult {
+    int particleCount;
+    float density;     // Particles per unit volume
+    int cellSize;
+    int threads;
+    int side;          // Edge length of the cubic simulation space
+    int cellCount;
+    StageStats stages[STAGE_COUNT];
+    bool timed[STAGE_COUNT]; // countNeighborsN2 is skipped for large particle counts
+};
+
+// Sweeps particle count, density, cell size and thread count and times each stage per repetition
+class BenchmarkSuite {
+public:
+    std::vector<int> particleCounts;
+    std::vector<float> densities;
+    std::vector<int> cellSizes;
+    std::vector<int> threadCounts;
+
+    int warmup;
+    int repetitions;
+    int n2Limit;       // Largest particle count to run countNeighborsN2 with
+    KvSortMethod sortMethod;
+    CellOrder cellOrder;
+
+    std::string jsonPath;
+    std::string csvPath;
+
+    std::vector<BenchResult> results;
+
+    void setDefaults();
+    // --key=value arguments, lists are comma separated. Returns false on error or --help
+    bool parseArgs(int argc, char** argv);
+
+    void run();
+
+    void printTable();
+    bool writeJson(const char* path);
+    bool writeCsv(const char* path);
+
+    static void printUsage(const char* program);
+
+private:
+    BenchResult runPoint(int particleCount, float density, int cellSize, int threads);
+};
+
+#endif // BENCHMARK_SUITE_H
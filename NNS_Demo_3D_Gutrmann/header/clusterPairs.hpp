@@ -0,0 +1,80 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef CLUSTER_PAIRS_H
+#define CLUSTER_PAIRS_H
+
+#include <listSkin.hpp>
+#include <simd.hpp>
+#include <vector>
+
+// Cluster pair lists on the NNS grid: the particles are cut into clusters of clusterSize along a Hilbert
+// curve through the cells, so a cluster is a compact group of neighboring cells whatever the density, and
+// each cluster gets the list of clusters whose bounding box comes within the cutoff of its own
+// The kernel then tests whole clusters against each other, clusterSize x clusterSize distances with
+// one SIMD compare per j particle, instead of the short per cell loops of countNeighbors that leave most
+// lanes empty when cells hold a few particles. More distances are tested, but each vector is full
+// Like VerletList the lists are built with cutoff + skin and reused until a particle has moved more than
+// skin / 2 (see ListSkin), in between only the lane positions are refreshed. Open domains only (like countNeighborsSIMD)
+class ClusterPairList : public ListSkin {
+public:
+    float cutoff;
+    int clusterSize;    // 4 (4x4 kernel) or 8 (8x8 kernel)
+    int particleCount;
+    int clusterCount;   // Set by build, particles in the out-of-bounds cell are not clustered
+    SimdLevel simdLevel; // Detected at init, can be lowered for testing
+
+    // Sorted particle in each lane (clusterSize per cluster), -1 for the padding of the last cluster
+    std::vector<int> clusterIndex;
+    // Positions of the lanes, clusterSize x values, then y, then z per cluster
+    // Padding lanes are placed far away, so they are never within the cutoff of a particle
+    AlignedFloatVector x;
+    AlignedFloatVector y;
+    AlignedFloatVector z;
+    // Bounding box of the particles of each cluster at the last build, min x y z then max x y z
+    std::vector<float> bounds;
+
+    // CSR lists, the j clusters of cluster c (itself included) are pairs[pairOffsets[c]] to pairs[pairOffsets[c + 1] - 1]
+    std::vector<int> pairOffsets;
+    std::vector<int> pairs;
+
+    // Cluster pairs taken from the cells around each cluster at the last build, before the bounding box test
+    long long candidatePairs;
+
+    // clusterWidth 0 picks 8 with AVX2 and up, otherwise 4. A skin of 0 needs a build every frame
+    void init(int count, float cutoffDist, float skinDist, int clusterWidth = 0);
+
+    // Rebuilds the grid and the lists if needed, otherwise gathers the new positions into sortedLoc
+    // using the previous order and refreshes the lanes. Returns true if the lists were rebuilt
+    bool update(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    // Builds the clusters and lists from the current grid (hash, kvSort, findCellStartEnd, reorder done)
+    void build(NNS& sort, std::vector<float>& locations, const std::vector<float>& sortedLoc);
+
+    // Same result as Particle::countNeighbors, particles in the out-of-bounds cell get 0
+    void countNeighbors(NNS& sort, std::vector<int>& neighborCount);
+
+    // Distances tested by countNeighbors, clusterSize^2 per listed pair
+    long long distanceTests() const { return (long long)pairs.size() * clusterSize * clusterSize; }
+
+    // Bytes held by the clusters and lists
+    size_t memoryBytes() const;
+
+    void printStats();
+
+private:
+    // Lane positions from sortedLoc in the order of the last build, padding lanes stay far away
+    void refreshPositions(const std::vector<float>& sortedLoc);
+
+    // Row-major cells along the Hilbert curve, kept while the grid size stays the same
+    std::vector<int> curve;
+    int curveDims[3];
+    // Lanes of the particles of each row-major cell, first and end
+    std::vector<int> cellLanes;
+    // Smallest and largest row-major cell coordinate (x y z) of the particles of each cluster
+    std::vector<int> cellBounds;
+};
+
+#endif // CLUSTER_PAIRS_H
@@ -0,0 +1,82 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <sort.hpp>
+#include <trajectory.hpp>
+#include <string>
+
+// Run settings, set from the command line (--key=value) or a config file (key = value per line)
+// Run with --help for the list of keys
+struct Config {
+    // Simulation space and particles
+    int xDim;
+    int yDim;
+    int zDim;
+    int cellSize;
+    int gridBuffer;     // two times the cell size is a good starting point
+    int particleCount;
+    bool periodic;      // Periodic box without a buffer, the space must be at least 3 cells per axis
+
+    // Run mode
+    bool performanceTest; // Timed runs, otherwise prints data structures and checks against all-to-all
+    bool multiThread;
+    int threads;          // 0 uses one thread per physical core
+    bool pinThreads;      // Bind thread t to a CPU (see applyThreads), unless OMP_PROC_BIND or OMP_PLACES is set
+    bool threadAutotune;  // Time a few thread counts and SMT settings at startup and keep the fastest
+    int iterations;
+
+    // Kernel settings
+    bool recordLists;     // Keep CSR neighbor lists for checking (a second pass of the counting kernels)
+    bool sortedLists;     // NNS lists in sorted order with sorted indexes, otherwise original order
+    HashMode hashMode;
+    KvSortMethod sortMethod;
+    bool keepPreviousOrder;
+    CellOrder cellOrder;
+    float verletSkin;
+    int cellDivisions;    // Subcell grid cells per cutoff, 0 lets the autotuner choose
+    int autotuneInterval; // Frames between subcell grid autotune runs, 0 tunes once
+    int quantizeBits;     // Also time the quantized position kernel with this many bits per axis, 0 skips it
+    bool quantizeValidate; // Report count mismatches of the quantized kernel against the float kernel
+    bool cellSchedule;    // countNeighbors threaded over cost balanced cell chunks instead of particles
+    int clusterSize;      // Particles per cluster of the cluster pair kernel (4 or 8), 0 picks from the SIMD level
+
+    // Trajectory files, see trajectory.hpp
+    std::string trajectoryPath;      // Stream this file instead of running the demo
+    std::string countsPath;          // Neighbor counts of the streamed frames
+    std::string writeTrajectoryPath; // Write a random trajectory first (particles and space from the settings above)
+    int trajectoryFrames;
+    TrajectoryLayout trajectoryLayout;
+    bool pipeline;                   // Overlap the grid build of the next frame with the kernel (FramePipeline)
+
+    // Extra benchmarks (performance test only)
+    bool kvSortBenchmark;
+    bool cellOrderBenchmark;
+    bool sparseGridBenchmark;
+    bool knnBenchmark;
+    bool subcellBenchmark;
+    bool adaptiveBenchmark;
+    bool scheduleBenchmark;
+    bool storeBenchmark;
+    bool clusterBenchmark;
+    bool incrementalBenchmark;
+
+    // Defaults are the "multi" preset
+    void setDefaults();
+    // "small" (debug check), "single" (single thread performance) or "multi"
+    bool setPreset(const char* name);
+
+    bool set(const char* key, const char* value);
+    bool loadFile(const char* path);
+    // Returns false on an error or --help, the caller should exit
+    bool parseArgs(int argc, char** argv);
+
+    void print();
+    static void printUsage(const char* program);
+};
+
+#endif // CONFIG_H
@@ -6,31 +6,14 @@
 #ifndef HELPER_H
 #define HELPER_H
 
-#define PERFORMANCE_TEST 1
-#define MULTI_THREAD 1
-
-#if !PERFORMANCE_TEST
-    #define X_DIM 10
-    #define Y_DIM 10
-    #define Z_DIM 5
-    #define CELL_SIZE 5
-    #define GRID_BUFFER 5 // two times the cell size is a good starting point
-    #define PARTICLE_COUNT 10
-#elif (PERFORMANCE_TEST && !MULTI_THREAD)
-    #define X_DIM 40
-    #define Y_DIM 40
-    #define Z_DIM 30
-    #define CELL_SIZE 5
-    #define GRID_BUFFER 10 // two times the cell size is a good starting point
-    #define PARTICLE_COUNT 800
-#else
-    #define X_DIM 60
-    #define Y_DIM 60
-    #define Z_DIM 60
-    #define CELL_SIZE 5
-    #define GRID_BUFFER 10 // two times the cell size is a good starting point
-    #define PARTICLE_COUNT 3600
-#endif
+#include <cstdio>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Run settings (space, particle count, threading, kernels) are set at runtime, see config.hpp
 
 struct float3 {
     float x;
@@ -40,4 +23,61 @@ struct float3 {
 
 float3 make_float3(float a, float b, float c);
 
+// offsets[1] to offsets[count] hold counts, they are replaced by the exclusive prefix sum (offsets[0] = 0)
+// Threaded like the radix sort histograms, each thread sums a block and then adds the blocks before it
+// Call outside of a parallel region, returns the total
+int exclusiveScan(int* offsets, int count);
+
+// Cache line aligned storage, also satisfies the alignment of any SIMD width used
+#define MEM_ALIGNMENT 64
+// Padding in floats so a full AVX-512 vector can be read past the last particle
+#define SOA_PADDING 16
+
+template <class T>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() {}
+    template <class U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return (T*)::operator new(n * sizeof(T), std::align_val_t(MEM_ALIGNMENT));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(MEM_ALIGNMENT));
+    }
+
+    template <class U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <class U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloatVector;
+
+// Structure of arrays particle positions, x, y and z are separate aligned and padded arrays
+struct Float3SoA {
+    AlignedFloatVector x;
+    AlignedFloatVector y;
+    AlignedFloatVector z;
+    int count;
+
+    void resize(int particleCount);
+};
+
+// Positions stored as offsets inside the particle's cell, bits (1 - 16) per axis, see NNS::reorder
+// An offset is the cell-relative coordinate truncated to steps of cellLength / 2^bits. Distances are
+// taken between the middles of the steps, so they are off by at most sqrt(3) * cellLength / 2^bits
+// Up to 10 bits the three offsets are packed into 4 bytes, above that they take three 16-bit values
+struct QuantizedPositions {
+    int bits;
+    int count;
+    std::vector<uint32_t> packed; // x | y << bits | z << (2 * bits), bits <= 10
+    std::vector<uint16_t> wide;   // x, y, z per particle, bits > 10
+
+    void resize(int particleCount, int precisionBits);
+    bool isPacked() const { return bits <= 10; }
+    int bytesPerParticle() const { return isPacked() ? 4 : 6; }
+    // Largest error of a distance (see above)
+    float errorBound(float cellLength) const { return sqrtf(3.0f) * cellLength / (float)(1 << bits); }
+};
+
 #endif // HELPER_H
\ No newline at end of file
@@ -0,0 +1,59 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <globals.hpp>
+#include <vector>
+#include <cstdint>
+
+// Hot path counters, compiled out unless built with -DNNS_INSTRUMENT=1 (CMake option NNS_INSTRUMENT)
+// The hooks in NNS::hash, NNS::findCellStartEnd and Particle::countNeighbors are inside #if NNS_INSTRUMENT
+#ifndef NNS_INSTRUMENT
+#define NNS_INSTRUMENT 0
+#endif
+
+class NNS;
+
+// One per OpenMP thread, aligned so threads don't share cache lines
+struct alignas(MEM_ALIGNMENT) ThreadCounters {
+    uint64_t particles;       // Particles this thread computed
+    uint64_t distanceTests;   // Distance evaluations
+    uint64_t hits;            // Distances within the cutoff
+    uint64_t emptyCellProbes; // Neighbor cells visited that had no particles
+    double busyTime;          // Seconds spent in the loop (without waiting at the barrier)
+};
+
+class Instrumentation {
+public:
+    std::vector<ThreadCounters> threads;
+
+    int frame;
+    uint64_t dumpedParticles; // Particles hashed into the out-of-bounds cell (cellCount-1)
+
+    // Particles per cell, the last bin collects everything above
+    static const int histogramBins = 16;
+    uint64_t cellHistogram[histogramBins];
+    int maxPerCell;
+    int occupiedCells;
+
+    Instrumentation();
+
+    // Clears the counters, called by NNS::hash at the start of a frame
+    void beginFrame();
+    // Makes room for count threads, call outside of the parallel region
+    void reserveThreads(int count);
+    ThreadCounters& thread(int threadNum);
+
+    void recordDumped(uint64_t count);
+    void recordCellOccupancy(const NNS& sort);
+
+    void printFrame();
+};
+
+extern Instrumentation instrument;
+
+#endif // INSTRUMENT_H
@@ -0,0 +1,50 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef KNN_H
+#define KNN_H
+
+#include <sort.hpp>
+#include <vector>
+
+// k nearest neighbors from the NNS grid (hash, kvSort, findCellStartEnd, reorder done)
+// Each query walks outward through shells of cells (Chebyshev distance r from its cell) keeping the
+// k closest in a max-heap, and stops once the next shell can't be closer than the kth distance
+// Open domains only, periodic grids are not wrapped
+class KNearest {
+public:
+    int k;
+    int queryCount;
+
+    // queryCount * k results, nearest first. Missing neighbors (fewer than k found) are -1 / INFINITY
+    std::vector<int> indices;    // Original particle indexes
+    std::vector<float> distances;
+
+    // Statistics of the last query
+    long long cellsVisited;
+    long long distanceTests;
+
+    void init(int neighbors);
+
+    // Every particle, results in original order, a particle is not its own neighbor
+    void queryParticles(NNS& sort, std::vector<float>& sortedLoc);
+    // Arbitrary points (x, y, z per point), results in the order of points
+    void queryPoints(NNS& sort, std::vector<float>& sortedLoc, const std::vector<float>& points);
+
+    // Reference results by testing every particle, same layout as queryParticles
+    void queryParticlesBruteForce(std::vector<float>& locations);
+
+private:
+    // Per-thread heaps, k entries each
+    std::vector<float> heapDist2;
+    std::vector<int> heapIndex;
+
+    void resize(int count);
+    // skipSorted is the sorted index of the query particle or -1
+    void queryOne(NNS& sort, const float* loc, float px, float py, float pz, int skipSorted, int outRow, int thread,
+        long long& cells, long long& tests);
+};
+
+#endif // KNN_H
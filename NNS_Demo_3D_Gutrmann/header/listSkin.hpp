@@ -0,0 +1,42 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef LIST_SKIN_H
+#define LIST_SKIN_H
+
+#include <sort.hpp>
+#include <vector>
+
+// Rebuild bookkeeping of the lists built with cutoff + skin and reused across frames (VerletList and
+// ClusterPairList). Lists stay valid while no particle has moved more than skin / 2 since the last 
+// build, any pair now within cutoff was then within cutoff + skin
+class ListSkin {
+public:
+    float skin;
+
+    // Original order positions at the last build
+    std::vector<float> buildLocations;
+
+    // Statistics
+    int buildCount;
+    int frameCount;
+    float lastMaxDisplacement;
+
+    // Largest displacement since the last build (parallel max reduction)
+    float maxDisplacement(const std::vector<float>& locations) const;
+
+protected:
+    void initSkin(int count, float skinDist);
+
+    // Counts the frame and returns true if the lists have to be rebuilt, the grid is then rebuilt too
+    // (hash, kvSort, findCellStartEnd, reorder). Otherwise only gathers the new positions into sortedLoc
+    // using the previous order
+    bool updateGrid(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    // Keeps the positions of a build, call at the end of it
+    void recordBuild(const std::vector<float>& locations);
+};
+
+#endif // LIST_SKIN_H
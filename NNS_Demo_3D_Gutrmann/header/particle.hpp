@@ -6,9 +6,14 @@
 #ifndef PARTICLE_H
 #define PARTICLE_H
 
+#include <globals.hpp>
+#include <simd.hpp>
 #include <vector>
 
 class NNS;
+class SparseGrid;
+class SubcellGrid;
+class AdaptiveGrid;
 
 class Particle {
     int count;
@@ -24,23 +29,76 @@ public:
     //std::vector<float> sortedVel;
     //std::vector<float> sortedAccel;
 
+    // Sorted particle data as structure of arrays, used by the SIMD kernel
+    Float3SoA sortedSoA;
+    SimdLevel simdLevel; // Detected at init, can be lowered for testing
+
+    // Sorted positions as quantized offsets inside their cell (see NNS::reorder), resize to set the bits
+    QuantizedPositions sortedQuantized;
+
     
     // Counting neighboors, filler calulation -------------------
     std::vector<int> neighborCount;
 
+    // Counts in sorted order for the symmetric and generic traversals (per-thread copies for forEachPair)
+    std::vector<int> threadNeighborCount;
+
     // Testing (N2 stands for n squared, O(n^2) efficiency)
     std::vector<int> neighborCountN2;
 
-    // Checking found particles [Debug]
-    std::vector<std::vector<int>> neighborList;
-    std::vector<std::vector<int>> neighborN2List;
+    // Neighbor lists in CSR form, filled if recordLists by a second (fill) pass after the count pass
+    // The neighbors of row i are neighborList[neighborOffsets[i]] to neighborList[neighborOffsets[i + 1] - 1]
+    std::vector<int> neighborOffsets;
+    std::vector<int> neighborList;
+    std::vector<int> neighborN2Offsets; // All-to-all lists, always in original order
+    std::vector<int> neighborN2List;
+    bool recordLists;
+    // NNS lists with rows and neighbors as sorted indexes, so later kernels can stream them with sortedLoc
+    // Otherwise rows and neighbors are original indexes
+    bool sortedLists;
+    std::vector<int> listOriginalIndex; // Original index of each row of sorted lists
+
+    // countNeighbors(NNS&) threads over cost balanced chunks of cells (NNS::buildSchedule, built by the
+    // call) instead of a static split of the particles, for clustered data
+    bool cellSchedule;
 
     /// Functions -----------------------------------------------
 
     void init(int particleCount, int dimx, int dimy, int dimz);
+    // Particles in clusterCount Gaussian blobs (standard deviation spread) at random centers, 
+    // kept inside the space
+    void initClustered(int particleCount, int dimx, int dimy, int dimz, int clusterCount, float spread);
+    // Moves every particle by a random step of up to maxStep per axis
+    void jitter(float maxStep);
+    // Clamps the particles into the simulation space of init, jittered particles would otherwise walk
+    // into the grid buffer, whose outermost cells have stencils that leave the grid
+    void confine(int dimx, int dimy, int dimz);
     
     void countNeighborsN2(int cellLength);
+    // Minimum image all-to-all in the periodic box of sort (see NNS::init)
+    void countNeighborsN2Periodic(NNS& sort);
+    // Also handles periodic grids, as does countNeighborsSymmetric, the SIMD kernel is for open domains
     void countNeighbors(NNS& sort);
+    // Same result using sortedSoA (see NNS::reorder), squared distances and SIMD
+    void countNeighborsSIMD(NNS& sort);
+    // Same result visiting each pair once with a half (13 cell) stencil and adding to both particles,
+    // threaded over colors of cells that never share a neighbor cell
+    void countNeighborsSymmetric(NNS& sort);
+    // Same loop on sortedQuantized with integer distances, off by at most sortedQuantized.errorBound
+    // Open domains, particles in the excluded out-of-bounds cell get 0
+    void countNeighborsQuantized(NNS& sort);
+    // Runs the float (sortedLoc) and quantized kernels and prints how many counts differ, 
+    // both sorted arrays have to be filled by reorder, false if they differ by more than the bound allows
+    bool validateQuantized(NNS& sort);
+    // Same results written as instances of NNS::forEachNeighbor and NNS::forEachPair
+    void countNeighborsGeneric(NNS& sort);
+    void countNeighborsPairwiseGeneric(NNS& sort);
+    // Same loop on the sparse grid, sortedLoc has to be filled by SparseGrid::build
+    void countNeighbors(SparseGrid& grid);
+    // Same loop on the subcell grid with its pruned stencil, sortedLoc has to be filled by SubcellGrid::build
+    void countNeighbors(SubcellGrid& grid);
+    // Same loop as countNeighbors(NNS&) on grid.coarse, scanning only the nearby subcells of split cells
+    void countNeighbors(AdaptiveGrid& grid);
 
     void printLoc(int printCount = 0);
 
@@ -54,10 +112,29 @@ public:
     void printNeighborN2Less(int printCount);
     void printNeighborN2More(int printCount);
 
-    // Testing: comparing NNS and all-to-all results
-    void check();
+    // Testing: comparing NNS and all-to-all results, false if the NNS lists miss a neighbor
+    bool check();
 
     int getParticleCount();
+
+private:
+    // Write cursor of each list row, used by the symmetric fill pass
+    std::vector<int> listCursor;
+
+    // Kernels compiled as the count pass (Fill false) and the fill pass, which writes the lists 
+    // at the offsets of the counts. Both are threaded, nothing is allocated per particle
+    template <bool Fill> void countNeighborsN2Impl(int cellLength);
+    template <bool Fill> void countNeighborsN2PeriodicImpl(NNS& sort);
+    template <bool Fill, bool Periodic> void countNeighborsImpl(NNS& sort);
+    template <bool Fill, bool Periodic> void countNeighborsSymmetricImpl(NNS& sort);
+    template <bool Packed> void countNeighborsQuantizedImpl(NNS& sort);
+
+    // Prefix sums the counts into the offsets and sizes the lists, before a fill pass
+    void allocateLists(NNS& sort);
+    void allocateN2Lists();
+    // NNS neighbors of original particle i as original indexes, rowOf is the list row of each particle
+    void originalNeighbors(int i, const std::vector<int>& rowOf, std::vector<int>& out);
+    void listRows(std::vector<int>& rowOf);
 };
 
 #endif // PARTICLE_H
\ No newline at end of file
@@ -0,0 +1,72 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef PARTICLE_STORE_H
+#define PARTICLE_STORE_H
+
+#include <sort.hpp>
+#include <simd.hpp>
+#include <string>
+#include <vector>
+
+// One registered attribute, components floats per particle like Particle::locations
+struct ParticleField {
+    std::string name;
+    int components;             // 1 to 4
+    std::vector<float> values;  // Original order, or sorted order when the store stays sorted
+    std::vector<float> sorted;  // Sorted copy filled by reorder, unused when the store stays sorted
+};
+
+// Particle attributes kept as one array per field (positions, velocities, masses, ...), all moved to
+// the sorted order of an NNS grid in one parallel pass instead of one NNS::reorder per attribute
+// Two modes:
+//  - Gather: values stay in original order and reorder fills a sorted copy of each field, results
+//    computed in sorted order go back with scatter
+//  - Stay sorted: reorder permutes the values themselves through one scratch array, so there is no
+//    second copy of the fields and nothing to scatter back. Slots change every frame, externalId and
+//    slotOf follow the particles
+// Fields are registered after init. The position field can be hashed (NNS::hash) and, sorted, used as
+// the sortedLoc of the kernels
+class ParticleStore {
+public:
+    int particleCount;
+    bool staySorted;
+    std::vector<ParticleField> fields;
+
+    // Particle in each slot of values, and the slot of each particle (identity in gather mode)
+    std::vector<int> externalId;
+    std::vector<int> slotOf;
+
+    SimdLevel simdLevel; // Streaming store gather, detected at init
+
+    void init(int count, bool keepSorted = false);
+
+    // Returns the index of the new field, values are zero
+    int addField(const std::string& name, int components);
+    // Index of the field or -1
+    int findField(const std::string& name) const;
+
+    std::vector<float>& values(int field) { return fields[field].values; }
+    // Sorted data after reorder, values itself when the store stays sorted
+    std::vector<float>& sorted(int field) { return staySorted ? fields[field].values : fields[field].sorted; }
+
+    // Call after findCellStartEnd (or NNS::build) on the position field's values. Gather mode fills
+    // sorted() of every field. Stay sorted mode permutes every field and externalId, then sets
+    // sort.cellIndexPair[i].index = i, so kernels indexing results by cellIndexPair[i].index
+    // (Particle::countNeighbors) write them in the new slot order
+    void reorder(NNS& sort);
+
+    // out[cellIndexPair[i].index] = in[i] for components floats per particle, gather mode only
+    void scatter(const NNS& sort, const std::vector<float>& in, std::vector<float>& out, int components);
+
+    // Bytes held by the fields, sorted copies and the ID maps
+    size_t memoryBytes() const;
+
+private:
+    std::vector<float> scratch; // Stay sorted: one field's worth, swapped with each field in turn
+    std::vector<int> idScratch;
+};
+
+#endif // PARTICLE_STORE_H
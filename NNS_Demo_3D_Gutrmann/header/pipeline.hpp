@@ -0,0 +1,129 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <sort.hpp>
+#include <particle.hpp>
+#include <timer.hpp>
+#include <omp.h>
+#include <utility>
+#include <vector>
+
+// Runs frames of independent positions (a trajectory, or repeated searches of one frame) through
+// hash, kvSort, findCellStartEnd, reorder and countNeighbors. Two grid slots (cellIndexPair, cellStart/End
+// and sortedLoc) let the build of frame f + 1 run on buildThreads threads while the kernel of frame f
+// runs on the rest, so the serial parts of the build no longer leave the cores idle
+// The thread split is rebalanced every frame towards equal stage times
+// Not for simulations where frame f + 1 depends on the result of frame f. Instrumentation
+// (NNS_INSTRUMENT) counters are per thread number and are not meaningful in the overlapped stages
+class FramePipeline {
+public:
+    NNS grids[2];
+    std::vector<float> sortedLoc[2];
+
+    int totalThreads;
+    int buildThreads;  // The kernel runs on totalThreads - buildThreads
+    bool rebalance;
+
+    // Stage times summed over the last run
+    double buildTime;
+    double kernelTime;
+
+    // Set the grid settings (hashMode, setSortMethod, setCellOrder) of both grids after init
+    void init(int count, int dimx, int dimy, int dimz, int cell, int buffer, bool periodicBox = false);
+
+    // source(f) returns the positions of frame f (x y z per particle), valid until the next call to source
+    // done(f) is called after the kernel of frame f, with part.neighborCount holding its counts
+    // Returns the wall time of the run. With one thread there is nothing to overlap, runs runSequential
+    template <class Source, class Done>
+    double run(Particle& part, int frameCount, Source source, Done done);
+
+    // Same frames one stage after the other on all threads, for comparison
+    template <class Source, class Done>
+    double runSequential(Particle& part, int frameCount, Source source, Done done);
+
+private:
+    void build(int slot, const float* locations);
+    void kernel(int slot, Particle& part);
+    void balance(double stageBuild, double stageKernel);
+};
+
+template <class Source, class Done>
+double FramePipeline::run(Particle& part, int frameCount, Source source, Done done) {
+    if (totalThreads < 2) {
+        return runSequential(part, frameCount, source, done);
+    }
+    buildTime = kernelTime = 0.0;
+    if (frameCount <= 0) {
+        return 0.0;
+    }
+
+    // The two stage threads each start a nested team
+    int previousLevels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+
+    double t = wallTime();
+    double ts = wallTime();
+    build(0, source(0));
+    buildTime += wallTime() - ts;
+
+    for (int f = 0; f < frameCount; f++) {
+        int slot = f & 1;
+
+        if (f + 1 == frameCount) {
+            ts = wallTime();
+            kernel(slot, part);
+            kernelTime += wallTime() - ts;
+        }
+        else {
+            double stageBuild = 0.0, stageKernel = 0.0;
+#pragma omp parallel num_threads(2)
+            {
+                double start = wallTime();
+                if (omp_get_thread_num() == 0) {
+                    omp_set_num_threads(buildThreads);
+                    build(slot ^ 1, source(f + 1));
+                    stageBuild = wallTime() - start;
+                }
+                else {
+                    omp_set_num_threads(totalThreads - buildThreads);
+                    kernel(slot, part);
+                    stageKernel = wallTime() - start;
+                }
+            }
+            buildTime += stageBuild;
+            kernelTime += stageKernel;
+            balance(stageBuild, stageKernel);
+        }
+
+        done(f);
+    }
+
+    omp_set_max_active_levels(previousLevels);
+    return wallTime() - t;
+}
+
+template <class Source, class Done>
+double FramePipeline::runSequential(Particle& part, int frameCount, Source source, Done done) {
+    buildTime = kernelTime = 0.0;
+
+    double t = wallTime();
+    for (int f = 0; f < frameCount; f++) {
+        double ts = wallTime();
+        build(0, source(f));
+        buildTime += wallTime() - ts;
+
+        ts = wallTime();
+        kernel(0, part);
+        kernelTime += wallTime() - ts;
+
+        done(f);
+    }
+    return wallTime() - t;
+}
+
+#endif // PIPELINE_H
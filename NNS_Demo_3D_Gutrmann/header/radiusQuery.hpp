@@ -0,0 +1,44 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef RADIUS_QUERY_H
+#define RADIUS_QUERY_H
+
+#include <sort.hpp>
+#include <vector>
+
+// Particles within a radius of external points (probes, sensors, mesh vertices) from the NNS grid
+// The radius can be larger than cellLength, the stencil then reaches ceil(radius / cellLength) cells
+// Queries are sorted by cell so neighboring queries read the same cells, and the results are sized
+// by a count pass and written by a fill pass, so nothing is allocated per query
+// Open domains only, particles in the excluded out-of-bounds cell are not found
+class RadiusQuery {
+public:
+    // CSR results in the order of the points, the neighbors of point q are
+    // indices[offsets[q]] to indices[offsets[q + 1] - 1] (original particle indexes)
+    std::vector<int> offsets;
+    std::vector<int> indices;
+    std::vector<float> distances; // Same layout, filled if storeDistances
+    bool storeDistances;
+
+    RadiusQuery();
+
+    // points holds x, y, z per point. Call after reorder (or build)
+    void query(NNS& sort, std::vector<float>& sortedLoc, const std::vector<float>& points, float radius);
+
+    // Reference results by testing every particle, same layout
+    void queryBruteForce(std::vector<float>& locations, const std::vector<float>& points, float radius);
+
+    int getQueryCount();
+
+private:
+    std::vector<KeyValuePair> queryOrder; // (cell, point) sorted by cell
+
+    // Count pass (Fill false) stores the count of each point in offsets[q + 1]
+    template <bool Fill>
+    void visit(NNS& sort, const float* loc, const float* points, float radius);
+};
+
+#endif // RADIUS_QUERY_H
@@ -0,0 +1,49 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+
+struct KeyValuePair; // sort.hpp
+
+// Instruction sets the SoA neighbor kernel is compiled for, chosen at runtime
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+// Counts particles in the given [start, end) ranges of the SoA arrays closer than the cutoff
+// ranges holds rangeCount start/end pairs, the arrays must be padded (see Float3SoA)
+typedef int (*CountInRangesFunc)(const float* x, const float* y, const float* z,
+    const uint32_t* ranges, int rangeCount, float px, float py, float pz, float cutoff2);
+
+// dst[i * components + k] = src[pairs[i].index * components + k] for i in [begin, end), k < components
+// Gathers sorted copies of particle data (pairs is NNS::cellIndexPair). The SSE and up
+// versions write whole 16 byte blocks with streaming (non-temporal) stores, the copy is not read again
+// before the kernel and would only push the source data out of cache. components is 1 to 4
+typedef void (*GatherFunc)(float* dst, const float* src, const KeyValuePair* pairs,
+    int components, int begin, int end);
+
+// counts[k] = particles of the j clusters closer than the cutoff to particle k of cluster i, for k < clusterSize
+// x, y and z hold clusterSize floats per cluster (see ClusterPairList), each j cluster is tested as a whole
+// against the whole i cluster, lanes that are not particles have to be placed out of reach
+typedef void (*ClusterPairFunc)(const float* x, const float* y, const float* z, int iCluster,
+    const int* jClusters, int jCount, float cutoff2, int* counts);
+
+// Best level supported by this CPU
+SimdLevel detectSimdLevel();
+const char* simdLevelName(SimdLevel level);
+
+// Falls back to the next lower level if level is not supported
+CountInRangesFunc getCountInRangesFunc(SimdLevel level);
+GatherFunc getGatherFunc(SimdLevel level);
+// clusterSize 4 (SSE, 4x4) or 8 (AVX2, 8x8), scalar loops of the same size below those levels
+ClusterPairFunc getClusterPairFunc(SimdLevel level, int clusterSize);
+
+#endif // SIMD_H
@@ -8,12 +8,35 @@
 
 #include <globals.hpp>
 #include <vector>
+#include <cstdint>
+#include <omp.h>
 
 struct KeyValuePair {
     int cellID;    // Grid cell
     int index;     // Particle index
 };
 
+// Bounds checking done by NNS::hash, see the hashingLogic functions
+enum HashMode {
+    HASH_DEBUG, // Bounds checking and reporting
+    HASH_SAFE,  // Bounds checking
+    HASH_FAST,  // No error handling
+    HASH_PERIODIC // Used in place of the above by periodic grids (see NNS::init), wraps into the box
+};
+
+// Order of the cell IDs, Morton and Hilbert keep neighboring cells close in memory
+enum CellOrder {
+    CELL_ORDER_ROW_MAJOR, // x + y * cellDimx + z * cellDimx * cellDimy
+    CELL_ORDER_MORTON,    // Z-order curve
+    CELL_ORDER_HILBERT    // Hilbert curve
+};
+
+// Key value sort used by NNS::kvSort
+enum KvSortMethod {
+    KV_SORT_STD,    // std::sort (serial), kept as a fallback
+    KV_SORT_RADIX   // Parallel LSD radix sort (stable)
+};
+
 class NNS {
 private:
     // Depending on use case make more things private and use getters and setters
@@ -39,28 +62,200 @@ public:
     std::vector<uint32_t> cellStart;
     std::vector<uint32_t> cellEnd;
 
+    // Cell ordering, the stencil is defined on row-major cells and mapped to cell IDs
+    CellOrder cellOrder;
+    std::vector<int> cellRank;      // Row-major cell -> cell ID
+    std::vector<int> cellRowMajor;  // Cell ID -> row-major cell
+    int stencilOffset[27];          // Row-major offsets of the 27 neighbor cells, t = 13 is the cell itself
+    std::vector<int> orderedNeighbor; // 27 neighbor cell IDs per cell for Morton and Hilbert (open domains)
+
+    // Row-major cell to cell ID
+    inline int orderedCell(int rowMajor) const {
+        return (cellOrder == CELL_ORDER_ROW_MAJOR) ? rowMajor : cellRank[rowMajor];
+    }
+
+    // Cell at a row-major offset from cell, outside of the grid gives the excluded cell (cellCount - 1)
+    // For row-major IDs this is just cell + offset, as in the original stencil
+    inline int offsetCell(int cell, int rowMajorOffset) const {
+        if (cellOrder == CELL_ORDER_ROW_MAJOR) {
+            return cell + rowMajorOffset;
+        }
+        int target = cellRowMajor[cell] + rowMajorOffset;
+        return (target < 0 || target >= cellCount) ? cellCount - 1 : cellRank[target];
+    }
+
+    // Periodic box, cells wrap across the faces and distances use the minimum image convention
+    // The box is the unbuffered space and each axis has at least 3 cells of at least cellLength
+    bool periodic;
+    float3 boxSize;
+    float3 cellWidth;
+    std::vector<int> periodicNeighbor; // 27 wrapped neighbor cell IDs per cell
+    std::vector<float3> periodicShift; // Added to (neighbor - particle) per cell and t, 0 or +-boxSize
+
+    // Neighbor t (0 - 26) of cell, one load from a table for the curve orders
+    inline int neighborCell(int cell, int t) const {
+        if (periodic) {
+            return periodicNeighbor[cell * 27 + t];
+        }
+        if (cellOrder == CELL_ORDER_ROW_MAJOR) {
+            return cell + stencilOffset[t];
+        }
+        return orderedNeighbor[cell * 27 + t];
+    }
+
+    // Minimum image shift of neighbor t of cell (periodic only)
+    inline const float3& neighborShift(int cell, int t) const {
+        return periodicShift[cell * 27 + t];
+    }
+
+    // Position wrapped into the periodic box, [-boxSize / 2, boxSize / 2) like the input space
+    inline float wrapCoordinate(float v, float length) const {
+        float u = v + length * 0.5f;
+        u -= length * floorf(u / length);
+        if (u >= length) {
+            u = 0.0f; // Rounding of tiny negative values
+        }
+        return u - length * 0.5f;
+    }
+    inline float3 wrapPosition(float x, float y, float z) const {
+        float3 wrapped = { wrapCoordinate(x, boxSize.x), wrapCoordinate(y, boxSize.y), wrapCoordinate(z, boxSize.z) };
+        return wrapped;
+    }
+
     int particleCount;
 
     KeyValuePair makeKeyValue(int cell, int idx);
 
     std::vector<KeyValuePair> cellIndexPair;
 
+    // Hashing logic used by hash and build (the hot loops are compiled for each mode)
+    HashMode hashMode;
+
+    // Key value sort settings
+    KvSortMethod sortMethod;
+    // Hash in the sorted order of the previous frame and sort stably, particles 
+    // that stay in a cell then keep their relative order from frame to frame
+    bool reusePreviousOrder;
+
 private:
+    // Radix sort scratch data
+    std::vector<KeyValuePair> cellIndexPairTemp;
+    std::vector<int> radixHistogram; // One histogram per thread
+    int radixPasses;                 // Digits needed to cover the cell IDs
+    int radixBits;                   // Bits per digit
+    bool hashedOnce;                 // cellIndexPair holds a previous frame's order
+
+    void radixSort();
+
+    // Counting sort scratch data, one cell histogram per thread, or one shared histogram when
+    // threads x cells is far above the particle count (see buildShared)
+    std::vector<uint32_t> cellHistogram;
+
+    // Incremental update data (original order), valid when slotMapValid
+    bool gridValid;                   // cellIndexPair and cellStart/cellEnd describe the last frame
+    bool slotMapValid;
+    std::vector<int> particleCell;    // Cell of each particle in cellIndexPair
+    std::vector<int> particleSlot;    // Slot of each particle in cellIndexPair
+    std::vector<KeyValuePair> movers; // Particles that changed cell (cellID is the new cell)
+
+    void swapSlots(uint32_t a, uint32_t b);
+    void moveToCell(uint32_t slot, int newCell);
+    void mergeMovers();
+
     // Contains bounds checking and reporting
-    void NNS::hashingLogicDebug(int i, std::vector<float>& locations, float xShift, float yShift, float zShift);
+    // i is the slot in cellIndexPair, idx the particle that is hashed into it
+    void hashingLogicDebug(int i, int idx, const float* locations, float xShift, float yShift, float zShift);
+    // Contains bounds checking, returns the cell
+    int hashingCellSafe(int idx, const float* locations, float xShift, float yShift, float zShift);
     // Contains bounds checking
-    void NNS::hashingLogicSafe(int i, std::vector<float>& locations, float xShift, float yShift, float zShift);
+    void hashingLogicSafe(int i, int idx, const float* locations, float xShift, float yShift, float zShift);
+    // Wraps into the periodic box, returns the cell
+    int hashingCellPeriodic(int idx, const float* locations);
+    void hashingLogicPeriodic(int i, int idx, const float* locations);
+    // Fills periodicNeighbor and periodicShift for the current cell order
+    void buildPeriodicStencil();
+    // Fills orderedNeighbor for the current (Morton or Hilbert) cell order
+    void buildOrderedStencil();
     // Contains no error handling
-    void NNS::hashingLogicFast(int i, std::vector<float>& locations, float xShift, float yShift, float zShift);
+    void hashingLogicFast(int i, int idx, const float* locations, float xShift, float yShift, float zShift);
+
+    template <HashMode Mode>
+    void hashingLogic(int i, int idx, const float* locations, float xShift, float yShift, float zShift);
+    template <HashMode Mode>
+    void hashImpl(const float* locations);
+    template <HashMode Mode>
+    void buildImpl(const float* locations, std::vector<float>& sortedLoc);
+    template <HashMode Mode>
+    void buildShared(const float* locations, std::vector<float>& sortedLoc);
+    template <bool Periodic, class Functor>
+    void forEachNeighborImpl(const float* loc, float cutoff2, Functor& f);
+    template <bool Periodic, class Functor>
+    void forEachPairImpl(const float* loc, float cutoff2, Functor& f);
 
 public:
-    void init(int count, int dimx, int dimy, int dimz, int cell, int buffer);
+    // periodicBox wraps the dimx x dimy x dimz space, the buffer is then not used
+    // Call setCellOrder after init, both rebuild the periodic stencil
+    void init(int count, int dimx, int dimy, int dimz, int cell, int buffer, bool periodicBox = false);
 
     void hash(std::vector<float>& locations);
+    void hash(const float* locations);
     int hash(float3 location);
+    // Call after init, before hashing
+    void setCellOrder(CellOrder order);
+    // Row-major cells 0 to count - 1 in the order of the curve, independent of cellOrder
+    std::vector<int> curveOrder(int count, CellOrder order) const;
+
     void kvSort();
+    void setSortMethod(KvSortMethod method, bool keepPreviousOrder = false);
     void findCellStartEnd();
     void reorder(std::vector<float>& locations, std::vector<float>& sortedLoc);
+    void reorder(const float* locations, std::vector<float>& sortedLoc);
+    void reorder(std::vector<float>& locations, Float3SoA& sortedSoA);
+    // Quantized offsets inside each particle's cell (open domains), particles in the excluded 
+    // out-of-bounds cell have no cell and are stored as 0
+    void reorder(std::vector<float>& locations, QuantizedPositions& quantized);
+
+    // Alternative to hash, kvSort and findCellStartEnd when most particles stay in their cell
+    // Only particles that changed cell are moved in cellIndexPair and only the cells between 
+    // their old and new cell are updated. Falls back to a full update above maxMoverFraction
+    // Finding the movers still hashes every particle (one parallel pass like hash), what is saved is
+    // the sort and the rewrite of cellIndexPair and cellStart/cellEnd
+    // hash, setCellOrder and init discard the grid, the next call then does a full update
+    // Particles are hashed with the bounds checks of HASH_SAFE (hashingCellSafe) whatever hashMode is,
+    // a particle leaving the grid has to land in the excluded cell, only the first full update uses hashMode
+    // Returns the number of particles that changed cell
+    int updateIncremental(std::vector<float>& locations);
+    float maxMoverFraction;
+
+    // Alternative to hash, kvSort, findCellStartEnd and reorder in one parallel counting sort
+    void build(std::vector<float>& locations, std::vector<float>& sortedLoc);
+    void build(const float* locations, std::vector<float>& sortedLoc);
+
+    // Work chunks of the cell-parallel kernels, so one thread handles all particles of a cell and the
+    // chunks balance the cost instead of the particle count. Cost of a cell is its particle count times
+    // the particles in its 27 stencil cells (the distance tests of countNeighbors)
+    // Chunk c is cells workCells[workChunks[c]] to workCells[workChunks[c + 1] - 1], in sorted order
+    // Call after findCellStartEnd (or build), chunksPerThread chunks per thread for dynamic scheduling
+    std::vector<int> workCells;      // Non-empty cells, the out-of-bounds cell included
+    std::vector<uint64_t> workCost;  // Inclusive prefix sum of the cell costs
+    std::vector<int> workChunks;
+    void buildSchedule(int threadCount, int chunksPerThread = 8);
+    // Max / mean thread cost of the cost model (1.0 is balanced) for the static particle loop and for the
+    // chunks of buildSchedule taken dynamically (each chunk goes to the thread that is free first)
+    void scheduleImbalance(int threadCount, double& particleStatic, double& cellDynamic);
+
+    // Calls f(i, j, r2, dx, dy, dz) for every particle i and each neighbor j closer than cutoff
+    // i and j are sorted indexes, r2 is the squared distance and (dx, dy, dz) = sortedLoc[j] - sortedLoc[i]
+    // (minimum image in periodic grids). Threaded over i, so f may write to data of particle i
+    // cutoff must not be larger than cellLength. Call after reorder (or build)
+    template <class Functor>
+    void forEachNeighbor(const std::vector<float>& sortedLoc, float cutoff, Functor f);
+
+    // Calls f(thread, i, j, r2, dx, dy, dz) once per unordered pair using the half stencil
+    // Threaded over cells, results added to both particles need a per-thread buffer (thread is 
+    // omp_get_thread_num()). Particles in the excluded out-of-bounds cell are skipped
+    template <class Functor>
+    void forEachPair(const std::vector<float>& sortedLoc, float cutoff, Functor f);
 
     // Printing main data strutures used in the NNS
     void printCellIndexPair(int printCount = 0);
@@ -68,6 +263,137 @@ public:
 
     int getCellCount();
     int getNonBuffCellCount();
+    // Bytes held by the dense grid (cellStart/cellEnd, the key value pairs and sort scratch data)
+    size_t memoryBytes() const;
+    // Particles in the out-of-bounds cell (cellCount - 1) after hash or build
+    int countDumped();
 };
 
+// Neighbor traversal templates, compiled with the caller's functor so it is inlined
+
+// Smallest float x with sqrtf(x) >= cutoff, so r2 < x selects exactly the pairs sqrtf(r2) < cutoff
+// does (cutoff * cutoff alone can differ just below it, where sqrtf rounds up to cutoff)
+inline float squaredCutoff(float cutoff) {
+    float cutoff2 = cutoff * cutoff;
+    while (cutoff2 > 0.0f && sqrtf(cutoff2) >= cutoff) {
+        cutoff2 = nextafterf(cutoff2, 0.0f);
+    }
+    while (sqrtf(cutoff2) < cutoff) {
+        cutoff2 = nextafterf(cutoff2, INFINITY);
+    }
+    return cutoff2;
+}
+
+template <class Functor>
+void NNS::forEachNeighbor(const std::vector<float>& sortedLoc, float cutoff, Functor f) {
+    if (periodic) {
+        forEachNeighborImpl<true>(sortedLoc.data(), squaredCutoff(cutoff), f);
+    }
+    else {
+        forEachNeighborImpl<false>(sortedLoc.data(), squaredCutoff(cutoff), f);
+    }
+}
+
+template <bool Periodic, class Functor>
+void NNS::forEachNeighborImpl(const float* loc, float cutoff2, Functor& f) {
+    int currIdx = 0;
+
+#pragma omp parallel for
+    for (currIdx = 0; currIdx < particleCount; currIdx++) {
+        float px = loc[currIdx * 3 + 0];
+        float py = loc[currIdx * 3 + 1];
+        float pz = loc[currIdx * 3 + 2];
+        int thisCell = cellIndexPair[currIdx].cellID;
+
+        for (int t = 0; t < 27; t++) {
+            int targetCell = neighborCell(thisCell, t);
+            if (targetCell >= cellCount - 1 || cellStart[targetCell] == 0xffffffff) {
+                continue; // Excluded out-of-bounds cell or empty
+            }
+
+            // Same float operations as countNeighbors, so periodic results match exactly
+            float3 shift = { 0.0f, 0.0f, 0.0f };
+            if constexpr (Periodic) {
+                shift = neighborShift(thisCell, t);
+            }
+
+            uint32_t endIndex = cellEnd[targetCell];
+            for (uint32_t checkIdx = cellStart[targetCell]; checkIdx < endIndex; checkIdx++) {
+                float dx = loc[checkIdx * 3 + 0] - px;
+                float dy = loc[checkIdx * 3 + 1] - py;
+                float dz = loc[checkIdx * 3 + 2] - pz;
+                if constexpr (Periodic) {
+                    dx += shift.x; dy += shift.y; dz += shift.z;
+                }
+                float r2 = (dx * dx) + (dy * dy) + (dz * dz);
+                if (r2 < cutoff2 && checkIdx != (uint32_t)currIdx) {
+                    f(currIdx, (int)checkIdx, r2, dx, dy, dz);
+                }
+            }
+        }
+    }
+}
+
+template <class Functor>
+void NNS::forEachPair(const std::vector<float>& sortedLoc, float cutoff, Functor f) {
+    if (periodic) {
+        forEachPairImpl<true>(sortedLoc.data(), squaredCutoff(cutoff), f);
+    }
+    else {
+        forEachPairImpl<false>(sortedLoc.data(), squaredCutoff(cutoff), f);
+    }
+}
+
+template <bool Periodic, class Functor>
+void NNS::forEachPairImpl(const float* loc, float cutoff2, Functor& f) {
+    int lastCell = cellCount - 1; // Excluded out-of-bounds cell
+
+#pragma omp parallel
+    {
+        int thread = omp_get_thread_num();
+
+        int cell = 0;
+#pragma omp for schedule(dynamic, 64)
+        for (cell = 0; cell < lastCell; cell++) {
+            uint32_t startIndex = cellStart[cell];
+            if (startIndex == 0xffffffff) {
+                continue;
+            }
+            uint32_t endIndex = cellEnd[cell];
+
+            // The cell itself (t = 13) then the forward half of the stencil
+            for (int t = 13; t < 27; t++) {
+                int targetCell = (t == 13) ? cell : neighborCell(cell, t);
+                if (targetCell >= lastCell || cellStart[targetCell] == 0xffffffff) {
+                    continue;
+                }
+                uint32_t targetEnd = cellEnd[targetCell];
+
+                float3 shift = { 0.0f, 0.0f, 0.0f };
+                if constexpr (Periodic) {
+                    shift = neighborShift(cell, t);
+                }
+
+                for (uint32_t a = startIndex; a < endIndex; a++) {
+                    float px = loc[a * 3 + 0], py = loc[a * 3 + 1], pz = loc[a * 3 + 2];
+
+                    uint32_t b = (t == 13) ? a + 1 : cellStart[targetCell];
+                    for (; b < targetEnd; b++) {
+                        float dx = loc[b * 3 + 0] - px;
+                        float dy = loc[b * 3 + 1] - py;
+                        float dz = loc[b * 3 + 2] - pz;
+                        if constexpr (Periodic) {
+                            dx += shift.x; dy += shift.y; dz += shift.z;
+                        }
+                        float r2 = (dx * dx) + (dy * dy) + (dz * dz);
+                        if (r2 < cutoff2) {
+                            f(thread, (int)a, (int)b, r2, dx, dy, dz);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
 #endif // SORT_H
\ No newline at end of file
@@ -0,0 +1,107 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef SPARSE_GRID_H
+#define SPARSE_GRID_H
+
+#include <globals.hpp>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+// Occupied cell in the hash table, key is the packed cell coordinate
+struct SparseCell {
+    uint64_t key;
+    uint32_t start;
+    uint32_t end;
+};
+
+// Grid that only stores occupied cells, in an open addressing (linear probing) hash table
+// Memory and the per-frame reset scale with the particle count, not the size of the domain
+// Cell coordinates are not bounded by a simulation space, so there is no buffer region and
+// no out-of-bounds cell. They are packed into 21 bits per axis (+-2^20 cells from the origin)
+class SparseGrid {
+public:
+    float cellLength;
+    int particleCount;
+
+    // Sorted order (by cell), same role as NNS::cellIndexPair
+    std::vector<uint64_t> sortedKey; // Cell of each sorted particle
+    std::vector<int> sortedIndex;    // Original index of each sorted particle
+
+    int occupiedCount;
+
+    static const uint64_t emptyKey = ~0ULL;
+
+    // capacity is rounded up to a power of two, at least twice the particle count
+    void init(int count, float cell);
+
+    // Hashes, counts and scatters the particles into sorted order, fills sortedLoc like NNS::reorder
+    void build(std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    // Packed key of the cell containing a point
+    uint64_t cellKey(float x, float y, float z) const;
+
+    // Range of the sorted particles in neighbor t (0 - 26) of the cell, false if it is empty
+    inline bool neighborRange(uint64_t key, int t, uint32_t& start, uint32_t& end) const {
+        return find(key + stencilDelta[t], start, end);
+    }
+
+    // Range of the sorted particles in a cell, false if it is empty
+    inline bool find(uint64_t key, uint32_t& start, uint32_t& end) const {
+        uint64_t bit = bitOf(key);
+        if (!(occupiedBits[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false; // Most probes of a sparse grid end here without touching the table
+        }
+        uint64_t slot = slotOf(key);
+        while (true) {
+            const SparseCell& cell = table[slot];
+            if (cell.key == key) {
+                start = cell.start;
+                end = cell.end;
+                return true;
+            }
+            if (cell.key == emptyKey) {
+                return false;
+            }
+            slot = (slot + 1) & tableMask;
+        }
+    }
+
+    // Bytes held by the grid (table, sorted order and scratch data)
+    size_t memoryBytes() const;
+
+private:
+    std::vector<SparseCell> table;
+    uint64_t tableMask;
+    int tableBits;
+
+    uint64_t stencilDelta[27];          // Key offsets of the 27 neighbor cells, t = 13 is the cell itself
+
+    std::vector<uint64_t> particleKey;  // Cell of each particle (original order)
+    std::vector<uint32_t> particleSlot; // Table slot of each particle (original order)
+    std::vector<uint32_t> occupiedSlots;
+    // (key relative to the occupied bounding box, slot) sorted by key, and radix sort scratch data
+    std::vector<std::pair<uint64_t, uint32_t>> occupiedOrder;
+    std::vector<std::pair<uint64_t, uint32_t>> occupiedOrderTemp;
+    std::vector<uint32_t> radixHistogram;
+
+    // One bit per 1/8 slot, set for occupied cells (with false positives), small enough to stay in cache
+    std::vector<uint64_t> occupiedBits;
+
+    // Runs of 4 cells along x hash together and take consecutive slots, so the x neighbors
+    // of a cell are usually in the same cache line (Fibonacci hashing for the run)
+    inline uint64_t slotOf(uint64_t key) const {
+        return ((((key & ~3ULL) * 0x9E3779B97F4A7C15ULL) >> (64 - tableBits)) + (key & 3)) & tableMask;
+    }
+    inline uint64_t bitOf(uint64_t key) const {
+        return ((((key & ~3ULL) * 0x9E3779B97F4A7C15ULL) >> (64 - tableBits - 3)) + (key & 3)) & bitMask;
+    }
+    uint64_t bitMask;
+    uint32_t insert(uint64_t key);
+    void sortOccupiedCells();
+};
+
+#endif // SPARSE_GRID_H
@@ -0,0 +1,99 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef SUBCELL_GRID_H
+#define SUBCELL_GRID_H
+
+#include <globals.hpp>
+#include <timer.hpp>
+#include <vector>
+#include <cstdint>
+
+// Grid with cells a fraction of the cutoff (cellWidth = cutoff / divisions), unlike NNS where
+// cellLength is both. The 27 cell stencil of NNS covers 27 r^3 for a 4.19 r^3 sphere, smaller cells
+// with a stencil of only the cells that can hold a point within the cutoff waste fewer distance tests:
+// 1 division 27 cells (27 r^3), 2 divisions 125 cells (15.6 r^3), 3 divisions 311 of 343 cells (11.5 r^3)
+// The grid spans the bounding box of the particles at each build, with `divisions` empty cells of
+// padding around it so the stencil never leaves the grid. No buffer region and no out-of-bounds cell
+class SubcellGrid {
+public:
+    float cutoff;
+    int divisions;
+    float cellWidth;
+    int particleCount;
+
+    // Padded grid size in cells
+    int cellDimx;
+    int cellDimy;
+    int cellDimz;
+    int cellCount;
+
+    // Particles of row-major cell c are sorted indexes cellOffsets[c] to cellOffsets[c + 1] - 1
+    std::vector<uint32_t> cellOffsets;
+    std::vector<int> sortedCell;  // Cell of each sorted particle
+    std::vector<int> sortedIndex; // Original index of each sorted particle
+
+    // Row-major offsets of the cells whose closest point to the center cell is within the cutoff
+    std::vector<int> stencil;
+
+    // Autotuning, see autotune
+    int autotuneInterval; // Frames between autotune runs, 0 tunes only once
+    int framesSinceTune;
+    std::vector<double> tuneTimes; // Time per frame of each candidate at the last autotune
+
+    void init(int count, float cutoffDist, int cellDivisions = 1);
+    // Regenerates the stencil, takes effect at the next build
+    void setDivisions(int cellDivisions);
+
+    // Bounding box, counting sort into cells and scatter, fills sortedLoc like NNS::reorder
+    void build(std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    // Runs frame() reps times for each candidate division count (after one warm up run) and keeps
+    // the fastest. frame should build the grid and run the interaction kernel, so the choice fits
+    // the current distribution and kernel. Returns the chosen division count
+    template <class Frame>
+    int autotune(const std::vector<int>& candidates, int reps, Frame frame);
+
+    // True when autotune is due (first frame and then every autotuneInterval frames), counts the frame
+    bool tuneDue();
+
+    // Bytes held by the grid
+    size_t memoryBytes() const;
+
+private:
+    std::vector<int> particleCell;       // Cell of each particle (original order)
+    std::vector<uint32_t> cellCursor;    // Scatter cursor of each cell
+    bool tuned;
+};
+
+template <class Frame>
+int SubcellGrid::autotune(const std::vector<int>& candidates, int reps, Frame frame) {
+    int best = divisions;
+    double bestTime = 0.0;
+    tuneTimes.assign(candidates.size(), 0.0);
+
+    for (size_t c = 0; c < candidates.size(); c++) {
+        setDivisions(candidates[c]);
+        frame(); // Warm up, sizes the grid for this cell width
+
+        double t = wallTime();
+        for (int r = 0; r < reps; r++) {
+            frame();
+        }
+        tuneTimes[c] = (wallTime() - t) / reps;
+
+        if (c == 0 || tuneTimes[c] < bestTime) {
+            bestTime = tuneTimes[c];
+            best = candidates[c];
+        }
+    }
+
+    setDivisions(best);
+    framesSinceTune = 0;
+    tuned = true;
+    return best;
+}
+
+#endif // SUBCELL_GRID_H
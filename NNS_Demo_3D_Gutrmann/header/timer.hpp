@@ -0,0 +1,17 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+
+// Wall clock time in seconds
+// clock() measures CPU time summed over all OpenMP threads, so it can't be used for speedups
+inline double wallTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif // TIMER_H
@@ -0,0 +1,122 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <timer.hpp>
+#include <omp.h>
+#include <vector>
+#include <cstddef>
+#include <cstdio>
+#include <type_traits>
+
+// Logical CPUs this process may run on, with their core, package and NUMA node read from
+// /sys/devices/system (Linux). Elsewhere, or without sysfs, every logical CPU counts as a core
+struct CpuTopology {
+    struct Cpu {
+        int id;      // Logical CPU number
+        int core;    // Physical core, unique over the packages
+        int package;
+        int node;    // NUMA node
+        int sibling; // 0 for the first hardware thread of its core
+    };
+    std::vector<Cpu> cpus; // Sorted by node, package, core, sibling
+    int coreCount;
+    int packageCount;
+    int nodeCount;
+
+    void detect();
+    void print();
+
+    // Logical CPUs for threadCount threads, thread t goes to the t'th entry
+    // Without smt one thread per core first (siblings only past coreCount threads),
+    // with smt the siblings of a core are next to each other so cores fill up one at a time
+    std::vector<int> placement(int threadCount, bool smt) const;
+};
+
+// Thread count and placement chosen by autotuneThreads
+struct ThreadSetting {
+    int threads;
+    bool smt;
+};
+
+// Sets the OpenMP thread count and, if pin, binds thread t of the following parallel regions to
+// topology.placement(threads, smt)[t]. Pinning is skipped when OMP_PROC_BIND or OMP_PLACES is set,
+// the OpenMP runtime then places the threads. Returns true if the threads were pinned
+bool applyThreads(const CpuTopology& topology, ThreadSetting setting, bool pin);
+// Lets the threads of the current team run on every CPU of topology again. Needed before nested
+// parallel regions (FramePipeline), whose threads would inherit the single CPU of their parent
+void unpinThreads(const CpuTopology& topology);
+
+// Runs frame() reps times (after a warm up run) for each candidate, one thread per core at
+// 1/4, 1/2 and all cores, and all cores with their SMT siblings, then applies the fastest
+// frame should run the work the threads are chosen for (grid build and interaction kernel)
+template <class Frame>
+ThreadSetting autotuneThreads(const CpuTopology& topology, bool pin, int reps, Frame frame);
+
+// Drops the pages of the vector (its contents become zero) and rewrites them with a static
+// parallel loop, so each page is first touched, and placed on the NUMA node of, the thread whose
+// static share of the elements it holds. The kernels loop over particles and cells with the same
+// static split. Only for data that is about to be overwritten, T must be trivially copyable
+void releasePages(void* data, size_t bytes);
+
+template <class T>
+void firstTouch(std::vector<T>& v) {
+    static_assert(std::is_trivially_copyable<T>::value, "firstTouch zeroes the elements");
+    releasePages(v.data(), v.size() * sizeof(T));
+
+    long long count = (long long)v.size();
+    T* data = v.data();
+    long long i = 0;
+#pragma omp parallel for schedule(static)
+    for (i = 0; i < count; i++) {
+        data[i] = T();
+    }
+}
+
+template <class Frame>
+ThreadSetting autotuneThreads(const CpuTopology& topology, bool pin, int reps, Frame frame) {
+    int cores = topology.coreCount;
+    int logical = (int)topology.cpus.size();
+
+    std::vector<ThreadSetting> candidates;
+    for (int divisor : { 4, 2, 1 }) {
+        int threads = cores / divisor;
+        if (threads > 0 && (candidates.empty() || candidates.back().threads != threads)) {
+            candidates.push_back({ threads, false });
+        }
+    }
+    if (logical > cores) {
+        candidates.push_back({ cores, true });    // Half the cores with both siblings
+        candidates.push_back({ logical, true });
+    }
+
+    ThreadSetting best = candidates.back();
+    double bestTime = 0.0;
+    printf("Thread autotune, %d reps per setting\n", reps);
+    for (size_t c = 0; c < candidates.size(); c++) {
+        applyThreads(topology, candidates[c], pin);
+        frame(); // Warm up
+
+        double t = wallTime();
+        for (int r = 0; r < reps; r++) {
+            frame();
+        }
+        double time = (wallTime() - t) / reps;
+        printf("  %3d threads%s: %.3f ms per frame\n", candidates[c].threads, candidates[c].smt ? " (SMT)" : "", time * 1000.0);
+
+        if (c == 0 || time < bestTime) {
+            bestTime = time;
+            best = candidates[c];
+        }
+    }
+
+    applyThreads(topology, best, pin);
+    printf("  Using %d threads%s\n\n", best.threads, best.smt ? " (SMT)" : "");
+    return best;
+}
+
+#endif // TOPOLOGY_H
@@ -0,0 +1,116 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <sort.hpp>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+
+// Binary trajectory file, little endian:
+// 64 byte header, then frameCount frames of particleCount * 3 floats (frameBytes each)
+// A snapshot is a trajectory with one frame
+// The neighbor count output uses the same header (magic "NNSCNT01", layout TRAJ_LAYOUT_COUNTS)
+// followed by particleCount int32 counts per frame in original particle order
+enum TrajectoryLayout {
+    TRAJ_LAYOUT_XYZ = 0,   // x y z per particle, the layout of Particle::locations, hashed in place
+    TRAJ_LAYOUT_SOA = 1,   // All x, then all y, then all z, interleaved into a staging frame on read
+    TRAJ_LAYOUT_COUNTS = 2
+};
+
+struct TrajectoryHeader {
+    char magic[8];          // "NNSTRAJ1"
+    uint32_t version;
+    uint32_t layout;        // TrajectoryLayout
+    uint64_t particleCount;
+    uint64_t frameCount;
+    uint64_t frameBytes;
+    float box[3];           // Simulation space, positions are in -box / 2 to box / 2
+    uint32_t reserved[3];
+};
+static_assert(sizeof(TrajectoryHeader) == 64, "trajectory header must be 64 bytes");
+
+// Read only view of a trajectory file. Each frame is mapped on its own (POSIX mmap, fread on Windows),
+// so memory stays at about two frames however long the file is. frame() of an xyz file returns a pointer
+// into the mapping that can go straight to NNS::hash and NNS::reorder
+class TrajectoryReader {
+public:
+    TrajectoryHeader header;
+
+    TrajectoryReader();
+    ~TrajectoryReader();
+
+    bool open(const char* path);
+    void close();
+
+    int particleCount() const { return (int)header.particleCount; }
+    int frameCount() const { return (int)header.frameCount; }
+
+    // Positions (x y z per particle) of frame f, valid until the next call to frame or close
+    const float* frame(int f);
+    // Starts reading frame f in the background (madvise WILLNEED on its mapping), call after
+    // frame() of the current frame and before searching it
+    void prefetch(int f);
+
+private:
+    struct Window {
+        int frame;
+        void* base;     // Page aligned start of the mapping
+        size_t length;
+        const float* data;
+    };
+
+    bool mapFrame(int f, Window& w);
+    void unmap(Window& w);
+
+    Window current;
+    Window next;
+    std::vector<float> staging; // Interleaved SoA frames
+#ifdef _WIN32
+    FILE* file;
+    std::vector<float> readBuffer;
+#else
+    int fd;
+    size_t pageSize;
+#endif
+};
+
+// Sequential writer for trajectory and neighbor count files, the frame count
+// in the header is written by close
+class TrajectoryWriter {
+public:
+    TrajectoryWriter();
+    ~TrajectoryWriter();
+
+    bool open(const char* path, int particleCount, float boxx, float boxy, float boxz, TrajectoryLayout layout = TRAJ_LAYOUT_XYZ);
+    bool openCounts(const char* path, int particleCount);
+    // locations are x y z per particle like Particle::locations, SoA files are transposed on write
+    bool writeFrame(const float* locations);
+    bool writeCounts(const std::vector<int>& counts);
+    bool close();
+
+private:
+    bool writeHeader();
+
+    FILE* file;
+    TrajectoryHeader header;
+    std::vector<float> transposed;
+};
+
+// Streaming driver: hash, kvSort, findCellStartEnd, reorder and countNeighbors on every frame of the
+// trajectory at path, prefetching the next frame while the current one is searched. The grid covers
+// the header's box. Neighbor counts of each frame go to countsPath when it is not null
+// pipelined overlaps the build of the next frame with the kernel of the current one (FramePipeline)
+// Returns false if a file could not be opened or read
+bool streamTrajectory(const char* path, const char* countsPath, int cellSize, int gridBuffer, HashMode hashMode,
+    bool pipelined = false);
+
+// Writes frameCount frames of particleCount random particles moving by up to maxStep per frame
+bool writeRandomTrajectory(const char* path, int particleCount, int dimx, int dimy, int dimz, int frameCount,
+    float maxStep, TrajectoryLayout layout = TRAJ_LAYOUT_XYZ);
+
+#endif // TRAJECTORY_H
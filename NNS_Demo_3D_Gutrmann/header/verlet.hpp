@@ -0,0 +1,41 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#ifndef VERLET_H
+#define VERLET_H
+
+#include <listSkin.hpp>
+#include <vector>
+
+// Verlet neighbor lists built from the NNS grid with cutoff + skin and reused across frames
+// The lists are rebuilt once a particle has moved more than skin / 2 since the last build (see ListSkin)
+// Open domains only, there is no minimum image in the lists or the displacements (see build)
+class VerletList : public ListSkin {
+public:
+    float cutoff;
+    int particleCount;
+
+    // CSR lists in sorted order (NNS::cellIndexPair at the last build), 
+    // neighbors of sorted particle i are neighbors[offsets[i]] to neighbors[offsets[i + 1] - 1]
+    std::vector<int> offsets;
+    std::vector<int> neighbors;
+
+    void init(int count, float cutoffDist, float skinDist);
+
+    // Rebuilds the grid and the lists if needed, otherwise only gathers the new positions 
+    // into sortedLoc using the previous order. Returns true if the lists were rebuilt
+    bool update(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    // Builds the lists from the current grid (hash, kvSort, findCellStartEnd, reorder done)
+    // A periodic grid (NNS::periodic) is reported as an error and gives empty lists
+    void build(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc);
+
+    // Same result as Particle::countNeighbors using the lists
+    void countNeighbors(NNS& sort, std::vector<float>& sortedLoc, std::vector<int>& neighborCount);
+
+    void printStats();
+};
+
+#endif // VERLET_H
@@ -0,0 +1,170 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <adaptiveGrid.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+void AdaptiveGrid::init(int count, int dimx, int dimy, int dimz, int cell, int buffer) {
+	coarse.init(count, dimx, dimy, dimz, cell, buffer);
+
+	denseThreshold = 32;
+	targetPerSubcell = 4.0f;
+	maxSplit = 4;
+	minDenseFraction = 0.1f;
+
+	occupiedCells = 0;
+	maxOccupancy = 0;
+	meanOccupancy = 0.0f;
+	denseFraction = 0.0f;
+	refined = false;
+	splitCells = 0;
+
+	splitIndex.assign(coarse.cellCount, -1);
+}
+
+void AdaptiveGrid::computeStatistics() {
+	int lastCell = coarse.cellCount - 1; // Excluded out-of-bounds cell
+	int occupied = 0, maxCount = 0;
+	long long denseParticles = 0;
+
+	int cell = 0;
+#pragma omp parallel for reduction(+:occupied, denseParticles) reduction(max:maxCount)
+	for (cell = 0; cell < lastCell; cell++) {
+		if (coarse.cellStart[cell] == 0xffffffff) {
+			continue;
+		}
+		int count = (int)(coarse.cellEnd[cell] - coarse.cellStart[cell]);
+		++occupied;
+		maxCount = std::max(maxCount, count);
+		if (count > denseThreshold) {
+			denseParticles += count;
+		}
+	}
+
+	occupiedCells = occupied;
+	maxOccupancy = maxCount;
+	meanOccupancy = occupied ? (coarse.particleCount - coarse.countDumped()) / (float)occupied : 0.0f;
+	denseFraction = coarse.particleCount ? denseParticles / (float)coarse.particleCount : 0.0f;
+}
+
+// 1. Choose the split of each dense cell and lay out its subcell offsets (serial, cells only)
+// 2. Counting sort of each split cell's range by subcell, threaded over the split cells
+void AdaptiveGrid::refine(std::vector<float>& sortedLoc) {
+	int lastCell = coarse.cellCount - 1;
+	float cellLength = (float)coarse.cellLength;
+	float xShift = coarse.simDimx_buffered / 2.0f;
+	float yShift = coarse.simDimy_buffered / 2.0f;
+	float zShift = coarse.simDimz_buffered / 2.0f;
+
+	// 1.
+	splitCount.clear();
+	splitOrigin.clear();
+	subBase.clear();
+	int offsetCount = 0;
+	for (int cell = 0; cell < lastCell; cell++) {
+		uint32_t start = coarse.cellStart[cell];
+		if (start == 0xffffffff || (int)(coarse.cellEnd[cell] - start) <= denseThreshold) {
+			continue;
+		}
+		int count = (int)(coarse.cellEnd[cell] - start);
+		int split = (int)lroundf(cbrtf(count / targetPerSubcell));
+		split = std::min(std::max(split, 2), std::min(maxSplit, 8));
+
+		// All particles of the cell share its corner, take it from the first one like hash does
+		int cx = (int)(sortedLoc[start * 3 + 0] + xShift) / coarse.cellLength;
+		int cy = (int)(sortedLoc[start * 3 + 1] + yShift) / coarse.cellLength;
+		int cz = (int)(sortedLoc[start * 3 + 2] + zShift) / coarse.cellLength;
+
+		splitIndex[cell] = (int)splitCount.size();
+		splitCell.push_back(cell);
+		splitCount.push_back(split);
+		splitOrigin.push_back(make_float3(cx * cellLength - xShift, cy * cellLength - yShift, cz * cellLength - zShift));
+		subBase.push_back(offsetCount);
+		offsetCount += split * split * split + 1;
+	}
+	splitCells = (int)splitCount.size();
+	subOffsets.resize(offsetCount);
+
+	// 2.
+#pragma omp parallel
+	{
+		std::vector<int> subOf;
+		std::vector<KeyValuePair> pairTemp;
+		std::vector<float> locTemp;
+		std::vector<uint32_t> cursor;
+
+		int s = 0;
+#pragma omp for schedule(dynamic, 1)
+		for (s = 0; s < splitCells; s++) {
+			int cell = splitCell[s];
+			uint32_t start = coarse.cellStart[cell];
+			int count = (int)(coarse.cellEnd[cell] - start);
+			int split = splitCount[s];
+			int subCount = split * split * split;
+			float3 origin = splitOrigin[s];
+			float scale = split / cellLength;
+			uint32_t* offsets = &subOffsets[subBase[s]];
+
+			subOf.resize(count);
+			std::fill(offsets, offsets + subCount + 1, 0);
+			for (int p = 0; p < count; p++) {
+				const float* loc = &sortedLoc[(start + p) * 3];
+				int sx = std::min(std::max((int)((loc[0] - origin.x) * scale), 0), split - 1);
+				int sy = std::min(std::max((int)((loc[1] - origin.y) * scale), 0), split - 1);
+				int sz = std::min(std::max((int)((loc[2] - origin.z) * scale), 0), split - 1);
+				subOf[p] = sx + sy * split + sz * split * split;
+				++offsets[subOf[p] + 1];
+			}
+			offsets[0] = start;
+			for (int k = 0; k < subCount; k++) {
+				offsets[k + 1] += offsets[k];
+			}
+
+			// Stable scatter through a copy of the range
+			pairTemp.assign(coarse.cellIndexPair.begin() + start, coarse.cellIndexPair.begin() + start + count);
+			locTemp.assign(sortedLoc.begin() + start * 3, sortedLoc.begin() + (start + count) * 3);
+			cursor.assign(offsets, offsets + subCount);
+			for (int p = 0; p < count; p++) {
+				uint32_t dst = cursor[subOf[p]]++;
+				coarse.cellIndexPair[dst] = pairTemp[p];
+				sortedLoc[dst * 3 + 0] = locTemp[p * 3 + 0];
+				sortedLoc[dst * 3 + 1] = locTemp[p * 3 + 1];
+				sortedLoc[dst * 3 + 2] = locTemp[p * 3 + 2];
+			}
+		}
+	}
+}
+
+void AdaptiveGrid::build(std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	// Only the cells split last frame need clearing
+	for (int cell : splitCell) {
+		splitIndex[cell] = -1;
+	}
+	splitCell.clear();
+
+	coarse.build(locations, sortedLoc);
+	computeStatistics();
+
+	refined = (denseFraction >= minDenseFraction) && (maxOccupancy > denseThreshold);
+	if (refined) {
+		refine(sortedLoc);
+	}
+	else {
+		splitCells = 0;
+		splitCount.clear();
+		splitOrigin.clear();
+		subBase.clear();
+		subOffsets.clear();
+	}
+}
+
+void AdaptiveGrid::printStats() {
+	printf("Adaptive grid: %d occupied cells, mean %.1f, max %d particles, %.1f%% of particles in cells above %d, %s (%d split cells)\n",
+		occupiedCells, meanOccupancy, maxOccupancy, denseFraction * 100.0f, denseThreshold,
+		refined ? "refined" : "uniform", splitCells);
+}
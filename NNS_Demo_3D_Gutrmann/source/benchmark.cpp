@@ -0,0 +1,746 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <benchmark.hpp>
+#include <globals.hpp>
+#include <sort.hpp>
+#include <particle.hpp>
+#include <sparseGrid.hpp>
+#include <knn.hpp>
+#include <subcellGrid.hpp>
+#include <adaptiveGrid.hpp>
+#include <particleStore.hpp>
+#include <clusterPairs.hpp>
+#include <omp.h>
+#include <algorithm>
+
+struct StageTimes {
+	double hash;
+	double kvSort;
+	double findCellStartEnd;
+	double reorder;
+};
+
+static StageTimes timeStages(NNS& sortObject, Particle& partObject, int iterations) {
+	StageTimes times = { 0.0, 0.0, 0.0, 0.0 };
+
+	for (int i = 0; i < iterations; i++) {
+		double t0 = omp_get_wtime();
+		sortObject.hash(partObject.locations);
+		double t1 = omp_get_wtime();
+		sortObject.kvSort();
+		double t2 = omp_get_wtime();
+		sortObject.findCellStartEnd();
+		double t3 = omp_get_wtime();
+		sortObject.reorder(partObject.locations, partObject.sortedLoc);
+		double t4 = omp_get_wtime();
+
+		times.hash += t1 - t0;
+		times.kvSort += t2 - t1;
+		times.findCellStartEnd += t3 - t2;
+		times.reorder += t4 - t3;
+	}
+
+	// Report milliseconds per iteration
+	times.hash *= 1000.0 / iterations;
+	times.kvSort *= 1000.0 / iterations;
+	times.findCellStartEnd *= 1000.0 / iterations;
+	times.reorder *= 1000.0 / iterations;
+	return times;
+}
+
+void benchmarkKvSort(int cellSize, int gridBuffer) {
+	const int sideCount = 4;
+	const int sides[sideCount] = { 60, 120, 240, 480 };
+
+	printf("kvSort benchmark, wall time in ms per iteration (threads %d)\n", omp_get_max_threads());
+	printf("%10s %-12s %9s %9s %9s %9s %9s\n", "particles", "sort", "hash", "kvSort", "startEnd", "reorder", "total");
+
+	for (int s = 0; s < sideCount; s++) {
+		int side = sides[s];
+		int particleCount = 3600 * (side / 60) * (side / 60) * (side / 60);
+		int iterations = std::max(5, 1000 / ((side / 60) * (side / 60) * (side / 60)));
+
+		Particle partObject;
+		partObject.init(particleCount, side, side, side);
+
+		for (int m = 0; m < 3; m++) {
+			NNS sortObject;
+			sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+
+			const char* name = "std::sort";
+			if (m == 0) {
+				sortObject.setSortMethod(KV_SORT_STD);
+			}
+			else if (m == 1) {
+				sortObject.setSortMethod(KV_SORT_RADIX);
+				name = "radix";
+			}
+			else {
+				// Stable radix with input in the previous frame's order
+				sortObject.setSortMethod(KV_SORT_RADIX, true);
+				name = "radix prev";
+			}
+
+			// Warm up, also gives the previous-order mode a previous frame
+			timeStages(sortObject, partObject, 1);
+			StageTimes times = timeStages(sortObject, partObject, iterations);
+
+			printf("%10d %-12s %9.3f %9.3f %9.3f %9.3f %9.3f\n", particleCount, name,
+				times.hash, times.kvSort, times.findCellStartEnd, times.reorder,
+				times.hash + times.kvSort + times.findCellStartEnd + times.reorder);
+		}
+
+		// Fused counting sort, all four stages in one call
+		{
+			NNS sortObject;
+			sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+			sortObject.build(partObject.locations, partObject.sortedLoc);
+
+			double t = omp_get_wtime();
+			for (int i = 0; i < iterations; i++) {
+				sortObject.build(partObject.locations, partObject.sortedLoc);
+			}
+			t = (omp_get_wtime() - t) * 1000.0 / iterations;
+
+			printf("%10d %-12s %9s %9s %9s %9s %9.3f\n", particleCount, "build", "-", "-", "-", "-", t);
+		}
+	}
+	printf("\n");
+}
+
+void benchmarkCellOrder(int cellSize, int gridBuffer) {
+	const int sideCount = 3;
+	const int sides[sideCount] = { 120, 240, 480 };
+	const char* names[3] = { "row-major", "morton", "hilbert" };
+
+	printf("Cell order benchmark, wall time in ms per iteration (threads %d)\n", omp_get_max_threads());
+	printf("%10s %10s %-10s %9s %9s %9s %9s\n", "particles", "cells", "order", "build", "count", "SIMD", "symmetric");
+
+	for (int s = 0; s < sideCount; s++) {
+		int side = sides[s];
+		int particleCount = 3600 * (side / 60) * (side / 60) * (side / 60);
+		int iterations = std::max(3, 200 / ((side / 60) * (side / 60) * (side / 60)));
+
+		Particle partObject;
+		partObject.init(particleCount, side, side, side);
+
+		for (int o = 0; o < 3; o++) {
+			NNS sortObject;
+			sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+			sortObject.setCellOrder((CellOrder)o);
+
+			double buildTime = 0.0, countTime = 0.0, simdTime = 0.0, symmetricTime = 0.0;
+			for (int i = 0; i <= iterations; i++) {
+				double t0 = omp_get_wtime();
+				sortObject.hash(partObject.locations);
+				sortObject.kvSort();
+				sortObject.findCellStartEnd();
+				sortObject.reorder(partObject.locations, partObject.sortedLoc);
+				sortObject.reorder(partObject.locations, partObject.sortedSoA);
+				double t1 = omp_get_wtime();
+				partObject.countNeighbors(sortObject);
+				double t2 = omp_get_wtime();
+				partObject.countNeighborsSIMD(sortObject);
+				double t3 = omp_get_wtime();
+				partObject.countNeighborsSymmetric(sortObject);
+				double t4 = omp_get_wtime();
+
+				// First iteration is a warm up
+				if (i > 0) {
+					buildTime += t1 - t0;
+					countTime += t2 - t1;
+					simdTime += t3 - t2;
+					symmetricTime += t4 - t3;
+				}
+			}
+
+			double scale = 1000.0 / iterations;
+			printf("%10d %10d %-10s %9.3f %9.3f %9.3f %9.3f\n", particleCount, sortObject.getCellCount(), names[o],
+				buildTime * scale, countTime * scale, simdTime * scale, symmetricTime * scale);
+		}
+	}
+	printf("\n");
+}
+
+void benchmarkSparseGrid(int cellSize, int gridBuffer) {
+	const int sideCount = 4;
+	const int sides[sideCount] = { 120, 240, 480, 960 };
+	const int particleCount = 28800;
+	const int iterations = 50;
+
+	printf("Sparse grid benchmark, %d particles, wall time in ms per iteration (threads %d)\n", particleCount, omp_get_max_threads());
+	printf("%6s %10s %-7s %10s %9s %9s %9s %6s\n", "side", "cells", "grid", "memory MB", "build", "count", "total", "match");
+
+	for (int s = 0; s < sideCount; s++) {
+		int side = sides[s];
+
+		Particle partObject;
+		partObject.init(particleCount, side, side, side);
+
+		// Dense grid
+		NNS sortObject;
+		sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+		double denseBuild = 0.0, denseCount = 0.0;
+		for (int i = 0; i <= iterations; i++) {
+			double t0 = omp_get_wtime();
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedLoc);
+			double t1 = omp_get_wtime();
+			partObject.countNeighbors(sortObject);
+			double t2 = omp_get_wtime();
+
+			// First iteration is a warm up
+			if (i > 0) {
+				denseBuild += t1 - t0;
+				denseCount += t2 - t1;
+			}
+		}
+		std::vector<int> denseResult = partObject.neighborCount;
+
+		// Sparse grid
+		SparseGrid grid;
+		grid.init(particleCount, (float)cellSize);
+		double sparseBuild = 0.0, sparseCount = 0.0;
+		for (int i = 0; i <= iterations; i++) {
+			double t0 = omp_get_wtime();
+			grid.build(partObject.locations, partObject.sortedLoc);
+			double t1 = omp_get_wtime();
+			partObject.countNeighbors(grid);
+			double t2 = omp_get_wtime();
+
+			if (i > 0) {
+				sparseBuild += t1 - t0;
+				sparseCount += t2 - t1;
+			}
+		}
+		bool match = (denseResult == partObject.neighborCount);
+
+		double scale = 1000.0 / iterations;
+		printf("%6d %10d %-7s %10.2f %9.3f %9.3f %9.3f %6s\n", side, sortObject.getCellCount(), "dense",
+			sortObject.memoryBytes() / (1024.0 * 1024.0), denseBuild * scale, denseCount * scale, (denseBuild + denseCount) * scale, "-");
+		printf("%6d %10d %-7s %10.2f %9.3f %9.3f %9.3f %6s\n", side, grid.occupiedCount, "sparse",
+			grid.memoryBytes() / (1024.0 * 1024.0), sparseBuild * scale, sparseCount * scale, (sparseBuild + sparseCount) * scale, match ? "yes" : "NO");
+	}
+	printf("\n");
+}
+
+void benchmarkKnn(int cellSize, int gridBuffer) {
+	const int sideCount = 2;
+	const int sides[sideCount] = { 60, 120 };
+	const int kCount = 3;
+	const int ks[kCount] = { 8, 32, 64 };
+	const int iterations = 5;
+
+	printf("kNN benchmark, wall time in ms per query batch, brute force is run once with k = %d (threads %d)\n",
+		ks[kCount - 1], omp_get_max_threads());
+	printf("%10s %4s %9s %9s %12s %9s %6s\n", "particles", "k", "grid", "points", "cells/query", "brute", "match");
+
+	for (int s = 0; s < sideCount; s++) {
+		int side = sides[s];
+		int particleCount = 3600 * (side / 60) * (side / 60) * (side / 60);
+
+		Particle partObject;
+		partObject.init(particleCount, side, side, side);
+
+		NNS sortObject;
+		sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+		sortObject.hash(partObject.locations);
+		sortObject.kvSort();
+		sortObject.findCellStartEnd();
+		sortObject.reorder(partObject.locations, partObject.sortedLoc);
+
+		// Query points that are not particles, same distribution
+		Particle probes;
+		probes.init(particleCount, side, side, side);
+
+		// Brute force once with the largest k, the smaller k are prefixes of its rows
+		KNearest brute;
+		brute.init(ks[kCount - 1]);
+		double bruteTime = omp_get_wtime();
+		brute.queryParticlesBruteForce(partObject.locations);
+		bruteTime = (omp_get_wtime() - bruteTime) * 1000.0;
+
+		for (int q = 0; q < kCount; q++) {
+			KNearest knn;
+			knn.init(ks[q]);
+
+			double gridTime = 0.0, pointTime = 0.0;
+			for (int i = 0; i <= iterations; i++) {
+				double t0 = omp_get_wtime();
+				knn.queryPoints(sortObject, partObject.sortedLoc, probes.locations);
+				double t1 = omp_get_wtime();
+				knn.queryParticles(sortObject, partObject.sortedLoc);
+				double t2 = omp_get_wtime();
+
+				// First iteration is a warm up
+				if (i > 0) {
+					pointTime += t1 - t0;
+					gridTime += t2 - t1;
+				}
+			}
+			double cellsPerQuery = knn.cellsVisited / (double)particleCount;
+
+			// Distances are compared, the order of equally distant neighbors can differ
+			bool match = true;
+			for (int p = 0; p < particleCount && match; p++) {
+				match = std::equal(knn.distances.begin() + (size_t)p * ks[q], knn.distances.begin() + (size_t)(p + 1) * ks[q],
+					brute.distances.begin() + (size_t)p * brute.k);
+			}
+
+			printf("%10d %4d %9.3f %9.3f %12.1f %9.3f %6s\n", particleCount, ks[q], gridTime * 1000.0 / iterations,
+				pointTime * 1000.0 / iterations, cellsPerQuery, bruteTime, match ? "yes" : "NO");
+		}
+	}
+	printf("\n");
+}
+
+void benchmarkSubcellGrid(int cellSize, int gridBuffer) {
+	const int side = 60;
+	const int densityCount = 4;
+	const int particleCounts[densityCount] = { 3600, 14400, 57600, 230400 };
+	const int iterations = 20;
+	const std::vector<int> candidates = { 1, 2, 3 };
+
+	printf("Subcell grid benchmark, %d^3 space, cutoff %d, wall time in ms per iteration (threads %d)\n", side, cellSize, omp_get_max_threads());
+	printf("%10s %9s %8s %9s %9s %9s %6s\n", "particles", "divisions", "stencil", "build", "count", "total", "match");
+
+	for (int p = 0; p < densityCount; p++) {
+		int particleCount = particleCounts[p];
+
+		Particle partObject;
+		partObject.init(particleCount, side, side, side);
+
+		// Reference counts from the dense grid
+		NNS sortObject;
+		sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+		sortObject.build(partObject.locations, partObject.sortedLoc);
+		partObject.countNeighbors(sortObject);
+		std::vector<int> reference = partObject.neighborCount;
+
+		SubcellGrid grid;
+		grid.init(particleCount, (float)cellSize);
+
+		for (int d : candidates) {
+			grid.setDivisions(d);
+			double build = 0.0, count = 0.0;
+			for (int i = 0; i <= iterations; i++) {
+				double t0 = omp_get_wtime();
+				grid.build(partObject.locations, partObject.sortedLoc);
+				double t1 = omp_get_wtime();
+				partObject.countNeighbors(grid);
+				double t2 = omp_get_wtime();
+
+				// First iteration is a warm up
+				if (i > 0) {
+					build += t1 - t0;
+					count += t2 - t1;
+				}
+			}
+			bool match = (partObject.neighborCount == reference);
+
+			double scale = 1000.0 / iterations;
+			printf("%10d %9d %8d %9.3f %9.3f %9.3f %6s\n", particleCount, d, (int)grid.stencil.size(),
+				build * scale, count * scale, (build + count) * scale, match ? "yes" : "NO");
+		}
+
+		int chosen = grid.autotune(candidates, 5, [&]() {
+			grid.build(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighbors(grid);
+		});
+		printf("%10d autotune picks %d divisions\n", particleCount, chosen);
+	}
+	printf("\n");
+}
+
+void benchmarkAdaptiveGrid(int cellSize, int gridBuffer) {
+	const int side = 120;
+	const int sizeCount = 2;
+	const int particleCounts[sizeCount] = { 28800, 230400 };
+	const int clusterCount = 20;
+	const float spread = 4.0f;
+	const int iterations = 10;
+
+	printf("Adaptive grid benchmark, %d^3 space, clustered is %d Gaussian blobs of spread %.1f, wall time in ms per iteration (threads %d)\n",
+		side, clusterCount, spread, omp_get_max_threads());
+	printf("%10s %-9s %-8s %9s %9s %9s %6s\n", "particles", "workload", "grid", "build", "count", "total", "match");
+
+	for (int n = 0; n < sizeCount; n++) {
+		for (int clustered = 0; clustered < 2; clustered++) {
+			int particleCount = particleCounts[n];
+			const char* workload = clustered ? "clustered" : "uniform";
+
+			Particle partObject;
+			if (clustered) {
+				partObject.initClustered(particleCount, side, side, side, clusterCount, spread);
+			}
+			else {
+				partObject.init(particleCount, side, side, side);
+			}
+
+			// Dense grid
+			NNS sortObject;
+			sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+			double denseBuild = 0.0, denseCount = 0.0;
+			for (int i = 0; i <= iterations; i++) {
+				double t0 = omp_get_wtime();
+				sortObject.build(partObject.locations, partObject.sortedLoc);
+				double t1 = omp_get_wtime();
+				partObject.countNeighbors(sortObject);
+				double t2 = omp_get_wtime();
+
+				// First iteration is a warm up
+				if (i > 0) {
+					denseBuild += t1 - t0;
+					denseCount += t2 - t1;
+				}
+			}
+			std::vector<int> denseResult = partObject.neighborCount;
+
+			// Adaptive grid
+			AdaptiveGrid grid;
+			grid.init(particleCount, side, side, side, cellSize, gridBuffer);
+			double adaptiveBuild = 0.0, adaptiveCount = 0.0;
+			for (int i = 0; i <= iterations; i++) {
+				double t0 = omp_get_wtime();
+				grid.build(partObject.locations, partObject.sortedLoc);
+				double t1 = omp_get_wtime();
+				partObject.countNeighbors(grid);
+				double t2 = omp_get_wtime();
+
+				if (i > 0) {
+					adaptiveBuild += t1 - t0;
+					adaptiveCount += t2 - t1;
+				}
+			}
+			bool match = (denseResult == partObject.neighborCount);
+
+			double scale = 1000.0 / iterations;
+			printf("%10d %-9s %-8s %9.3f %9.3f %9.3f %6s\n", particleCount, workload, "dense",
+				denseBuild * scale, denseCount * scale, (denseBuild + denseCount) * scale, "-");
+			printf("%10d %-9s %-8s %9.3f %9.3f %9.3f %6s\n", particleCount, workload, grid.refined ? "refined" : "uniform",
+				adaptiveBuild * scale, adaptiveCount * scale, (adaptiveBuild + adaptiveCount) * scale, match ? "yes" : "NO");
+			printf("    ");
+			grid.printStats();
+		}
+	}
+	printf("\n");
+}
+
+void benchmarkSchedule(int cellSize, int gridBuffer) {
+	const int side = 120;
+	const int particleCount = 230400;
+	const int clusterCount = 20;
+	const float spread = 4.0f;
+	const int iterations = 10;
+	int threads = omp_get_max_threads();
+
+	printf("Schedule benchmark, %d particles in %d^3, clustered is %d Gaussian blobs of spread %.1f, wall time in ms per iteration (threads %d)\n",
+		particleCount, side, clusterCount, spread, threads);
+	printf("Imbalance is max / mean thread cost of the cost model (distance tests), 1.00 is balanced\n");
+	printf("%-9s %-9s %9s %9s %6s\n", "workload", "schedule", "count", "imbalance", "match");
+
+	for (int clustered = 0; clustered < 2; clustered++) {
+		const char* workload = clustered ? "clustered" : "uniform";
+
+		Particle partObject;
+		if (clustered) {
+			partObject.initClustered(particleCount, side, side, side, clusterCount, spread);
+		}
+		else {
+			partObject.init(particleCount, side, side, side);
+		}
+
+		NNS sortObject;
+		sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+		sortObject.build(partObject.locations, partObject.sortedLoc);
+
+		double particleStatic, cellDynamic;
+		sortObject.buildSchedule(threads);
+		sortObject.scheduleImbalance(threads, particleStatic, cellDynamic);
+
+		std::vector<int> reference;
+		for (int cells = 0; cells < 2; cells++) {
+			partObject.cellSchedule = (cells == 1);
+			double total = 0.0;
+			for (int i = 0; i <= iterations; i++) {
+				double t0 = omp_get_wtime();
+				partObject.countNeighbors(sortObject); // Includes buildSchedule for cells
+				double t1 = omp_get_wtime();
+
+				// First iteration is a warm up
+				if (i > 0) {
+					total += t1 - t0;
+				}
+			}
+			if (!cells) {
+				reference = partObject.neighborCount;
+			}
+
+			printf("%-9s %-9s %9.3f %9.2f %6s\n", workload, cells ? "cells" : "particles", total * 1000.0 / iterations,
+				cells ? cellDynamic : particleStatic, cells ? ((reference == partObject.neighborCount) ? "yes" : "NO") : "-");
+		}
+		printf("    %d occupied cells in %d chunks\n", (int)sortObject.workCells.size(), (int)sortObject.workChunks.size() - 1);
+	}
+	printf("\n");
+}
+
+void benchmarkParticleStore(int cellSize, int gridBuffer) {
+	const int side = 120;
+	const int particleCount = 230400;
+	const int iterations = 10;
+	const char* names[4] = { "position", "velocity", "force", "mass" };
+	const int components[4] = { 3, 3, 3, 1 };
+
+	printf("Particle store benchmark, %d particles in %d^3, fields position, velocity, force (3 floats) and mass (1)\n",
+		particleCount, side);
+	printf("Wall time in ms per frame of hash, kvSort, findCellStartEnd and the field reorder (threads %d)\n", omp_get_max_threads());
+	printf("%-14s %9s %9s %6s\n", "mode", "frame", "MB", "match");
+
+	Particle partObject;
+	partObject.init(particleCount, side, side, side);
+
+	NNS sortObject;
+	sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+	std::vector<float> reference;
+
+	for (int mode = 0; mode < 3; mode++) {
+		ParticleStore store;
+		store.init(particleCount, mode == 2);
+		for (int f = 0; f < 4; f++) {
+			store.addField(names[f], components[f]);
+			std::vector<float>& values = store.values(f);
+			for (size_t v = 0; v < values.size(); v++) {
+				values[v] = (f == 0) ? partObject.locations[v] : (float)(v % 1000) * (f + 1);
+			}
+		}
+
+		double total = 0.0;
+		for (int i = 0; i <= iterations; i++) {
+			double t0 = omp_get_wtime();
+			sortObject.hash(store.values(0));
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			if (mode == 0) {
+				// Serial loop per field like NNS::reorder
+				for (int f = 0; f < 4; f++) {
+					const std::vector<float>& values = store.values(f);
+					std::vector<float>& sorted = store.sorted(f);
+					int c = components[f];
+					for (int p = 0; p < particleCount; p++) {
+						int from = sortObject.cellIndexPair[p].index;
+						for (int k = 0; k < c; k++) {
+							sorted[(size_t)p * c + k] = values[(size_t)from * c + k];
+						}
+					}
+				}
+			}
+			else {
+				store.reorder(sortObject);
+			}
+			double t1 = omp_get_wtime();
+
+			// First iteration is a warm up
+			if (i > 0) {
+				total += t1 - t0;
+			}
+		}
+
+		// Velocity in sorted order by external ID, the same in every mode
+		std::vector<float> byId(store.values(1).size());
+		for (int slot = 0; slot < particleCount; slot++) {
+			int id = store.staySorted ? store.externalId[slot] : sortObject.cellIndexPair[slot].index;
+			for (int k = 0; k < 3; k++) {
+				byId[(size_t)id * 3 + k] = store.sorted(1)[(size_t)slot * 3 + k];
+			}
+		}
+		bool match = true;
+		if (mode == 0) {
+			reference = byId;
+		}
+		else {
+			match = (byId == reference);
+		}
+
+		const char* modeNames[3] = { "per field", "fused gather", "stay sorted" };
+		printf("%-14s %9.3f %9.1f %6s\n", modeNames[mode], total * 1000.0 / iterations,
+			store.memoryBytes() / (1024.0 * 1024.0), mode ? (match ? "yes" : "NO") : "-");
+	}
+	printf("\n");
+}
+
+void benchmarkClusterPairs(int cellSize, int gridBuffer, float skin) {
+	const int side = 120;
+	const int densityCount = 5;
+	const float densities[densityCount] = { 0.25f, 0.5f, 1.0f, 2.0f, 4.0f };
+	const int iterations = 20;
+	const int kernelCount = 5;
+	const float stepSize = skin * 0.05f;
+	int cellsPerAxis = side / cellSize;
+	int cells = cellsPerAxis * cellsPerAxis * cellsPerAxis;
+
+	printf("Cluster pair benchmark, %d^3 space, cutoff %d, skin %.2f, %d frames of particles moving up to %.2f per axis,\n",
+		side, cellSize, skin, iterations, stepSize);
+	printf("wall time in ms per frame (threads %d)\n", omp_get_max_threads());
+	printf("prepare is NNS::build (and the SoA reorder) or the cluster pair update, which rebuilds the grid and lists only\n");
+	printf("once a particle moved more than skin / 2, hits are the share of distance tests within the cutoff\n");
+	printf("%10s %8s %-16s %9s %9s %9s %8s %10s %6s %6s\n", "particles", "per cell", "kernel", "prepare", "count", "total",
+		"rebuilds", "tests", "hits", "match");
+
+	for (int d = 0; d < densityCount; d++) {
+		int particleCount = (int)(densities[d] * cells);
+
+		Particle partObject;
+		partObject.init(particleCount, side, side, side);
+		std::vector<float> original = partObject.locations;
+
+		NNS sortObject;
+		sortObject.init(particleCount, side, side, side, cellSize, gridBuffer);
+		sortObject.build(partObject.locations, partObject.sortedLoc);
+		partObject.countNeighbors(sortObject);
+
+		long long neighbors = 0;
+		for (int count : partObject.neighborCount) {
+			neighbors += count;
+		}
+		// Particles in the 27 stencil cells of each particle, summed (see NNS::buildSchedule)
+		sortObject.buildSchedule(1);
+		long long particleTests = sortObject.workCost.empty() ? 0 : (long long)sortObject.workCost.back();
+
+		// The counts of the last frame, every kernel sees the same frames
+		srand(1234);
+		for (int i = 0; i < iterations; i++) {
+			partObject.jitter(stepSize);
+			partObject.confine(side, side, side);
+		}
+		sortObject.build(partObject.locations, partObject.sortedLoc);
+		partObject.countNeighbors(sortObject);
+		std::vector<int> reference = partObject.neighborCount;
+
+		for (int k = 0; k < kernelCount; k++) {
+			// 4x4 and 8x8 reusing the lists, then 8x8 rebuilt every frame
+			ClusterPairList clusters;
+			if (k >= 2) {
+				clusters.init(particleCount, (float)cellSize, (k == 4) ? 0.0f : skin, (k == 2) ? 4 : 8);
+			}
+
+			partObject.locations = original;
+			srand(1234);
+			double prepare = 0.0, count = 0.0;
+			for (int i = 0; i < iterations; i++) {
+				partObject.jitter(stepSize);
+				partObject.confine(side, side, side);
+
+				double t0 = omp_get_wtime();
+				if (k < 2) {
+					sortObject.build(partObject.locations, partObject.sortedLoc);
+				}
+				if (k == 1) {
+					sortObject.reorder(partObject.locations, partObject.sortedSoA);
+				}
+				else if (k >= 2) {
+					clusters.update(sortObject, partObject.locations, partObject.sortedLoc);
+				}
+				double t1 = omp_get_wtime();
+				if (k == 0) {
+					partObject.countNeighbors(sortObject);
+				}
+				else if (k == 1) {
+					partObject.countNeighborsSIMD(sortObject);
+				}
+				else {
+					clusters.countNeighbors(sortObject, partObject.neighborCount);
+				}
+				double t2 = omp_get_wtime();
+
+				prepare += t1 - t0;
+				count += t2 - t1;
+			}
+
+			char name[32];
+			char rebuilds[16] = "-";
+			if (k == 0)      snprintf(name, sizeof(name), "countNeighbors");
+			else if (k == 1) snprintf(name, sizeof(name), "SoA %s", simdLevelName(partObject.simdLevel));
+			else             snprintf(name, sizeof(name), "clusters %dx%d%s", clusters.clusterSize, clusters.clusterSize,
+				(k == 4) ? " s=0" : "");
+			if (k >= 2) {
+				snprintf(rebuilds, sizeof(rebuilds), "%d", clusters.buildCount);
+			}
+
+			long long tests = (k >= 2) ? clusters.distanceTests() : particleTests;
+			double scale = 1000.0 / iterations;
+			printf("%10d %8.2f %-16s %9.3f %9.3f %9.3f %8s %9.2fM %5.1f%% %6s\n", particleCount, densities[d], name,
+				prepare * scale, count * scale, (prepare + count) * scale, rebuilds, tests / 1.0e6,
+				tests ? 100.0 * neighbors / tests : 0.0, (partObject.neighborCount == reference) ? "yes" : "NO");
+		}
+	}
+	printf("\n");
+}
+
+void benchmarkIncremental(int cellSize, int gridBuffer) {
+	const int side = 240;
+	const int particleCount = 221184; // 2 per cell like the main performance test
+	const int iterations = 20;
+	const int stepCount = 5;
+	const float steps[stepCount] = { 0.001f, 0.01f, 0.02f, 0.05f, 0.25f }; // Fraction of the cell size per axis
+	const CellOrder orders[3] = { CELL_ORDER_ROW_MAJOR, CELL_ORDER_MORTON, CELL_ORDER_HILBERT };
+	const char* orderNames[3] = { "row", "morton", "hilbert" };
+
+	printf("Incremental update benchmark, %d particles in %d^3, %d jittered frames per step, wall time in ms per frame (threads %d)\n",
+		particleCount, side, iterations, omp_get_max_threads());
+	printf("full is hash, kvSort and findCellStartEnd, movers are the particles that changed cell per frame\n");
+	printf("%-8s %6s %8s %9s %11s %8s %6s\n", "order", "step", "movers", "full", "incremental", "speedup", "match");
+
+	Particle partObject;
+	partObject.init(particleCount, side, side, side);
+	std::vector<float> original = partObject.locations;
+
+	for (int o = 0; o < 3; o++) {
+		for (int s = 0; s < stepCount; s++) {
+			NNS incremental, full;
+			incremental.init(particleCount, side, side, side, cellSize, gridBuffer);
+			full.init(particleCount, side, side, side, cellSize, gridBuffer);
+			incremental.setCellOrder(orders[o]);
+			full.setCellOrder(orders[o]);
+
+			partObject.locations = original;
+			incremental.updateIncremental(partObject.locations);
+
+			double fullTime = 0.0, incrementalTime = 0.0;
+			long long movers = 0;
+			bool match = true;
+			for (int i = 0; i < iterations; i++) {
+				partObject.jitter(cellSize * steps[s]);
+				partObject.confine(side, side, side);
+
+				double t0 = omp_get_wtime();
+				full.hash(partObject.locations);
+				full.kvSort();
+				full.findCellStartEnd();
+				double t1 = omp_get_wtime();
+				movers += incremental.updateIncremental(partObject.locations);
+				double t2 = omp_get_wtime();
+
+				fullTime += t1 - t0;
+				incrementalTime += t2 - t1;
+
+				// Same cell of every slot and the same cell ranges, particles within a cell can be in another order
+				for (int p = 0; p < particleCount; p++) {
+					match = match && incremental.cellIndexPair[p].cellID == full.cellIndexPair[p].cellID;
+				}
+				for (int c = 0; c < full.cellCount; c++) {
+					match = match && incremental.cellStart[c] == full.cellStart[c];
+				}
+			}
+
+			printf("%-8s %6.3f %7.2f%% %9.3f %11.3f %7.1fx %6s\n", orderNames[o], steps[s],
+				100.0 * movers / ((double)iterations * particleCount), fullTime * 1000.0 / iterations,
+				incrementalTime * 1000.0 / iterations, fullTime / incrementalTime, match ? "yes" : "NO");
+		}
+	}
+	printf("\n");
+}
\ No newline at end of file
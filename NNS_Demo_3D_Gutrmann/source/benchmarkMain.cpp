@@ -0,0 +1,25 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+* Per-stage benchmark, run with --help for the sweep settings
+*/
+
+#include <benchmarkSuite.hpp>
+
+int main(int argc, char** argv) {
+	BenchmarkSuite suite;
+	if (!suite.parseArgs(argc, argv)) {
+		return 1;
+	}
+
+	suite.run();
+	suite.printTable();
+
+	if (!suite.jsonPath.empty() && !suite.writeJson(suite.jsonPath.c_str())) {
+		return 1;
+	}
+	if (!suite.csvPath.empty() && !suite.writeCsv(suite.csvPath.c_str())) {
+		return 1;
+	}
+	return 0;
+}
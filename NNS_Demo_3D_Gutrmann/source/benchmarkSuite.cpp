@@ -0,0 +1,336 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <benchmarkSuite.hpp>
+#include <particle.hpp>
+#include <timer.hpp>
+#include <topology.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+const char* benchStageName(BenchStage stage) {
+	switch (stage) {
+	case STAGE_HASH: return "hash";
+	case STAGE_KV_SORT: return "kvSort";
+	case STAGE_FIND_CELL_START_END: return "findCellStartEnd";
+	case STAGE_REORDER: return "reorder";
+	case STAGE_COUNT_NEIGHBORS: return "countNeighbors";
+	case STAGE_COUNT_NEIGHBORS_N2: return "countNeighborsN2";
+	default: return "unknown";
+	}
+}
+
+// Nearest rank percentile of sorted samples
+static double percentile(const std::vector<double>& sorted, double p) {
+	int rank = (int)std::ceil(p / 100.0 * sorted.size());
+	rank = std::min(std::max(rank, 1), (int)sorted.size());
+	return sorted[rank - 1];
+}
+
+static StageStats computeStats(std::vector<double> samples) {
+	StageStats stats = { 0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+	if (samples.empty()) {
+		return stats;
+	}
+	std::sort(samples.begin(), samples.end());
+
+	double sum = 0.0;
+	for (double s : samples) {
+		sum += s;
+	}
+	stats.repetitions = (int)samples.size();
+	stats.min = samples.front();
+	stats.max = samples.back();
+	stats.mean = sum / samples.size();
+	stats.median = (samples.size() % 2) ? samples[samples.size() / 2]
+		: 0.5 * (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]);
+	stats.p10 = percentile(samples, 10.0);
+	stats.p90 = percentile(samples, 90.0);
+	return stats;
+}
+
+void BenchmarkSuite::setDefaults() {
+	// Default point is the demo setup: 3600 particles in 60 x 60 x 60
+	particleCounts = { 3600, 28800, 230400 };
+	densities = { 3600.0f / (60 * 60 * 60) };
+	cellSizes = { 5 };
+	CpuTopology topology;
+	topology.detect();
+	threadCounts = { 1, topology.coreCount };
+	threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+	warmup = 3;
+	repetitions = 20;
+	n2Limit = 30000;
+	sortMethod = KV_SORT_RADIX;
+	cellOrder = CELL_ORDER_ROW_MAJOR;
+
+	jsonPath = "";
+	csvPath = "";
+}
+
+template <typename T>
+static bool parseList(const char* key, const char* value, std::vector<T>& list) {
+	list.clear();
+	const char* c = value;
+	while (*c) {
+		char* end = nullptr;
+		double v = strtod(c, &end);
+		if (end == c || v <= 0.0) {
+			printf("Benchmark Error: bad value for %s: %s\n", key, value);
+			return false;
+		}
+		list.push_back((T)v);
+		c = (*end == ',') ? end + 1 : end;
+		if (*end != ',' && *end != '\0') {
+			printf("Benchmark Error: bad value for %s: %s\n", key, value);
+			return false;
+		}
+	}
+	if (list.empty()) {
+		printf("Benchmark Error: empty list for %s\n", key);
+		return false;
+	}
+	return true;
+}
+
+bool BenchmarkSuite::parseArgs(int argc, char** argv) {
+	setDefaults();
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+			printUsage(argv[0]);
+			return false;
+		}
+		if (strncmp(arg, "--", 2) != 0 || strchr(arg, '=') == nullptr) {
+			printf("Benchmark Error: expected --key=value, got %s\n", arg);
+			return false;
+		}
+
+		std::string key(arg + 2, strchr(arg, '=') - (arg + 2));
+		const char* value = strchr(arg, '=') + 1;
+
+		bool ok = true;
+		if (key == "particles") {
+			ok = parseList(key.c_str(), value, particleCounts);
+		}
+		else if (key == "density") {
+			ok = parseList(key.c_str(), value, densities);
+		}
+		else if (key == "cell") {
+			ok = parseList(key.c_str(), value, cellSizes);
+		}
+		else if (key == "threads") {
+			ok = parseList(key.c_str(), value, threadCounts);
+		}
+		else if (key == "warmup") {
+			warmup = atoi(value);
+		}
+		else if (key == "reps") {
+			repetitions = std::max(1, atoi(value));
+		}
+		else if (key == "n2_limit") {
+			n2Limit = atoi(value);
+		}
+		else if (key == "sort") {
+			if (strcmp(value, "std") == 0) sortMethod = KV_SORT_STD;
+			else if (strcmp(value, "radix") == 0) sortMethod = KV_SORT_RADIX;
+			else ok = false;
+		}
+		else if (key == "cell_order") {
+			if (strcmp(value, "row") == 0) cellOrder = CELL_ORDER_ROW_MAJOR;
+			else if (strcmp(value, "morton") == 0) cellOrder = CELL_ORDER_MORTON;
+			else if (strcmp(value, "hilbert") == 0) cellOrder = CELL_ORDER_HILBERT;
+			else ok = false;
+		}
+		else if (key == "json") {
+			jsonPath = value;
+		}
+		else if (key == "csv") {
+			csvPath = value;
+		}
+		else {
+			printf("Benchmark Error: unknown key %s\n", key.c_str());
+			return false;
+		}
+
+		if (!ok) {
+			printf("Benchmark Error: bad value for %s: %s\n", key.c_str(), value);
+			return false;
+		}
+	}
+	return true;
+}
+
+void BenchmarkSuite::printUsage(const char* program) {
+	printf("Usage: %s [--key=value ...]\n", program);
+	printf("Lists are comma separated, every combination is run\n");
+	printf("  --particles=3600,28800   particle counts\n");
+	printf("  --density=0.0167         particles per unit volume (sets the cubic space size)\n");
+	printf("  --cell=5                 cell sizes (also the interaction distance)\n");
+	printf("  --threads=1,4            OpenMP thread counts\n");
+	printf("  --warmup=3               untimed iterations before measuring\n");
+	printf("  --reps=20                timed iterations\n");
+	printf("  --n2_limit=30000         skip countNeighborsN2 above this particle count\n");
+	printf("  --sort=std|radix\n");
+	printf("  --cell_order=row|morton|hilbert\n");
+	printf("  --json=file              write results as JSON\n");
+	printf("  --csv=file               write results as CSV\n");
+}
+
+BenchResult BenchmarkSuite::runPoint(int particleCount, float density, int cellSize, int threads) {
+	BenchResult result;
+	memset(&result, 0, sizeof(result));
+	result.particleCount = particleCount;
+	result.density = density;
+	result.cellSize = cellSize;
+	result.threads = threads;
+
+	// Cubic space holding the particles at the requested density
+	int side = (int)std::ceil(std::cbrt(particleCount / density));
+	side = std::max(side, cellSize);
+	result.side = side;
+
+	omp_set_num_threads(threads);
+
+	srand(1);
+	Particle partObject;
+	partObject.init(particleCount, side, side, side);
+
+	NNS sortObject;
+	sortObject.init(particleCount, side, side, side, cellSize, cellSize * 2);
+	sortObject.hashMode = HASH_FAST;
+	sortObject.setSortMethod(sortMethod);
+	sortObject.setCellOrder(cellOrder);
+	result.cellCount = sortObject.getCellCount();
+
+	bool runN2 = particleCount <= n2Limit;
+	std::vector<double> samples[STAGE_COUNT];
+
+	for (int i = 0; i < warmup + repetitions; i++) {
+		double t[STAGE_COUNT + 1];
+		t[0] = wallTime();
+		sortObject.hash(partObject.locations);
+		t[1] = wallTime();
+		sortObject.kvSort();
+		t[2] = wallTime();
+		sortObject.findCellStartEnd();
+		t[3] = wallTime();
+		sortObject.reorder(partObject.locations, partObject.sortedLoc);
+		t[4] = wallTime();
+		partObject.countNeighbors(sortObject);
+		t[5] = wallTime();
+		if (runN2) {
+			partObject.countNeighborsN2(cellSize);
+		}
+		t[6] = wallTime();
+
+		if (i < warmup) {
+			continue;
+		}
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			if (s == STAGE_COUNT_NEIGHBORS_N2 && !runN2) {
+				continue;
+			}
+			samples[s].push_back((t[s + 1] - t[s]) * 1000.0);
+		}
+	}
+
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		result.timed[s] = !samples[s].empty();
+		result.stages[s] = computeStats(samples[s]);
+	}
+	return result;
+}
+
+void BenchmarkSuite::run() {
+	results.clear();
+	int restoreThreads = omp_get_max_threads();
+
+	for (int particleCount : particleCounts) {
+		for (float density : densities) {
+			for (int cellSize : cellSizes) {
+				for (int threads : threadCounts) {
+					results.push_back(runPoint(particleCount, density, cellSize, threads));
+				}
+			}
+		}
+	}
+
+	omp_set_num_threads(restoreThreads);
+}
+
+void BenchmarkSuite::printTable() {
+	printf("Wall time in ms, median [p10, p90] of %d repetitions after %d warmup\n", repetitions, warmup);
+	printf("%10s %9s %5s %7s %5s  %-17s %9s %9s %9s\n", "particles", "density", "cell", "threads", "side", "stage", "median", "p10", "p90");
+
+	for (const BenchResult& r : results) {
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			if (!r.timed[s]) {
+				continue;
+			}
+			const StageStats& st = r.stages[s];
+			printf("%10d %9.5f %5d %7d %5d  %-17s %9.4f %9.4f %9.4f\n", r.particleCount, r.density, r.cellSize, r.threads, r.side,
+				benchStageName((BenchStage)s), st.median, st.p10, st.p90);
+		}
+	}
+}
+
+bool BenchmarkSuite::writeJson(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		printf("Benchmark Error: could not open %s\n", path);
+		return false;
+	}
+
+	fprintf(file, "{\n  \"unit\": \"ms\",\n  \"warmup\": %d,\n  \"repetitions\": %d,\n", warmup, repetitions);
+	fprintf(file, "  \"sort\": \"%s\",\n  \"results\": [\n", sortMethod == KV_SORT_RADIX ? "radix" : "std");
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		fprintf(file, "    {\"particles\": %d, \"density\": %g, \"cell\": %d, \"threads\": %d, \"side\": %d, \"cells\": %d, \"stages\": {",
+			r.particleCount, r.density, r.cellSize, r.threads, r.side, r.cellCount);
+
+		bool first = true;
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			if (!r.timed[s]) {
+				continue;
+			}
+			const StageStats& st = r.stages[s];
+			fprintf(file, "%s\n      \"%s\": {\"min\": %.6f, \"mean\": %.6f, \"median\": %.6f, \"p10\": %.6f, \"p90\": %.6f, \"max\": %.6f}",
+				first ? "" : ",", benchStageName((BenchStage)s), st.min, st.mean, st.median, st.p10, st.p90, st.max);
+			first = false;
+		}
+		fprintf(file, "\n    }}%s\n", (i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	fclose(file);
+	return true;
+}
+
+bool BenchmarkSuite::writeCsv(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		printf("Benchmark Error: could not open %s\n", path);
+		return false;
+	}
+
+	fprintf(file, "particles,density,cell,threads,side,cells,stage,repetitions,min_ms,mean_ms,median_ms,p10_ms,p90_ms,max_ms\n");
+	for (const BenchResult& r : results) {
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			if (!r.timed[s]) {
+				continue;
+			}
+			const StageStats& st = r.stages[s];
+			fprintf(file, "%d,%g,%d,%d,%d,%d,%s,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n", r.particleCount, r.density, r.cellSize, r.threads,
+				r.side, r.cellCount, benchStageName((BenchStage)s), st.repetitions, st.min, st.mean, st.median, st.p10, st.p90, st.max);
+		}
+	}
+	fclose(file);
+	return true;
+}
@@ -0,0 +1,284 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <clusterPairs.hpp>
+#include <globals.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+// Out of reach of any particle, the squared distance (1e36) still fits in a float
+static const float farAway = 1.0e18f;
+
+// Squared distance between two boxes (min x y z, max x y z), 0 when they overlap
+// No particle pair of the two clusters is closer: every difference of coordinates is at least the gap,
+// and rounding keeps that order, so no neighbor is lost without a margin
+static inline float boxDistance2(const float* a, const float* b) {
+	float gx = std::max(std::max(b[0] - a[3], a[0] - b[3]), 0.0f);
+	float gy = std::max(std::max(b[1] - a[4], a[1] - b[4]), 0.0f);
+	float gz = std::max(std::max(b[2] - a[5], a[2] - b[5]), 0.0f);
+	return (gx * gx) + (gy * gy) + (gz * gz);
+}
+
+void ClusterPairList::init(int count, float cutoffDist, float skinDist, int clusterWidth) {
+	cutoff = cutoffDist;
+	particleCount = count;
+	simdLevel = detectSimdLevel();
+
+	if (clusterWidth == 0) {
+		clusterWidth = (simdLevel >= SIMD_AVX2) ? 8 : 4;
+	}
+	clusterSize = (clusterWidth >= 8) ? 8 : 4;
+	clusterCount = 0;
+
+	clusterIndex.clear();
+	pairOffsets.assign(1, 0);
+	pairs.clear();
+	curve.clear();
+	curveDims[0] = curveDims[1] = curveDims[2] = 0;
+
+	candidatePairs = 0;
+	initSkin(count, skinDist);
+}
+
+bool ClusterPairList::update(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	// Pairs now within cutoff were within cutoff + skin at the last build, and so were their clusters' boxes
+	if (!updateGrid(sort, locations, sortedLoc)) {
+		refreshPositions(sortedLoc);
+		return false;
+	}
+	build(sort, locations, sortedLoc);
+	return true;
+}
+
+void ClusterPairList::refreshPositions(const std::vector<float>& sortedLoc) {
+	int lane = 0;
+	int laneCount = (int)clusterIndex.size();
+
+#pragma omp parallel for
+	for (lane = 0; lane < laneCount; lane++) {
+		int i = clusterIndex[lane];
+		if (i >= 0) {
+			x[lane] = sortedLoc[i * 3 + 0];
+			y[lane] = sortedLoc[i * 3 + 1];
+			z[lane] = sortedLoc[i * 3 + 2];
+		}
+	}
+}
+
+// 1. Lanes: the cells along the Hilbert curve, each cell's particles on consecutive lanes
+// 2. Cluster positions, bounding boxes and the cells they cover
+// 3. Candidates: the clusters holding lanes of the cells around those covered, as many cells as cutoff + skin
+//    reaches. Neighboring cells often share a cluster, a per thread stamp visits each once
+// 4. Bounding box test against cutoff + skin into per thread lists, copied to one contiguous allocation
+//    after a prefix sum
+void ClusterPairList::build(NNS& sort, std::vector<float>& locations, const std::vector<float>& sortedLoc) {
+	const int S = clusterSize;
+	const int shift = (S == 8) ? 3 : 2; // Lane to cluster
+	const int lastCell = sort.cellCount - 1; // Excluded out-of-bounds cell, also the last row-major cell
+	const int dim[3] = { sort.cellDimx, sort.cellDimy, sort.cellDimz };
+	const float listCutoff = cutoff + skin;
+	const float listCutoff2 = squaredCutoff(listCutoff);
+	const int reach = std::max((int)ceilf(listCutoff / (float)sort.cellLength), 1);
+
+	// 1.
+	if (curveDims[0] != dim[0] || curveDims[1] != dim[1] || curveDims[2] != dim[2]) {
+		curve = sort.curveOrder(lastCell, CELL_ORDER_HILBERT);
+		curveDims[0] = dim[0];
+		curveDims[1] = dim[1];
+		curveDims[2] = dim[2];
+	}
+
+	// The excluded cell keeps an empty range
+	cellLanes.assign((size_t)sort.cellCount * 2, 0);
+	int lanes = 0;
+	for (int rm : curve) {
+		cellLanes[rm * 2 + 0] = lanes;
+		int cell = sort.orderedCell(rm);
+		if (sort.cellStart[cell] != 0xffffffff) {
+			lanes += (int)(sort.cellEnd[cell] - sort.cellStart[cell]);
+		}
+		cellLanes[rm * 2 + 1] = lanes;
+	}
+
+	clusterCount = (lanes + S - 1) >> shift;
+	clusterIndex.assign((size_t)clusterCount * S, -1);
+	x.resize(clusterIndex.size());
+	y.resize(clusterIndex.size());
+	z.resize(clusterIndex.size());
+	bounds.resize((size_t)clusterCount * 6);
+	cellBounds.resize((size_t)clusterCount * 6);
+	pairOffsets.assign(clusterCount + 1, 0);
+
+	int curveCells = (int)curve.size();
+	int t = 0;
+#pragma omp parallel for
+	for (t = 0; t < curveCells; t++) {
+		int rm = curve[t];
+		int cell = sort.orderedCell(rm);
+		uint32_t start = sort.cellStart[cell];
+		if (start != 0xffffffff) {
+			for (uint32_t i = start; i < sort.cellEnd[cell]; i++) {
+				clusterIndex[cellLanes[rm * 2] + (i - start)] = (int)i;
+			}
+		}
+	}
+
+	// 2.
+	int c = 0;
+#pragma omp parallel for
+	for (c = 0; c < clusterCount; c++) {
+		float* box = &bounds[(size_t)c * 6];
+		int* cells = &cellBounds[(size_t)c * 6];
+		for (int k = 0; k < 3; k++) {
+			box[k] = farAway;
+			box[k + 3] = -farAway;
+			cells[k] = INT_MAX;
+			cells[k + 3] = INT_MIN;
+		}
+
+		for (int lane = c * S; lane < (c + 1) * S; lane++) {
+			int i = clusterIndex[lane];
+			if (i < 0) {
+				x[lane] = y[lane] = z[lane] = farAway;
+				continue;
+			}
+
+			float p[3] = { sortedLoc[i * 3 + 0], sortedLoc[i * 3 + 1], sortedLoc[i * 3 + 2] };
+			x[lane] = p[0];
+			y[lane] = p[1];
+			z[lane] = p[2];
+
+			int cell = sort.cellIndexPair[i].cellID;
+			int rm = (sort.cellOrder == CELL_ORDER_ROW_MAJOR) ? cell : sort.cellRowMajor[cell];
+			int coord[3] = { rm % dim[0], (rm / dim[0]) % dim[1], rm / (dim[0] * dim[1]) };
+			for (int k = 0; k < 3; k++) {
+				box[k] = std::min(box[k], p[k]);
+				box[k + 3] = std::max(box[k + 3], p[k]);
+				cells[k] = std::min(cells[k], coord[k]);
+				cells[k + 3] = std::max(cells[k + 3], coord[k]);
+			}
+		}
+	}
+
+	long long candidates = 0;
+#pragma omp parallel reduction(+:candidates)
+	{
+		// Static shares of the clusters, so each thread's lists are one block of pairs
+		int threads = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+		int begin = (int)((long long)clusterCount * thread / threads);
+		int end = (int)((long long)clusterCount * (thread + 1) / threads);
+
+		std::vector<int> listed;
+		// Last cluster that visited each j cluster
+		std::vector<int> visited(clusterCount, -1);
+
+		for (int i = begin; i < end; i++) {
+			const int* cells = &cellBounds[(size_t)i * 6];
+			const float* box = &bounds[(size_t)i * 6];
+			size_t listStart = listed.size();
+
+			// 3.
+			int lo[3], hi[3];
+			for (int k = 0; k < 3; k++) {
+				lo[k] = std::max(cells[k] - reach, 0);
+				hi[k] = std::min(cells[k + 3] + reach, dim[k] - 1);
+			}
+
+			for (int cz = lo[2]; cz <= hi[2]; cz++) {
+				for (int cy = lo[1]; cy <= hi[1]; cy++) {
+					const int* row = &cellLanes[(size_t)((cz * dim[1] + cy) * dim[0]) * 2];
+					for (int cx = lo[0]; cx <= hi[0]; cx++) {
+						int first = row[cx * 2 + 0];
+						int last = row[cx * 2 + 1];
+						if (first == last) {
+							continue;
+						}
+
+						// 4.
+						for (int j = first >> shift; j < (last + S - 1) >> shift; j++) {
+							if (visited[j] == i) {
+								continue;
+							}
+							visited[j] = i;
+							++candidates;
+							if (boxDistance2(box, &bounds[(size_t)j * 6]) < listCutoff2) {
+								listed.push_back(j);
+							}
+						}
+					}
+				}
+			}
+
+			pairOffsets[i + 1] = (int)(listed.size() - listStart);
+		}
+
+#pragma omp barrier
+#pragma omp single
+		{
+			// Exclusive prefix sum of the counts
+			pairOffsets[0] = 0;
+			for (c = 0; c < clusterCount; c++) {
+				pairOffsets[c + 1] += pairOffsets[c];
+			}
+			pairs.resize(pairOffsets[clusterCount]);
+		}
+
+		std::copy(listed.begin(), listed.end(), pairs.begin() + pairOffsets[begin]);
+	}
+
+	candidatePairs = candidates;
+	recordBuild(locations);
+}
+
+void ClusterPairList::countNeighbors(NNS& sort, std::vector<int>& neighborCount) {
+	ClusterPairFunc countPairs = getClusterPairFunc(simdLevel, clusterSize);
+	const float cutoff2 = squaredCutoff(cutoff);
+
+	int c = 0;
+
+#pragma omp parallel for schedule(dynamic, 64)
+	for (c = 0; c < clusterCount; c++) {
+		int counts[8] = {};
+		int begin = pairOffsets[c];
+		countPairs(x.data(), y.data(), z.data(), c, pairs.data() + begin, pairOffsets[c + 1] - begin, cutoff2, counts);
+
+		for (int lane = 0; lane < clusterSize; lane++) {
+			int i = clusterIndex[(size_t)c * clusterSize + lane];
+			if (i >= 0) {
+				// The particle found itself at distance 0, its own cluster is always in its list
+				neighborCount[sort.cellIndexPair[i].index] = counts[lane] - 1;
+			}
+		}
+	}
+
+	// Not clustered, like the excluded cell in the other kernels' stencils
+	int lastCell = sort.cellCount - 1;
+	if (sort.cellStart[lastCell] != 0xffffffff) {
+		for (uint32_t i = sort.cellStart[lastCell]; i < sort.cellEnd[lastCell]; i++) {
+			neighborCount[sort.cellIndexPair[i].index] = 0;
+		}
+	}
+}
+
+size_t ClusterPairList::memoryBytes() const {
+	return (x.capacity() + y.capacity() + z.capacity() + bounds.capacity() + buildLocations.capacity()) * sizeof(float)
+		+ (clusterIndex.capacity() + pairOffsets.capacity() + pairs.capacity() + curve.capacity()
+			+ cellLanes.capacity() + cellBounds.capacity()) * sizeof(int);
+}
+
+void ClusterPairList::printStats() {
+	printf("Cluster pair list: %dx%d clusters, cutoff %.2f skin %.2f\n", clusterSize, clusterSize, cutoff, skin);
+	printf("\tRebuilds %d of %d frames (every %.1f frames)\n", buildCount, frameCount,
+		buildCount ? frameCount / (float)buildCount : 0.0f);
+	printf("\tPairs %zu (%.1f per cluster), %.0f%% of %lld candidates pruned by the bounding boxes\n", pairs.size(),
+		pairs.size() / (float)std::max(clusterCount, 1),
+		candidatePairs ? 100.0 * (1.0 - pairs.size() / (double)candidatePairs) : 0.0, candidatePairs);
+	printf("\tDistance tests %lld (%.1f per particle), %.2f MB\n", distanceTests(),
+		distanceTests() / (float)std::max(particleCount, 1), memoryBytes() / (1024.0f * 1024.0f));
+	printf("\tLast max displacement %.3f (rebuild above %.3f)\n", lastMaxDisplacement, skin * 0.5f);
+}
@@ -0,0 +1,337 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <config.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+void Config::setDefaults() {
+	setPreset("multi");
+
+	iterations = 1000;
+
+#if defined(DEBUG) | defined(_DEBUG)
+	hashMode = HASH_DEBUG;
+#else
+	hashMode = HASH_SAFE;
+#endif
+	sortMethod = KV_SORT_RADIX;
+	keepPreviousOrder = false;
+	sortedLists = false;
+	cellOrder = CELL_ORDER_ROW_MAJOR;
+	verletSkin = 1.0f;
+	cellDivisions = 0;
+	autotuneInterval = 200;
+	quantizeBits = 0;
+	quantizeValidate = false;
+	cellSchedule = false;
+	clusterSize = 0;
+	trajectoryPath.clear();
+	countsPath.clear();
+	writeTrajectoryPath.clear();
+	trajectoryFrames = 100;
+	trajectoryLayout = TRAJ_LAYOUT_XYZ;
+	pipeline = true;
+
+	kvSortBenchmark = false;
+	cellOrderBenchmark = false;
+	sparseGridBenchmark = false;
+	knnBenchmark = false;
+	subcellBenchmark = false;
+	adaptiveBenchmark = false;
+	scheduleBenchmark = false;
+	storeBenchmark = false;
+	clusterBenchmark = false;
+	incrementalBenchmark = false;
+}
+
+bool Config::setPreset(const char* name) {
+	if (strcmp(name, "small") == 0) {
+		xDim = 10; yDim = 10; zDim = 5;
+		cellSize = 5;
+		gridBuffer = 5;
+		particleCount = 10;
+		performanceTest = false;
+		multiThread = false;
+	}
+	else if (strcmp(name, "single") == 0) {
+		xDim = 40; yDim = 40; zDim = 30;
+		cellSize = 5;
+		gridBuffer = 10;
+		particleCount = 800;
+		performanceTest = true;
+		multiThread = false;
+	}
+	else if (strcmp(name, "multi") == 0) {
+		xDim = 60; yDim = 60; zDim = 60;
+		cellSize = 5;
+		gridBuffer = 10;
+		particleCount = 3600;
+		performanceTest = true;
+		multiThread = true;
+	}
+	else {
+		return false;
+	}
+
+	threads = 0;
+	pinThreads = true;
+	threadAutotune = false;
+	periodic = false;
+	recordLists = !performanceTest;
+	return true;
+}
+
+static bool parseBool(const char* value, bool& out) {
+	if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0 || strcmp(value, "on") == 0) {
+		out = true;
+		return true;
+	}
+	if (strcmp(value, "0") == 0 || strcmp(value, "false") == 0 || strcmp(value, "off") == 0) {
+		out = false;
+		return true;
+	}
+	return false;
+}
+
+static bool parseInt(const char* value, int& out) {
+	char* end;
+	long v = strtol(value, &end, 10);
+	if (end == value || *end != '\0') {
+		return false;
+	}
+	out = (int)v;
+	return true;
+}
+
+static bool parseFloat(const char* value, float& out) {
+	char* end;
+	float v = strtof(value, &end);
+	if (end == value || *end != '\0') {
+		return false;
+	}
+	out = v;
+	return true;
+}
+
+bool Config::set(const char* key, const char* value) {
+	bool ok = true;
+
+	if (strcmp(key, "preset") == 0)                ok = setPreset(value);
+	else if (strcmp(key, "x") == 0)                ok = parseInt(value, xDim);
+	else if (strcmp(key, "y") == 0)                ok = parseInt(value, yDim);
+	else if (strcmp(key, "z") == 0)                ok = parseInt(value, zDim);
+	else if (strcmp(key, "cell") == 0)             ok = parseInt(value, cellSize);
+	else if (strcmp(key, "buffer") == 0)           ok = parseInt(value, gridBuffer);
+	else if (strcmp(key, "particles") == 0)        ok = parseInt(value, particleCount);
+	else if (strcmp(key, "periodic") == 0)         ok = parseBool(value, periodic);
+	else if (strcmp(key, "performance_test") == 0) ok = parseBool(value, performanceTest);
+	else if (strcmp(key, "multi_thread") == 0)     ok = parseBool(value, multiThread);
+	else if (strcmp(key, "threads") == 0)          ok = parseInt(value, threads);
+	else if (strcmp(key, "pin_threads") == 0)      ok = parseBool(value, pinThreads);
+	else if (strcmp(key, "thread_autotune") == 0)  ok = parseBool(value, threadAutotune);
+	else if (strcmp(key, "iterations") == 0)       ok = parseInt(value, iterations);
+	else if (strcmp(key, "record_lists") == 0)     ok = parseBool(value, recordLists);
+	else if (strcmp(key, "sorted_lists") == 0)     ok = parseBool(value, sortedLists);
+	else if (strcmp(key, "keep_order") == 0)       ok = parseBool(value, keepPreviousOrder);
+	else if (strcmp(key, "verlet_skin") == 0)      ok = parseFloat(value, verletSkin);
+	else if (strcmp(key, "kv_sort_benchmark") == 0)    ok = parseBool(value, kvSortBenchmark);
+	else if (strcmp(key, "cell_order_benchmark") == 0) ok = parseBool(value, cellOrderBenchmark);
+	else if (strcmp(key, "sparse_grid_benchmark") == 0) ok = parseBool(value, sparseGridBenchmark);
+	else if (strcmp(key, "knn_benchmark") == 0)    ok = parseBool(value, knnBenchmark);
+	else if (strcmp(key, "subcell_benchmark") == 0) ok = parseBool(value, subcellBenchmark);
+	else if (strcmp(key, "adaptive_benchmark") == 0) ok = parseBool(value, adaptiveBenchmark);
+	else if (strcmp(key, "cell_divisions") == 0)   ok = parseInt(value, cellDivisions);
+	else if (strcmp(key, "autotune_interval") == 0) ok = parseInt(value, autotuneInterval);
+	else if (strcmp(key, "quantize_bits") == 0)    ok = parseInt(value, quantizeBits);
+	else if (strcmp(key, "quantize_validate") == 0) ok = parseBool(value, quantizeValidate);
+	else if (strcmp(key, "cell_schedule") == 0)    ok = parseBool(value, cellSchedule);
+	else if (strcmp(key, "schedule_benchmark") == 0) ok = parseBool(value, scheduleBenchmark);
+	else if (strcmp(key, "store_benchmark") == 0)  ok = parseBool(value, storeBenchmark);
+	else if (strcmp(key, "cluster_size") == 0)     ok = parseInt(value, clusterSize);
+	else if (strcmp(key, "cluster_benchmark") == 0) ok = parseBool(value, clusterBenchmark);
+	else if (strcmp(key, "incremental_benchmark") == 0) ok = parseBool(value, incrementalBenchmark);
+	else if (strcmp(key, "trajectory") == 0)       trajectoryPath = value;
+	else if (strcmp(key, "counts_out") == 0)       countsPath = value;
+	else if (strcmp(key, "write_trajectory") == 0) writeTrajectoryPath = value;
+	else if (strcmp(key, "trajectory_frames") == 0) ok = parseInt(value, trajectoryFrames);
+	else if (strcmp(key, "pipeline") == 0)         ok = parseBool(value, pipeline);
+	else if (strcmp(key, "trajectory_layout") == 0) {
+		if (strcmp(value, "xyz") == 0)      trajectoryLayout = TRAJ_LAYOUT_XYZ;
+		else if (strcmp(value, "soa") == 0) trajectoryLayout = TRAJ_LAYOUT_SOA;
+		else ok = false;
+	}
+	else if (strcmp(key, "hash_mode") == 0) {
+		if (strcmp(value, "debug") == 0)     hashMode = HASH_DEBUG;
+		else if (strcmp(value, "safe") == 0) hashMode = HASH_SAFE;
+		else if (strcmp(value, "fast") == 0) hashMode = HASH_FAST;
+		else ok = false;
+	}
+	else if (strcmp(key, "sort") == 0) {
+		if (strcmp(value, "std") == 0)        sortMethod = KV_SORT_STD;
+		else if (strcmp(value, "radix") == 0) sortMethod = KV_SORT_RADIX;
+		else ok = false;
+	}
+	else if (strcmp(key, "cell_order") == 0) {
+		if (strcmp(value, "row") == 0)          cellOrder = CELL_ORDER_ROW_MAJOR;
+		else if (strcmp(value, "morton") == 0)  cellOrder = CELL_ORDER_MORTON;
+		else if (strcmp(value, "hilbert") == 0) cellOrder = CELL_ORDER_HILBERT;
+		else ok = false;
+	}
+	else {
+		printf("Config Error: unknown key \"%s\"\n", key);
+		return false;
+	}
+
+	if (!ok) {
+		printf("Config Error: bad value \"%s\" for \"%s\"\n", value, key);
+	}
+	return ok;
+}
+
+// Trims spaces and tabs from both ends
+static std::string trim(const std::string& s) {
+	size_t first = s.find_first_not_of(" \t\r\n");
+	if (first == std::string::npos) {
+		return "";
+	}
+	size_t last = s.find_last_not_of(" \t\r\n");
+	return s.substr(first, last - first + 1);
+}
+
+bool Config::loadFile(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		printf("Config Error: could not open \"%s\"\n", path);
+		return false;
+	}
+
+	bool ok = true;
+	char line[512];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), file)) {
+		++lineNumber;
+		std::string text = line;
+		size_t comment = text.find('#');
+		if (comment != std::string::npos) {
+			text = text.substr(0, comment);
+		}
+		text = trim(text);
+		if (text.empty()) {
+			continue;
+		}
+
+		size_t equals = text.find('=');
+		if (equals == std::string::npos) {
+			printf("Config Error: %s:%d expected key = value\n", path, lineNumber);
+			ok = false;
+			continue;
+		}
+		std::string key = trim(text.substr(0, equals));
+		std::string value = trim(text.substr(equals + 1));
+		ok = set(key.c_str(), value.c_str()) && ok;
+	}
+
+	fclose(file);
+	return ok;
+}
+
+bool Config::parseArgs(int argc, char** argv) {
+	setDefaults();
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			printUsage(argv[0]);
+			return false;
+		}
+
+		// Accept --key=value or key=value
+		if (arg.compare(0, 2, "--") == 0) {
+			arg = arg.substr(2);
+		}
+		size_t equals = arg.find('=');
+		if (equals == std::string::npos) {
+			printf("Config Error: expected --key=value, got \"%s\"\n", argv[i]);
+			return false;
+		}
+		std::string key = arg.substr(0, equals);
+		std::string value = arg.substr(equals + 1);
+
+		bool ok = (key == "config") ? loadFile(value.c_str()) : set(key.c_str(), value.c_str());
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Config::print() {
+	const char* hashNames[3] = { "debug", "safe", "fast" };
+	const char* orderNames[3] = { "row", "morton", "hilbert" };
+
+	printf("Config: space %d x %d x %d%s, cell %d, buffer %d, particles %d\n",
+		xDim, yDim, zDim, periodic ? " (periodic)" : "", cellSize, gridBuffer, particleCount);
+	printf("        performance_test %d, multi_thread %d, threads %d, pin_threads %d, thread_autotune %d, iterations %d\n",
+		performanceTest, multiThread, threads, pinThreads, threadAutotune, iterations);
+	printf("        record_lists %d, sorted_lists %d, hash_mode %s, sort %s, keep_order %d, cell_order %s, verlet_skin %.2f\n",
+		recordLists, sortedLists, hashNames[hashMode], sortMethod == KV_SORT_STD ? "std" : "radix",
+		keepPreviousOrder, orderNames[cellOrder], verletSkin);
+	printf("        cell_divisions %d, autotune_interval %d, quantize_bits %d, quantize_validate %d, cell_schedule %d, cluster_size %d\n\n",
+		cellDivisions, autotuneInterval, quantizeBits, quantizeValidate, cellSchedule, clusterSize);
+	if (!trajectoryPath.empty() || !writeTrajectoryPath.empty()) {
+		printf("        trajectory %s, counts_out %s, write_trajectory %s, trajectory_frames %d, trajectory_layout %s, pipeline %d\n\n",
+			trajectoryPath.empty() ? "-" : trajectoryPath.c_str(), countsPath.empty() ? "-" : countsPath.c_str(),
+			writeTrajectoryPath.empty() ? "-" : writeTrajectoryPath.c_str(), trajectoryFrames,
+			trajectoryLayout == TRAJ_LAYOUT_SOA ? "soa" : "xyz", pipeline);
+	}
+}
+
+void Config::printUsage(const char* program) {
+	printf("Usage: %s [--key=value ...] [--config=file]\n\n", program);
+	printf("Keys (a config file takes the same keys as \"key = value\" lines, # starts a comment):\n");
+	printf("  preset=small|single|multi   Base settings, apply before other keys (default multi)\n");
+	printf("  x, y, z                     Simulation space size\n");
+	printf("  cell, buffer                Cell size and grid buffer\n");
+	printf("  particles                   Particle count\n");
+	printf("  periodic=0|1                Periodic box with minimum image distances (needs 3+ cells per axis)\n");
+	printf("  performance_test=0|1        Timed runs, 0 prints and checks against all-to-all\n");
+	printf("  multi_thread=0|1            Use OpenMP threads\n");
+	printf("  threads=N                   Thread count, 0 uses one thread per physical core\n");
+	printf("  pin_threads=0|1             Bind each thread to a CPU (ignored if OMP_PROC_BIND or OMP_PLACES is set)\n");
+	printf("  thread_autotune=0|1         Time 1/4, 1/2 and all cores with and without SMT at startup, keep the fastest\n");
+	printf("  iterations=N                Iterations of each timed loop\n");
+	printf("  record_lists=0|1            Keep CSR neighbor lists for checking\n");
+	printf("  sorted_lists=0|1            NNS lists in sorted order with sorted indexes\n");
+	printf("  hash_mode=debug|safe|fast   Bounds checking of NNS::hash\n");
+	printf("  sort=std|radix              Key value sort\n");
+	printf("  keep_order=0|1              Hash in the previous frame's order, stable sort\n");
+	printf("  cell_order=row|morton|hilbert\n");
+	printf("  verlet_skin=F               Skin distance of the Verlet and cluster pair list tests\n");
+	printf("  cell_divisions=N            Subcell grid cells per cutoff, 0 autotunes between 1, 2 and 3\n");
+	printf("  autotune_interval=N         Frames between subcell grid autotune runs, 0 tunes once\n");
+	printf("  quantize_bits=N             Time the quantized position kernel (1 - 16 bits per axis), 0 skips it\n");
+	printf("  quantize_validate=0|1       Report quantized kernel count mismatches against the float kernel\n");
+	printf("  cell_schedule=0|1           countNeighbors threaded over cost balanced cell chunks, not particles\n");
+	printf("  cluster_size=0|4|8          Particles per cluster of the cluster pair kernel, 0 picks 8 with AVX2\n");
+	printf("  trajectory=path             Stream a trajectory file (see trajectory.hpp) instead of the demo\n");
+	printf("  counts_out=path             Write the neighbor counts of each streamed frame\n");
+	printf("  write_trajectory=path       Write a random trajectory of the configured particles and space\n");
+	printf("  trajectory_frames=N         Frames of write_trajectory\n");
+	printf("  trajectory_layout=xyz|soa   Frame layout of write_trajectory, xyz frames are hashed in place\n");
+	printf("  pipeline=0|1                Stream with the next frame's grid build overlapping the kernel\n");
+	printf("  kv_sort_benchmark=0|1       Per-stage std::sort vs radix sort timing\n");
+	printf("  cell_order_benchmark=0|1    Cell order timing on large grids\n");
+	printf("  sparse_grid_benchmark=0|1   Dense vs sparse grid memory and timing on mostly empty domains\n");
+	printf("  knn_benchmark=0|1           k nearest neighbor queries against brute force\n");
+	printf("  subcell_benchmark=0|1       Subcell grid cells per cutoff at several densities\n");
+	printf("  adaptive_benchmark=0|1      Dense vs adaptive grid on uniform and clustered particles\n");
+	printf("  schedule_benchmark=0|1      Particle vs cell chunk scheduling of countNeighbors, with load imbalance\n");
+	printf("  store_benchmark=0|1         Per field reorder vs the particle store's fused gather and stay sorted mode\n");
+	printf("  cluster_benchmark=0|1       Per particle kernels vs 4x4 and 8x8 cluster pairs at low to high densities\n");
+	printf("  incremental_benchmark=0|1   Incremental grid update vs full rebuild of moving particles\n");
+}
@@ -4,6 +4,8 @@
 */
 
 #include <globals.hpp>
+#include <algorithm>
+#include <omp.h>
 
 float3 make_float3(float a, float b, float c) {
     float3 temp;
@@ -11,4 +13,64 @@ float3 make_float3(float a, float b, float c) {
     temp.y = b;
     temp.z = c;
     return temp;
+}
+
+int exclusiveScan(int* offsets, int count) {
+	offsets[0] = 0;
+	std::vector<int> blockSum(omp_get_max_threads() + 1, 0);
+
+#pragma omp parallel
+	{
+		int threadCount = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+		int chunk = (count + threadCount - 1) / threadCount;
+		int begin = std::min(count, thread * chunk);
+		int end = std::min(count, begin + chunk);
+
+		// Inclusive sum of the block, count i is offsets[i + 1]
+		for (int i = begin + 1; i < end; i++) {
+			offsets[i + 1] += offsets[i];
+		}
+		blockSum[thread + 1] = (end > begin) ? offsets[end] : 0;
+
+#pragma omp barrier
+#pragma omp single
+		{
+			for (int t = 0; t < threadCount; t++) {
+				blockSum[t + 1] += blockSum[t];
+			}
+		}
+
+		int blockOffset = blockSum[thread];
+		for (int i = begin; i < end; i++) {
+			offsets[i + 1] += blockOffset;
+		}
+	}
+
+	return offsets[count];
+}
+
+void Float3SoA::resize(int particleCount) {
+	count = particleCount;
+
+	// Round up to a multiple of the padding and add one padding block, 
+	// the padding is zero and SIMD code masks anything past count
+	size_t padded = ((size_t)particleCount + SOA_PADDING - 1) / SOA_PADDING * SOA_PADDING + SOA_PADDING;
+	x.assign(padded, 0.0f);
+	y.assign(padded, 0.0f);
+	z.assign(padded, 0.0f);
+}
+
+void QuantizedPositions::resize(int particleCount, int precisionBits) {
+	count = particleCount;
+	bits = (precisionBits < 1) ? 1 : (precisionBits > 16) ? 16 : precisionBits;
+
+	if (isPacked()) {
+		packed.resize(particleCount);
+		wide.clear();
+	}
+	else {
+		wide.resize((size_t)particleCount * 3);
+		packed.clear();
+	}
 }
\ No newline at end of file
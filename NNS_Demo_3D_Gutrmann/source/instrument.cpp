@@ -0,0 +1,103 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <instrument.hpp>
+#include <sort.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <cstring>
+
+Instrumentation instrument;
+
+Instrumentation::Instrumentation() {
+	frame = -1;
+	dumpedParticles = 0;
+	memset(cellHistogram, 0, sizeof(cellHistogram));
+	maxPerCell = 0;
+	occupiedCells = 0;
+}
+
+void Instrumentation::beginFrame() {
+	++frame;
+	threads.assign(omp_get_max_threads(), ThreadCounters());
+	dumpedParticles = 0;
+	memset(cellHistogram, 0, sizeof(cellHistogram));
+	maxPerCell = 0;
+	occupiedCells = 0;
+}
+
+void Instrumentation::reserveThreads(int count) {
+	if ((int)threads.size() < count) {
+		threads.resize(count, ThreadCounters());
+	}
+}
+
+ThreadCounters& Instrumentation::thread(int threadNum) {
+	return threads[threadNum];
+}
+
+void Instrumentation::recordDumped(uint64_t count) {
+	dumpedParticles += count;
+}
+
+void Instrumentation::recordCellOccupancy(const NNS& sort) {
+	memset(cellHistogram, 0, sizeof(cellHistogram));
+	maxPerCell = 0;
+	occupiedCells = 0;
+
+	// The out-of-bounds cell is reported by recordDumped
+	for (int cell = 0; cell < sort.cellCount - 1; cell++) {
+		int perCell = 0;
+		if (sort.cellStart[cell] != 0xffffffff) {
+			perCell = sort.cellEnd[cell] - sort.cellStart[cell];
+			++occupiedCells;
+		}
+		++cellHistogram[std::min(perCell, histogramBins - 1)];
+		maxPerCell = std::max(maxPerCell, perCell);
+	}
+}
+
+void Instrumentation::printFrame() {
+	printf("Instrumentation, frame %d\n", frame);
+	printf("  Dumped (out-of-bounds) particles: %llu\n", (unsigned long long)dumpedParticles);
+	printf("  Occupied cells: %d, max particles per cell: %d\n", occupiedCells, maxPerCell);
+	printf("  Particles per cell histogram:");
+	for (int b = 0; b < histogramBins; b++) {
+		if (cellHistogram[b]) {
+			printf(" %d%s:%llu", b, (b == histogramBins - 1) ? "+" : "", (unsigned long long)cellHistogram[b]);
+		}
+	}
+	printf("\n");
+
+	uint64_t particles = 0, distanceTests = 0, hits = 0, emptyCellProbes = 0;
+	double maxBusy = 0.0, sumBusy = 0.0;
+	int activeThreads = 0;
+	for (size_t t = 0; t < threads.size(); t++) {
+		const ThreadCounters& c = threads[t];
+		if (c.busyTime == 0.0 && c.particles == 0) {
+			continue; // Thread not used this frame
+		}
+		printf("  Thread %2d: particles %9llu, distance tests %11llu, hits %10llu, empty cell probes %10llu, busy %.3f ms\n", (int)t,
+			(unsigned long long)c.particles, (unsigned long long)c.distanceTests, (unsigned long long)c.hits,
+			(unsigned long long)c.emptyCellProbes, c.busyTime * 1000.0);
+		particles += c.particles;
+		distanceTests += c.distanceTests;
+		hits += c.hits;
+		emptyCellProbes += c.emptyCellProbes;
+		maxBusy = std::max(maxBusy, c.busyTime);
+		sumBusy += c.busyTime;
+		++activeThreads;
+	}
+
+	printf("  Total: distance tests %llu, hits %llu (%.1f%%), empty cell probes %llu\n", (unsigned long long)distanceTests,
+		(unsigned long long)hits, distanceTests ? 100.0 * hits / distanceTests : 0.0, (unsigned long long)emptyCellProbes);
+	if (particles) {
+		printf("  Per particle: %.1f distance tests, %.1f neighbors\n", (double)distanceTests / particles, (double)hits / particles);
+	}
+	// 1.0 is perfectly balanced, the slowest thread sets the loop time
+	if (activeThreads && sumBusy > 0.0) {
+		printf("  Load imbalance (max / mean busy time): %.2f\n", maxBusy / (sumBusy / activeThreads));
+	}
+}
@@ -0,0 +1,240 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <knn.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+
+// Max-heap on squared distance, the root is the current kth nearest
+static void heapPush(float* dist2, int* index, int& size, int capacity, float d2, int idx) {
+	int i;
+	if (size < capacity) {
+		i = size++;
+		// Sift up
+		while (i > 0 && dist2[(i - 1) / 2] < d2) {
+			dist2[i] = dist2[(i - 1) / 2];
+			index[i] = index[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+	}
+	else {
+		if (d2 >= dist2[0]) {
+			return;
+		}
+		// Replace the root and sift down
+		i = 0;
+		while (true) {
+			int child = i * 2 + 1;
+			if (child >= size) {
+				break;
+			}
+			if (child + 1 < size && dist2[child + 1] > dist2[child]) {
+				++child;
+			}
+			if (dist2[child] <= d2) {
+				break;
+			}
+			dist2[i] = dist2[child];
+			index[i] = index[child];
+			i = child;
+		}
+	}
+	dist2[i] = d2;
+	index[i] = idx;
+}
+
+void KNearest::init(int neighbors) {
+	k = neighbors;
+	queryCount = 0;
+	cellsVisited = 0;
+	distanceTests = 0;
+}
+
+void KNearest::resize(int count) {
+	queryCount = count;
+	indices.resize((size_t)count * k);
+	distances.resize((size_t)count * k);
+
+	size_t heapSize = (size_t)omp_get_max_threads() * k;
+	if (heapDist2.size() < heapSize) {
+		heapDist2.resize(heapSize);
+		heapIndex.resize(heapSize);
+	}
+}
+
+void KNearest::queryOne(NNS& sort, const float* loc, float px, float py, float pz, int skipSorted, int outRow, int thread,
+	long long& cells, long long& tests) {
+	float* dist2 = &heapDist2[(size_t)thread * k];
+	int* index = &heapIndex[(size_t)thread * k];
+	int size = 0;
+
+	// Cell of the point, same math as hashing, clamped so points outside the grid still search it
+	float xShift = sort.simDimx_buffered / 2.0f;
+	float yShift = sort.simDimy_buffered / 2.0f;
+	float zShift = sort.simDimz_buffered / 2.0f;
+	int cx = std::min(std::max((int)(px + xShift) / sort.cellLength, 0), sort.cellDimx - 1);
+	int cy = std::min(std::max((int)(py + yShift) / sort.cellLength, 0), sort.cellDimy - 1);
+	int cz = std::min(std::max((int)(pz + zShift) / sort.cellLength, 0), sort.cellDimz - 1);
+
+	// Distance from the point to the nearest face of its cell, shell r is at least (r - 1) cells further
+	float cell = (float)sort.cellLength;
+	float face = std::min(std::min(px + xShift - cx * cell, (cx + 1) * cell - (px + xShift)),
+		std::min(std::min(py + yShift - cy * cell, (cy + 1) * cell - (py + yShift)),
+			std::min(pz + zShift - cz * cell, (cz + 1) * cell - (pz + zShift))));
+	face = std::max(face, 0.0f);
+
+	int maxShell = std::max(sort.cellDimx, std::max(sort.cellDimy, sort.cellDimz));
+	int lastCell = sort.cellCount - 1; // Excluded out-of-bounds cell
+
+	for (int r = 0; r <= maxShell; r++) {
+		if (r > 0 && size == k) {
+			float bound = (r - 1) * cell + face;
+			if (bound * bound >= dist2[0]) {
+				break; // Nothing in this shell or beyond can be closer than the kth
+			}
+		}
+
+		for (int dz = -r; dz <= r; dz++) {
+			int z = cz + dz;
+			if (z < 0 || z >= sort.cellDimz) {
+				continue;
+			}
+			for (int dy = -r; dy <= r; dy++) {
+				int y = cy + dy;
+				if (y < 0 || y >= sort.cellDimy) {
+					continue;
+				}
+				// Inner rows of the shell only have their two end cells
+				bool fullRow = (dz == -r || dz == r || dy == -r || dy == r);
+				int dxStep = (fullRow || r == 0) ? 1 : 2 * r;
+
+				for (int dx = -r; dx <= r; dx += dxStep) {
+					int x = cx + dx;
+					if (x < 0 || x >= sort.cellDimx) {
+						continue;
+					}
+
+					int target = sort.orderedCell(x + y * sort.cellDimx + z * sort.cellDimx * sort.cellDimy);
+					if (target >= lastCell || sort.cellStart[target] == 0xffffffff) {
+						continue;
+					}
+					++cells;
+
+					uint32_t endIndex = sort.cellEnd[target];
+					for (uint32_t j = sort.cellStart[target]; j < endIndex; j++) {
+						if ((int)j == skipSorted) {
+							continue;
+						}
+						float ddx = loc[j * 3 + 0] - px;
+						float ddy = loc[j * 3 + 1] - py;
+						float ddz = loc[j * 3 + 2] - pz;
+						heapPush(dist2, index, size, k, (ddx * ddx) + (ddy * ddy) + (ddz * ddz), (int)j);
+						++tests;
+					}
+				}
+			}
+		}
+	}
+
+	// Pop the heap from the back, largest first, so the row ends up nearest first
+	float* outDist = &distances[(size_t)outRow * k];
+	int* outIndex = &indices[(size_t)outRow * k];
+	for (int n = size; n < k; n++) {
+		outDist[n] = INFINITY;
+		outIndex[n] = -1;
+	}
+	while (size > 0) {
+		int last = size - 1;
+		outDist[last] = sqrtf(dist2[0]);
+		outIndex[last] = sort.cellIndexPair[index[0]].index;
+
+		// Move the last entry to the root and sift it down
+		float d2 = dist2[last];
+		int idx = index[last];
+		size = last;
+		int i = 0;
+		while (true) {
+			int child = i * 2 + 1;
+			if (child >= size) {
+				break;
+			}
+			if (child + 1 < size && dist2[child + 1] > dist2[child]) {
+				++child;
+			}
+			if (dist2[child] <= d2) {
+				break;
+			}
+			dist2[i] = dist2[child];
+			index[i] = index[child];
+			i = child;
+		}
+		if (size > 0) {
+			dist2[i] = d2;
+			index[i] = idx;
+		}
+	}
+}
+
+void KNearest::queryParticles(NNS& sort, std::vector<float>& sortedLoc) {
+	resize(sort.particleCount);
+	const float* loc = sortedLoc.data();
+	long long cells = 0, tests = 0;
+
+	// Sorted order, neighboring queries walk the same cells
+	int currIdx = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:cells, tests)
+	for (currIdx = 0; currIdx < sort.particleCount; currIdx++) {
+		queryOne(sort, loc, loc[currIdx * 3 + 0], loc[currIdx * 3 + 1], loc[currIdx * 3 + 2], currIdx,
+			sort.cellIndexPair[currIdx].index, omp_get_thread_num(), cells, tests);
+	}
+
+	cellsVisited = cells;
+	distanceTests = tests;
+}
+
+void KNearest::queryPoints(NNS& sort, std::vector<float>& sortedLoc, const std::vector<float>& points) {
+	int count = (int)(points.size() / 3);
+	resize(count);
+	const float* loc = sortedLoc.data();
+	long long cells = 0, tests = 0;
+
+	int q = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:cells, tests)
+	for (q = 0; q < count; q++) {
+		queryOne(sort, loc, points[q * 3 + 0], points[q * 3 + 1], points[q * 3 + 2], -1, q, omp_get_thread_num(), cells, tests);
+	}
+
+	cellsVisited = cells;
+	distanceTests = tests;
+}
+
+void KNearest::queryParticlesBruteForce(std::vector<float>& locations) {
+	int count = (int)(locations.size() / 3);
+	resize(count);
+
+	int currIdx = 0;
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		std::vector<std::pair<float, int>> candidates;
+		candidates.reserve(count);
+		for (int j = 0; j < count; j++) {
+			if (j == currIdx) {
+				continue;
+			}
+			float dx = locations[j * 3 + 0] - locations[currIdx * 3 + 0];
+			float dy = locations[j * 3 + 1] - locations[currIdx * 3 + 1];
+			float dz = locations[j * 3 + 2] - locations[currIdx * 3 + 2];
+			candidates.push_back(std::make_pair((dx * dx) + (dy * dy) + (dz * dz), j));
+		}
+
+		int found = std::min(k, (int)candidates.size());
+		std::partial_sort(candidates.begin(), candidates.begin() + found, candidates.end());
+		for (int n = 0; n < k; n++) {
+			distances[(size_t)currIdx * k + n] = (n < found) ? sqrtf(candidates[n].first) : INFINITY;
+			indices[(size_t)currIdx * k + n] = (n < found) ? candidates[n].second : -1;
+		}
+	}
+}
@@ -0,0 +1,58 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <listSkin.hpp>
+#include <globals.hpp>
+#include <algorithm>
+
+void ListSkin::initSkin(int count, float skinDist) {
+	skin = skinDist;
+	buildLocations.resize((size_t)count * 3);
+
+	buildCount = 0;
+	frameCount = 0;
+	lastMaxDisplacement = 0.0f;
+}
+
+float ListSkin::maxDisplacement(const std::vector<float>& locations) const {
+	int count = (int)(buildLocations.size() / 3);
+	float maxDist2 = 0.0f;
+	int i = 0;
+
+#pragma omp parallel for reduction(max:maxDist2)
+	for (i = 0; i < count; i++) {
+		float dx = locations[i * 3 + 0] - buildLocations[i * 3 + 0];
+		float dy = locations[i * 3 + 1] - buildLocations[i * 3 + 1];
+		float dz = locations[i * 3 + 2] - buildLocations[i * 3 + 2];
+		maxDist2 = std::max(maxDist2, (dx * dx) + (dy * dy) + (dz * dz));
+	}
+
+	return sqrtf(maxDist2);
+}
+
+bool ListSkin::updateGrid(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	++frameCount;
+
+	if (buildCount > 0) {
+		lastMaxDisplacement = maxDisplacement(locations);
+
+		// Any pair now within cutoff was within cutoff + skin at the last build
+		if (lastMaxDisplacement <= skin * 0.5f) {
+			sort.reorder(locations, sortedLoc);
+			return false;
+		}
+	}
+
+	sort.hash(locations);
+	sort.kvSort();
+	sort.findCellStartEnd();
+	sort.reorder(locations, sortedLoc);
+	return true;
+}
+
+void ListSkin::recordBuild(const std::vector<float>& locations) {
+	std::copy(locations.begin(), locations.begin() + buildLocations.size(), buildLocations.begin());
+	++buildCount;
+}
@@ -7,32 +7,98 @@
 #include <globals.hpp>
 #include <sort.hpp>
 #include <particle.hpp>
-#include <time.h>
+#include <benchmark.hpp>
+#include <verlet.hpp>
+#include <sparseGrid.hpp>
+#include <subcellGrid.hpp>
+#include <adaptiveGrid.hpp>
+#include <trajectory.hpp>
+#include <pipeline.hpp>
+#include <topology.hpp>
+#include <particleStore.hpp>
+#include <clusterPairs.hpp>
+#include <algorithm>
+#include <config.hpp>
+#include <timer.hpp>
+#include <instrument.hpp>
 #include <omp.h>
 
-int main() {
-#if PERFORMANCE_TEST && MULTI_THREAD
-	printf("omp_get_max_threads() = %d\n", omp_get_max_threads());
-	int numThreads = omp_get_max_threads() / 2;
-	omp_set_num_threads(numThreads);
-	printf("omp_get_max_threads() = %d\n\n", omp_get_max_threads());
-#endif
+int main(int argc, char** argv) {
+	// Settings come from the command line or a config file, run with --help for the keys
+	Config config;
+	if (!config.parseArgs(argc, argv)) {
+		return 1;
+	}
+	config.print();
 
-	// Feel free to change these values to test
-	int xDimension = X_DIM;
-	int yDimension = Y_DIM;
-	int zDimension = Z_DIM;
-	int cellSize = CELL_SIZE;
-	int gridBuffer = GRID_BUFFER;
-	int particleCount = PARTICLE_COUNT;
+	// One thread per physical core by default, the NNS runs slower on SMT siblings (see the output at the end)
+	CpuTopology topology;
+	topology.detect();
+	ThreadSetting threadSetting = { 1, false };
+	if (config.multiThread) {
+		topology.print();
+		threadSetting.threads = (config.threads > 0) ? config.threads : topology.coreCount;
+		bool pinned = applyThreads(topology, threadSetting, config.pinThreads);
+		printf("omp_get_max_threads() = %d%s\n\n", omp_get_max_threads(), pinned ? ", pinned" : "");
+	}
+	else {
+		omp_set_num_threads(1);
+	}
 
+	int xDimension = config.xDim;
+	int yDimension = config.yDim;
+	int zDimension = config.zDim;
+	int cellSize = config.cellSize;
+	int gridBuffer = config.gridBuffer;
+	int particleCount = config.particleCount;
+	int iterations = config.iterations;
+
+	// Trajectory files replace the random particles of the demo
+	if (!config.writeTrajectoryPath.empty()) {
+		if (!writeRandomTrajectory(config.writeTrajectoryPath.c_str(), particleCount, xDimension, yDimension, zDimension,
+			config.trajectoryFrames, 0.05f, config.trajectoryLayout)) {
+			return 1;
+		}
+		if (config.trajectoryPath.empty()) {
+			return 0;
+		}
+	}
+	if (!config.trajectoryPath.empty()) {
+		if (config.pipeline) {
+			unpinThreads(topology);
+		}
+		bool ok = streamTrajectory(config.trajectoryPath.c_str(), config.countsPath.empty() ? nullptr : config.countsPath.c_str(),
+			cellSize, gridBuffer, config.hashMode, config.pipeline);
+		return ok ? 0 : 1;
+	}
+
+	// Measured on a throwaway grid of the configured size, so the grid below is first touched by
+	// the chosen threads. The seed is reset so the particles are the same as without autotuning
+	if (config.multiThread && config.threadAutotune) {
+		NNS tuneGrid;
+		Particle tuneParticles;
+		tuneGrid.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer, config.periodic);
+		tuneParticles.init(particleCount, xDimension, yDimension, zDimension);
+		threadSetting = autotuneThreads(topology, config.pinThreads, 5, [&]() {
+			tuneGrid.build(tuneParticles.locations, tuneParticles.sortedLoc);
+			tuneParticles.countNeighbors(tuneGrid);
+		});
+		srand(1);
+	}
 
 	NNS sortObject;
 	Particle partObject;
 
-	sortObject.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer);
+	sortObject.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer, config.periodic);
 	partObject.init(particleCount, xDimension, yDimension, zDimension);
 
+	sortObject.hashMode = config.hashMode;
+	sortObject.setSortMethod(config.sortMethod, config.keepPreviousOrder);
+	sortObject.setCellOrder(config.cellOrder);
+	partObject.recordLists = config.recordLists;
+	partObject.sortedLists = config.sortedLists;
+	partObject.cellSchedule = config.cellSchedule;
+
 	// --- Simulation loop starts here ----------------------------------------------------
 	sortObject.hash(partObject.locations);
 
@@ -45,26 +111,43 @@ int main() {
 
 	// Improves memory access pattern, also the algorithm functions in sorted order
 	sortObject.reorder(partObject.locations, partObject.sortedLoc);
+	// NNS::build(locations, sortedLoc) can replace the four steps above
 
 
 	partObject.countNeighbors(sortObject);
 	partObject.printNeighborCount(); printf("\n\n");
+#if NNS_INSTRUMENT
+	instrument.printFrame(); printf("\n\n");
+#endif
 	// --- Simulation loop ends here ------------------------------------------------------
 
 
 	
-#if !PERFORMANCE_TEST
-	// Testing (Debug)
-	partObject.countNeighborsN2(cellSize);
-	partObject.printNeighborN2Count(); printf("\n\n");
-	partObject.check(); printf("\n\n");
-#endif
+	if (!config.performanceTest) {
+		// Testing (Debug), nns_tests (testMain.cpp) checks the other kernels and grids
+		if (sortObject.periodic) {
+			partObject.countNeighborsN2Periodic(sortObject);
+		}
+		else {
+			partObject.countNeighborsN2(cellSize);
+		}
+		partObject.printNeighborN2Count(); printf("\n\n");
+		if (config.recordLists) {
+			partObject.check(); printf("\n\n");
+		}
+		printf("NNS counts %s the%s all-to-all\n\n", (partObject.neighborCount == partObject.neighborCountN2) ? "match" : "do NOT match",
+			sortObject.periodic ? " minimum image" : "");
+		return 0;
+	}
+
+	// Performance testing, the timed kernels don't record lists except where noted
+	partObject.recordLists = false;
 
-#if PERFORMANCE_TEST
-	clock_t t;
-	float nnsTime, ataTime;
-	// Running 1000x to get a larger time for the timer, and to get a more repeatable performance number
-	printf("Running 1000 iterations of NNS and all-to-all\n\n");
+	// Wall clock time, clock() sums CPU time over the threads and hides the multithreaded speedup
+	double t;
+	double nnsTime, ataTime;
+	// Running many iterations (1000 by default) to get a larger time for the timer, and to get a more repeatable performance number
+	printf("Running %d iterations of NNS and all-to-all\n\n", iterations);
 	
 	printf("Simulation space is about: %d x %d x %d\n", xDimension, yDimension, zDimension);
 	printf("Particle count:            %d\n\n", particleCount);
@@ -73,33 +156,266 @@ int main() {
 
 	// NNS
 	{
-		t = clock();
-		for (int i = 0; i < 1000; i++) {
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
 			sortObject.hash(partObject.locations);
 			sortObject.kvSort();
 			sortObject.findCellStartEnd();
 			sortObject.reorder(partObject.locations, partObject.sortedLoc);
 			partObject.countNeighbors(sortObject);
+#if NNS_INSTRUMENT
+			// Printing every frame would swamp the timing output, the last one is representative
+			if (i == iterations - 1) {
+				instrument.printFrame();
+			}
+#endif
 		}
-		t = clock() - t;
-		nnsTime = ((float)t) / CLOCKS_PER_SEC;
+		nnsTime = wallTime() - t;
 		printf("NNS time %0.3f\n", nnsTime);
 	}
 
+	// Same frames with the build of the next frame overlapping the kernel of the current one
+	// Nested teams, the pinning is lifted for it
+	{
+		unpinThreads(topology);
+		FramePipeline pipeline;
+		pipeline.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer, config.periodic);
+		for (NNS& grid : pipeline.grids) {
+			grid.hashMode = config.hashMode;
+			grid.setSortMethod(config.sortMethod, config.keepPreviousOrder);
+			grid.setCellOrder(config.cellOrder);
+		}
+		double pipelineTime = pipeline.run(partObject, iterations,
+			[&](int) { return (const float*)partObject.locations.data(); }, [](int) {});
+		printf("NNS pipelined time %0.3f (%.1f frames/s vs %.1f sequential, build on %d of %d threads)\n", pipelineTime,
+			iterations / pipelineTime, iterations / nnsTime, pipeline.buildThreads, pipeline.totalThreads);
+		applyThreads(topology, threadSetting, config.pinThreads);
+	}
+
+	// Same with the CSR neighbor lists filled by a second pass
+	{
+		partObject.recordLists = true;
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighbors(sortObject);
+		}
+		printf("NNS with %s CSR lists time %0.3f (%d entries)\n", partObject.sortedLists ? "sorted" : "original",
+			wallTime() - t, (int)partObject.neighborList.size());
+		partObject.recordLists = false;
+	}
+
+	// Same with the counting written as a forEachNeighbor functor
+	{
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighborsGeneric(sortObject);
+		}
+		printf("NNS forEachNeighbor time %0.3f\n", wallTime() - t);
+	}
+
+	// The SIMD, symmetric and Verlet kernels are for open domains
+	if (sortObject.periodic) {
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			partObject.countNeighborsN2Periodic(sortObject);
+		}
+		ataTime = wallTime() - t;
+		printf("Periodic all-to-all time %0.3f\n", ataTime);
+		printf("\nPerformance difference: %.1fx\n", ataTime / nnsTime);
+		return 0;
+	}
+
+	// NNS with SoA sorted data and the SIMD kernel
+	{
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedSoA);
+			partObject.countNeighborsSIMD(sortObject);
+		}
+		printf("NNS SoA %s time %0.3f\n", simdLevelName(partObject.simdLevel), wallTime() - t);
+	}
+
+	// NNS with quantized cell-relative positions
+	if (config.quantizeBits > 0) {
+		partObject.sortedQuantized.resize(particleCount, config.quantizeBits);
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedQuantized);
+			partObject.countNeighborsQuantized(sortObject);
+		}
+		printf("NNS quantized %d bits time %0.3f\n", partObject.sortedQuantized.bits, wallTime() - t);
+
+		if (config.quantizeValidate) {
+			sortObject.reorder(partObject.locations, partObject.sortedLoc);
+			partObject.validateQuantized(sortObject);
+		}
+	}
+
+	// NNS visiting each pair once (half stencil)
+	{
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighborsSymmetric(sortObject);
+		}
+		printf("NNS symmetric time %0.3f\n", wallTime() - t);
+	}
+
+	// Same with the counting written as a forEachPair functor
+	{
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			sortObject.hash(partObject.locations);
+			sortObject.kvSort();
+			sortObject.findCellStartEnd();
+			sortObject.reorder(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighborsPairwiseGeneric(sortObject);
+		}
+		printf("NNS forEachPair time %0.3f\n", wallTime() - t);
+	}
+
+	// Subcell grid, cells per cutoff fixed or chosen by the autotuner (tuning runs are timed too)
+	{
+		SubcellGrid subcell;
+		subcell.init(particleCount, (float)cellSize, std::max(config.cellDivisions, 1));
+		subcell.autotuneInterval = config.autotuneInterval;
+		auto frame = [&]() {
+			subcell.build(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighbors(subcell);
+		};
+
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
+			if (config.cellDivisions == 0 && subcell.tuneDue()) {
+				subcell.autotune({ 1, 2, 3 }, 3, frame);
+			}
+			frame();
+		}
+		printf("Subcell grid time %0.3f (%d divisions, %d stencil cells%s)\n", wallTime() - t, subcell.divisions,
+			(int)subcell.stencil.size(), (config.cellDivisions == 0) ? ", autotuned" : "");
+	}
+
 	// All-to-all
 	{
-		t = clock();
-		for (int i = 0; i < 1000; i++) {
+		t = wallTime();
+		for (int i = 0; i < iterations; i++) {
 			partObject.countNeighborsN2(cellSize);
 		}
-		t = clock() - t;
-		ataTime = ((float)t) / CLOCKS_PER_SEC;
+		ataTime = wallTime() - t;
 		printf("All-to-all time %0.3f\n", ataTime);
 	}
 
 	printf("\nPerformance difference: %.1fx\n", ataTime / nnsTime);
 
-#endif
+	// Verlet lists, particles move a little every iteration (moving is not timed)
+	{
+		float verletSkin = config.verletSkin;
+		float stepSize = 0.01f;
+		VerletList verlet;
+		verlet.init(particleCount, (float)cellSize, verletSkin);
+
+		double total = 0.0;
+		for (int i = 0; i < iterations; i++) {
+			partObject.jitter(stepSize);
+
+			t = wallTime();
+			verlet.update(sortObject, partObject.locations, partObject.sortedLoc);
+			verlet.countNeighbors(sortObject, partObject.sortedLoc, partObject.neighborCount);
+			total += wallTime() - t;
+		}
+		printf("\nNNS Verlet list time %0.3f (moving particles, step up to %.2f)\n", total, stepSize);
+		verlet.printStats();
+	}
+
+	// Cluster pair lists with the same skin and moving particles, the time is the whole frame: the grid
+	// and list build on rebuild frames, the gather and lane refresh otherwise, and the i-cluster x j-cluster kernel
+	{
+		float stepSize = 0.01f;
+		ClusterPairList clusters;
+		clusters.init(particleCount, (float)cellSize, config.verletSkin, config.clusterSize);
+
+		double total = 0.0;
+		for (int i = 0; i < iterations; i++) {
+			partObject.jitter(stepSize);
+
+			t = wallTime();
+			clusters.update(sortObject, partObject.locations, partObject.sortedLoc);
+			clusters.countNeighbors(sortObject, partObject.neighborCount);
+			total += wallTime() - t;
+		}
+		printf("\nNNS cluster pairs %dx%d time %0.3f (moving particles, step up to %.2f)\n", clusters.clusterSize,
+			clusters.clusterSize, total, stepSize);
+		clusters.printStats();
+	}
+
+	// Per-stage timings with sweeps and JSON/CSV output: nns_benchmark --help
+
+	if (config.kvSortBenchmark) {
+		printf("\n");
+		benchmarkKvSort(cellSize, gridBuffer);
+	}
+
+	if (config.cellOrderBenchmark) {
+		printf("\n");
+		benchmarkCellOrder(cellSize, gridBuffer);
+	}
+
+	if (config.sparseGridBenchmark) {
+		printf("\n");
+		benchmarkSparseGrid(cellSize, gridBuffer);
+	}
+
+	if (config.knnBenchmark) {
+		printf("\n");
+		benchmarkKnn(cellSize, gridBuffer);
+	}
+
+	if (config.subcellBenchmark) {
+		printf("\n");
+		benchmarkSubcellGrid(cellSize, gridBuffer);
+	}
+
+	if (config.adaptiveBenchmark) {
+		printf("\n");
+		benchmarkAdaptiveGrid(cellSize, gridBuffer);
+	}
+
+	if (config.scheduleBenchmark) {
+		printf("\n");
+		benchmarkSchedule(cellSize, gridBuffer);
+	}
+
+	if (config.storeBenchmark) {
+		printf("\n");
+		benchmarkParticleStore(cellSize, gridBuffer);
+	}
+
+	if (config.clusterBenchmark) {
+		printf("\n");
+		benchmarkClusterPairs(cellSize, gridBuffer, config.verletSkin);
+	}
+
+	if (config.incrementalBenchmark) {
+		printf("\n");
+		benchmarkIncremental(cellSize, gridBuffer);
+	}
 
 	return 0;
 }
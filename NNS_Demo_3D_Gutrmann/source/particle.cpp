@@ -5,7 +5,17 @@
 
 #include <particle.hpp>
 #include <sort.hpp>
+#include <sparseGrid.hpp>
+#include <subcellGrid.hpp>
+#include <adaptiveGrid.hpp>
 #include <globals.hpp>
+#include <instrument.hpp>
+#include <topology.hpp>
+#include <timer.hpp>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <omp.h>
 
 void Particle::init(int particleCount, int dimx, int dimy, int dimz) {
 	float halfDimx = dimx / 2.0f;
@@ -26,21 +36,64 @@ void Particle::init(int particleCount, int dimx, int dimy, int dimz) {
 	}
 
 	sortedLoc.resize(locations.size());
+	firstTouch(sortedLoc);
+	sortedSoA.resize(particleCount);
+	simdLevel = detectSimdLevel();
+	recordLists = false;
+	sortedLists = false;
+	cellSchedule = false;
 	neighborCountN2.resize(neighborCount.size());
+}
+
+void Particle::initClustered(int particleCount, int dimx, int dimy, int dimz, int clusterCount, float spread) {
+	init(particleCount, dimx, dimy, dimz);
+
+	float half[3] = { dimx / 2.0f, dimy / 2.0f, dimz / 2.0f };
+	std::vector<float> centers(clusterCount * 3);
+	for (int c = 0; c < clusterCount * 3; c++) {
+		centers[c] = ((rand() % 1000) / 1000.0f - 0.5f) * half[c % 3];
+	}
 
-	std::vector<std::vector<int>> temp(neighborCount.size());
-	neighborList = temp;
-	neighborN2List = temp;
+	// Box-Muller normal offsets around the particle's cluster center
+	for (int i = 0; i < particleCount; i++) {
+		int c = rand() % clusterCount;
+		for (int a = 0; a < 3; a++) {
+			float u1 = (rand() % 10000 + 1) / 10001.0f;
+			float u2 = (rand() % 10000) / 10000.0f;
+			float v = centers[c * 3 + a] + spread * sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+			locations[i * 3 + a] = std::min(std::max(v, -half[a]), half[a] - 0.1f);
+		}
+	}
+}
+
+void Particle::jitter(float maxStep) {
+	for (int i = 0; i < count * 3; i++) {
+		locations[i] += ((rand() % 2001) / 1000.0f - 1.0f) * maxStep;
+	}
+}
+
+void Particle::confine(int dimx, int dimy, int dimz) {
+	float half[3] = { dimx / 2.0f, dimy / 2.0f, dimz / 2.0f };
+	for (int i = 0; i < count * 3; i++) {
+		locations[i] = std::min(std::max(locations[i], -half[i % 3]), half[i % 3] - 0.1f);
+	}
 }
 
 // All-to-all interaction alogithim O(n^2)
 void Particle::countNeighborsN2(int cellLength) {
+	countNeighborsN2Impl<false>(cellLength);
+	if (recordLists) {
+		allocateN2Lists();
+		countNeighborsN2Impl<true>(cellLength);
+	}
+}
+
+template <bool Fill>
+void Particle::countNeighborsN2Impl(int cellLength) {
 
 	int currIdx = 0;
 
-#if PERFORMANCE_TEST && MULTI_THREAD
 #pragma omp parallel for
-#endif
     for (currIdx = 0; currIdx < count; currIdx++) {
 		float3 thisLoc = make_float3(locations[currIdx * 3 + 0], locations[currIdx * 3 + 1], locations[currIdx * 3 + 2]);
 
@@ -55,10 +108,10 @@ void Particle::countNeighborsN2(int cellLength) {
 				float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
 				if (dist < (float)cellLength)
 				{
+					if constexpr (Fill) {
+						neighborN2List[neighborN2Offsets[currIdx] + localCount] = checkIdx;
+					}
 					++localCount;
-#if !PERFORMANCE_TEST
-					neighborN2List[currIdx].push_back(checkIdx);
-#endif
 				}
 			}
 		}
@@ -68,54 +121,587 @@ void Particle::countNeighborsN2(int cellLength) {
     }
 }
 
+// All-to-all with the minimum image convention in the periodic box of sort
+void Particle::countNeighborsN2Periodic(NNS& sort) {
+	countNeighborsN2PeriodicImpl<false>(sort);
+	if (recordLists) {
+		allocateN2Lists();
+		countNeighborsN2PeriodicImpl<true>(sort);
+	}
+}
+
+// Wraps the positions like NNS::reorder and then takes the nearest image of each difference,
+// the same float operations as the shifts of the periodic stencil so the counts agree exactly
+template <bool Fill>
+void Particle::countNeighborsN2PeriodicImpl(NNS& sort) {
+	std::vector<float3> wrapped(count);
+	for (int i = 0; i < count; i++) {
+		wrapped[i] = sort.wrapPosition(locations[i * 3 + 0], locations[i * 3 + 1], locations[i * 3 + 2]);
+	}
+	float3 box = sort.boxSize;
+
+	int currIdx = 0;
+
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		float3 thisLoc = wrapped[currIdx];
+
+		int localCount = 0;
+
+		for (int checkIdx = 0; checkIdx < count; checkIdx++) {
+
+			if (checkIdx != currIdx) // Dont compute with its self
+			{
+				float3 p2pVec = make_float3(wrapped[checkIdx].x - thisLoc.x, wrapped[checkIdx].y - thisLoc.y, wrapped[checkIdx].z - thisLoc.z);
+				p2pVec.x -= box.x * roundf(p2pVec.x / box.x);
+				p2pVec.y -= box.y * roundf(p2pVec.y / box.y);
+				p2pVec.z -= box.z * roundf(p2pVec.z / box.z);
+				float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+				if (dist < (float)sort.cellLength)
+				{
+					if constexpr (Fill) {
+						neighborN2List[neighborN2Offsets[currIdx] + localCount] = checkIdx;
+					}
+					++localCount;
+				}
+			}
+		}
+
+		neighborCountN2[currIdx] = localCount;
+	}
+}
+
 // Using the NNS to run "short" range algorithm
 void Particle::countNeighbors(NNS& sort) {
+	if (cellSchedule) {
+		sort.buildSchedule(omp_get_max_threads());
+	}
+
+	if (sort.periodic) {
+		countNeighborsImpl<false, true>(sort);
+	}
+	else {
+		countNeighborsImpl<false, false>(sort);
+	}
+
+	if (recordLists) {
+		allocateLists(sort);
+		if (sort.periodic) {
+			countNeighborsImpl<true, true>(sort);
+		}
+		else {
+			countNeighborsImpl<true, false>(sort);
+		}
+	}
+}
+
+// Periodic grids add the minimum image shift of the neighbor cell, looked up once per cell
+// The instrumentation counters only count the count pass
+template <bool Fill, bool Periodic>
+void Particle::countNeighborsImpl(NNS& sort) {
+
+	int i = 0;
+
+#if NNS_INSTRUMENT
+	instrument.reserveThreads(omp_get_max_threads());
+#endif
+
+#pragma omp parallel
+	{
+#if NNS_INSTRUMENT
+		ThreadCounters& counters = instrument.thread(omp_get_thread_num());
+		double busyStart = wallTime();
+#endif
+
+		auto particle = [&](int currIdx) {
+			float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
+			int thisCell = sort.cellIndexPair[currIdx].cellID;
+			int originalIndex = sort.cellIndexPair[currIdx].index;
+
+			int localCount = 0;
+			int* list = nullptr;
+			if constexpr (Fill) {
+				list = neighborList.data() + neighborOffsets[sortedLists ? currIdx : originalIndex];
+			}
+
+			// Check the cells around the particle 
+			for (int t = 0; t < 27; t++) {
+
+				// Iterate through the 27 neighbor cells
+				int targetCell = sort.neighborCell(thisCell, t);
+
+				if (targetCell < sort.cellCount - 1) // Excludes the one out-of-bounds cell
+				{
+					uint32_t startIndex = sort.cellStart[targetCell];
+					uint32_t endIndex = sort.cellEnd[targetCell];
+
+					if (startIndex != 0xffffffff)          // cell is not empty
+					{
+						float3 shift = make_float3(0.0f, 0.0f, 0.0f);
+						if constexpr (Periodic) {
+							shift = sort.neighborShift(thisCell, t);
+						}
+
+						for (uint32_t checkIdx = startIndex; checkIdx < endIndex; checkIdx++) { // This iterator is going through indexes of the sorted data
+							// If data is not sorted will need to use the result of the keyValue sort to get the unsorted (original) index
+
+							if (checkIdx != currIdx) // Dont compute with its self
+							{
+								float3 checkIdxLoc = make_float3(sortedLoc[checkIdx * 3 + 0], sortedLoc[checkIdx * 3 + 1], sortedLoc[checkIdx * 3 + 2]);
+
+								// Careful with this vectors direction for different interactions
+								float3 p2pVec = make_float3(checkIdxLoc.x - thisLoc.x, checkIdxLoc.y - thisLoc.y, checkIdxLoc.z - thisLoc.z);
+								if constexpr (Periodic) {
+									p2pVec = make_float3(p2pVec.x + shift.x, p2pVec.y + shift.y, p2pVec.z + shift.z);
+								}
+
+								float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+
+#if NNS_INSTRUMENT
+								if constexpr (!Fill) {
+									++counters.distanceTests;
+								}
+#endif
+								if (dist < (float)sort.cellLength)
+								{
+									if constexpr (Fill) {
+										// Get checkIdx's unsorted index to access unsorted data
+										list[localCount] = sortedLists ? (int)checkIdx : sort.cellIndexPair[checkIdx].index;
+									}
+									++localCount;
+								}
+							}
+						}
+					}
+#if NNS_INSTRUMENT
+					else if constexpr (!Fill) {
+						++counters.emptyCellProbes;
+					}
+#endif
+				}
+			}
+
+			neighborCount[originalIndex] = localCount;
+
+#if NNS_INSTRUMENT
+			if constexpr (!Fill) {
+				++counters.particles;
+				counters.hits += localCount;
+			}
+#endif
+		};
+
+		// nowait so the busy time of each thread doesn't include waiting for the others
+		if (cellSchedule) {
+			// Cost balanced chunks of cells (NNS::buildSchedule), taken as threads become free
+			int chunkCount = (int)sort.workChunks.size() - 1;
+			int c = 0;
+#pragma omp for schedule(dynamic, 1) nowait
+			for (c = 0; c < chunkCount; c++) {
+				for (int w = sort.workChunks[c]; w < sort.workChunks[c + 1]; w++) {
+					int cell = sort.workCells[w];
+					for (uint32_t p = sort.cellStart[cell]; p < sort.cellEnd[cell]; p++) {
+						particle((int)p);
+					}
+				}
+			}
+		}
+		else {
+#pragma omp for nowait
+			for (i = 0; i < count; i++) {
+				particle(i);
+			}
+		}
+
+#if NNS_INSTRUMENT
+		if constexpr (!Fill) {
+			counters.busyTime += wallTime() - busyStart;
+		}
+#endif
+	}
+}
+
+// Using the NNS with the sorted SoA positions, each neighbor cell is a contiguous range 
+// that the SIMD kernel processes several particles at a time
+void Particle::countNeighborsSIMD(NNS& sort) {
+
+	CountInRangesFunc countInRanges = getCountInRangesFunc(simdLevel);
+	float cutoff2 = squaredCutoff((float)sort.cellLength); // Same pairs as the sqrtf test of countNeighbors
+	const float* x = sortedSoA.x.data();
+	const float* y = sortedSoA.y.data();
+	const float* z = sortedSoA.z.data();
+
+	int currIdx = 0;
+
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		int thisCell = sort.cellIndexPair[currIdx].cellID;
+		int originalIndex = sort.cellIndexPair[currIdx].index;
+
+		// Gather the non-empty neighbor cell ranges
+		uint32_t ranges[27 * 2];
+		int rangeCount = 0;
+		for (int t = 0; t < 27; t++) {
+			int targetCell = sort.neighborCell(thisCell, t);
+
+			if (targetCell < sort.cellCount - 1 && sort.cellStart[targetCell] != 0xffffffff) {
+				ranges[rangeCount * 2 + 0] = sort.cellStart[targetCell];
+				ranges[rangeCount * 2 + 1] = sort.cellEnd[targetCell];
+				++rangeCount;
+			}
+		}
+
+		int localCount = countInRanges(x, y, z, ranges, rangeCount, x[currIdx], y[currIdx], z[currIdx], cutoff2);
+
+		// The particle found itself at distance 0, unless it is in the excluded out-of-bounds cell
+		if (thisCell < sort.cellCount - 1) {
+			--localCount;
+		}
+
+		neighborCount[originalIndex] = localCount;
+	}
+}
+
+static inline float distance2(const float* loc, uint32_t a, uint32_t b) {
+	float dx = loc[b * 3 + 0] - loc[a * 3 + 0];
+	float dy = loc[b * 3 + 1] - loc[a * 3 + 1];
+	float dz = loc[b * 3 + 2] - loc[a * 3 + 2];
+	return (dx * dx) + (dy * dy) + (dz * dz);
+}
+
+// Using the NNS with the quantized positions, 4 or 6 bytes per particle instead of 12
+// A neighbor in the cell (dx, dy, dz) cells away is at its offset + (dx, dy, dz) * 2^bits steps,
+// so distances are exact integers in steps and the cutoff (cellLength) is 2^bits steps
+void Particle::countNeighborsQuantized(NNS& sort) {
+	if (sortedQuantized.isPacked()) {
+		countNeighborsQuantizedImpl<true>(sort);
+	}
+	else {
+		countNeighborsQuantizedImpl<false>(sort);
+	}
+}
+
+template <bool Packed>
+void Particle::countNeighborsQuantizedImpl(NNS& sort) {
+	// Up to 10 bits the squared distance fits in 32 bits (3 * (2 * 2^10)^2 < 2^31)
+	typedef typename std::conditional<Packed, int32_t, int64_t>::type Distance;
+
+	int bits = sortedQuantized.bits;
+	uint32_t mask = (1u << bits) - 1;
+	Distance cutoff2 = (Distance)1 << (2 * bits);
+	const uint32_t* packed = sortedQuantized.packed.data();
+	const uint16_t* wide = sortedQuantized.wide.data();
+	int lastCell = sort.cellCount - 1; // Excluded out-of-bounds cell
+
+	// Neighbor cell offsets in steps
+	int cellOffset[27][3];
+	for (int t = 0; t < 27; t++) {
+		cellOffset[t][0] = ((t % 3) - 1) << bits;
+		cellOffset[t][1] = (((t % 9) / 3) - 1) << bits;
+		cellOffset[t][2] = ((t / 9) - 1) << bits;
+	}
+
+	auto load = [&](uint32_t idx, int& qx, int& qy, int& qz) {
+		if constexpr (Packed) {
+			uint32_t q = packed[idx];
+			qx = (int)(q & mask);
+			qy = (int)((q >> bits) & mask);
+			qz = (int)(q >> (2 * bits));
+		}
+		else {
+			qx = wide[(size_t)idx * 3 + 0];
+			qy = wide[(size_t)idx * 3 + 1];
+			qz = wide[(size_t)idx * 3 + 2];
+		}
+	};
 
 	int currIdx = 0;
 
-#if PERFORMANCE_TEST && MULTI_THREAD
 #pragma omp parallel for
-#endif
 	for (currIdx = 0; currIdx < count; currIdx++) {
-		float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
 		int thisCell = sort.cellIndexPair[currIdx].cellID;
 		int originalIndex = sort.cellIndexPair[currIdx].index;
 
 		int localCount = 0;
 
-		// Check the cells around the particle 
-		for (int t = 0; t < 27; t++) {
+		if (thisCell != lastCell) {
+			int px, py, pz;
+			load(currIdx, px, py, pz);
 
-			// Iterate through the 27 neighbor cells
-			int targetCell = (sort.cellDimy * sort.cellDimx * ((t / 9) - 1)) + ((thisCell - sort.cellDimx + (((t % 9) / 3) * sort.cellDimx)) - 1 + ((t) % 3));
+			for (int t = 0; t < 27; t++) {
+				int targetCell = sort.neighborCell(thisCell, t);
+				if (targetCell >= lastCell || sort.cellStart[targetCell] == 0xffffffff) {
+					continue;
+				}
+
+				// Query position relative to the neighbor cell's corner
+				int rx = px - cellOffset[t][0];
+				int ry = py - cellOffset[t][1];
+				int rz = pz - cellOffset[t][2];
 
-			if (targetCell < sort.cellCount - 1) // Excludes the one out-of-bounds cell
-			{
-				uint32_t startIndex = sort.cellStart[targetCell];
 				uint32_t endIndex = sort.cellEnd[targetCell];
+				for (uint32_t checkIdx = sort.cellStart[targetCell]; checkIdx < endIndex; checkIdx++) {
+					int qx, qy, qz;
+					load(checkIdx, qx, qy, qz);
+					Distance dx = qx - rx;
+					Distance dy = qy - ry;
+					Distance dz = qz - rz;
+					if ((dx * dx) + (dy * dy) + (dz * dz) < cutoff2 && checkIdx != (uint32_t)currIdx) {
+						++localCount;
+					}
+				}
+			}
+		}
+
+		neighborCount[originalIndex] = localCount;
+	}
+}
+
+bool Particle::validateQuantized(NNS& sort) {
+	countNeighbors(sort);
+	std::vector<int> reference = neighborCount;
+	countNeighborsQuantized(sort);
+
+	int differing = 0;
+	long long totalDiff = 0;
+	for (int i = 0; i < count; i++) {
+		if (neighborCount[i] != reference[i]) {
+			++differing;
+			totalDiff += std::abs(neighborCount[i] - reference[i]);
+		}
+	}
+
+	// Only (ordered) pairs closer to the cutoff than the error bound can be counted differently
+	float cutoff = (float)sort.cellLength;
+	float bound = sortedQuantized.errorBound(cutoff) * 1.01f; // Slack for the float math of reorder
+	int lastCell = sort.cellCount - 1;
+	long long ambiguous = 0;
+	int currIdx = 0;
+#pragma omp parallel for reduction(+:ambiguous)
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		int thisCell = sort.cellIndexPair[currIdx].cellID;
+		if (thisCell == lastCell) {
+			continue;
+		}
+		for (int t = 0; t < 27; t++) {
+			int targetCell = sort.neighborCell(thisCell, t);
+			if (targetCell >= lastCell || sort.cellStart[targetCell] == 0xffffffff) {
+				continue;
+			}
+			for (uint32_t checkIdx = sort.cellStart[targetCell]; checkIdx < sort.cellEnd[targetCell]; checkIdx++) {
+				if (checkIdx != (uint32_t)currIdx && fabsf(sqrtf(distance2(sortedLoc.data(), currIdx, checkIdx)) - cutoff) <= bound) {
+					++ambiguous;
+				}
+			}
+		}
+	}
 
-				if (startIndex != 0xffffffff)          // cell is not empty
+	printf("Quantized %d bits (%d bytes per particle, error bound %.4f): %d of %d counts differ from float, "
+		"total difference %lld, %lld pairs within the bound of the cutoff%s\n",
+		sortedQuantized.bits, sortedQuantized.bytesPerParticle(), sortedQuantized.errorBound(cutoff),
+		differing, count, totalDiff, ambiguous, (totalDiff > ambiguous) ? " (MORE THAN THE BOUND ALLOWS)" : "");
+	neighborCount = reference;
+	return totalDiff <= ambiguous;
+}
+
+// Neighbor counting as a forEachNeighbor functor, counts in sorted order then scatters
+void Particle::countNeighborsGeneric(NNS& sort) {
+	if (threadNeighborCount.size() < (size_t)count) {
+		threadNeighborCount.resize(count);
+	}
+	int* sortedCount = threadNeighborCount.data();
+	memset(sortedCount, 0, count * sizeof(int));
+
+	sort.forEachNeighbor(sortedLoc, (float)sort.cellLength, [sortedCount](int i, int, float, float, float, float) {
+		++sortedCount[i];
+	});
+
+	int currIdx = 0;
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		neighborCount[sort.cellIndexPair[currIdx].index] = sortedCount[currIdx];
+	}
+}
+
+// Neighbor counting as a forEachPair functor with per-thread buffers, like countNeighborsSymmetric
+// Particles in the excluded out-of-bounds cell get 0
+void Particle::countNeighborsPairwiseGeneric(NNS& sort) {
+	size_t bufferSize = (size_t)omp_get_max_threads() * count;
+	if (threadNeighborCount.size() < bufferSize) {
+		threadNeighborCount.resize(bufferSize);
+	}
+	int* buffers = threadNeighborCount.data();
+	memset(buffers, 0, bufferSize * sizeof(int));
+	size_t stride = count;
+
+	sort.forEachPair(sortedLoc, (float)sort.cellLength, [buffers, stride](int thread, int i, int j, float, float, float, float) {
+		int* localCount = buffers + thread * stride;
+		++localCount[i];
+		++localCount[j];
+	});
+
+	int threadCount = omp_get_max_threads();
+	int currIdx = 0;
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		int total = 0;
+		for (int t = 0; t < threadCount; t++) {
+			total += threadNeighborCount[(size_t)t * count + currIdx];
+		}
+		neighborCount[sort.cellIndexPair[currIdx].index] = total;
+	}
+}
+
+// Using the sparse grid, no cell is excluded since every particle has a cell
+void Particle::countNeighbors(SparseGrid& grid) {
+
+	int currIdx = 0;
+
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
+		uint64_t thisCell = grid.sortedKey[currIdx];
+
+		int localCount = 0;
+
+		for (int t = 0; t < 27; t++) {
+			uint32_t startIndex, endIndex;
+			if (!grid.neighborRange(thisCell, t, startIndex, endIndex)) {
+				continue; // Cell is empty
+			}
+
+			for (uint32_t checkIdx = startIndex; checkIdx < endIndex; checkIdx++) {
+				if (checkIdx != (uint32_t)currIdx) // Dont compute with its self
 				{
-					for (uint32_t checkIdx = startIndex; checkIdx < endIndex; checkIdx++) { // This iterator is going through indexes of the sorted data
-						// If data is not sorted will need to use the result of the keyValue sort to get the unsorted (original) index
+					float3 p2pVec = make_float3(sortedLoc[checkIdx * 3 + 0] - thisLoc.x, sortedLoc[checkIdx * 3 + 1] - thisLoc.y, sortedLoc[checkIdx * 3 + 2] - thisLoc.z);
+					float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+					if (dist < grid.cellLength)
+					{
+						++localCount;
+					}
+				}
+			}
+		}
 
-						if (checkIdx != currIdx) // Dont compute with its self
-						{
-							float3 checkIdxLoc = make_float3(sortedLoc[checkIdx * 3 + 0], sortedLoc[checkIdx * 3 + 1], sortedLoc[checkIdx * 3 + 2]);
+		neighborCount[grid.sortedIndex[currIdx]] = localCount;
+	}
+}
 
-							// Careful with this vectors direction for different interactions
-							float3 p2pVec = make_float3(checkIdxLoc.x - thisLoc.x, checkIdxLoc.y - thisLoc.y, checkIdxLoc.z - thisLoc.z);
+// Using the subcell grid, the padding keeps every stencil cell inside the grid
+void Particle::countNeighbors(SubcellGrid& grid) {
+	const uint32_t* cellOffsets = grid.cellOffsets.data();
+	const int* stencil = grid.stencil.data();
+	int stencilSize = (int)grid.stencil.size();
 
-							float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+	int currIdx = 0;
 
-							if (dist < (float)sort.cellLength)
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
+		int thisCell = grid.sortedCell[currIdx];
+
+		int localCount = 0;
+
+		for (int t = 0; t < stencilSize; t++) {
+			int targetCell = thisCell + stencil[t];
+			uint32_t endIndex = cellOffsets[targetCell + 1];
+
+			for (uint32_t checkIdx = cellOffsets[targetCell]; checkIdx < endIndex; checkIdx++) {
+				if (checkIdx != (uint32_t)currIdx) // Dont compute with its self
+				{
+					float3 p2pVec = make_float3(sortedLoc[checkIdx * 3 + 0] - thisLoc.x, sortedLoc[checkIdx * 3 + 1] - thisLoc.y, sortedLoc[checkIdx * 3 + 2] - thisLoc.z);
+					float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+					if (dist < grid.cutoff)
+					{
+						++localCount;
+					}
+				}
+			}
+		}
+
+		neighborCount[grid.sortedIndex[currIdx]] = localCount;
+	}
+}
+
+// Using the adaptive grid, split cells are scanned by the subcells whose box is within the cutoff
+// The box test gets a small margin so rounding of the subcell boundaries never drops a neighbor,
+// the distance test then gives the same counts as countNeighbors
+void Particle::countNeighbors(AdaptiveGrid& grid) {
+	NNS& sort = grid.coarse;
+	float cutoff = (float)sort.cellLength;
+	float reach = cutoff * 1.001f;
+	int lastCell = sort.cellCount - 1; // Excluded out-of-bounds cell
+
+	int currIdx = 0;
+
+#pragma omp parallel for schedule(dynamic, 64)
+	for (currIdx = 0; currIdx < count; currIdx++) {
+		float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
+		int thisCell = sort.cellIndexPair[currIdx].cellID;
+		int originalIndex = sort.cellIndexPair[currIdx].index;
+
+		int localCount = 0;
+
+		for (int t = 0; t < 27; t++) {
+			int targetCell = sort.neighborCell(thisCell, t);
+			if (targetCell >= lastCell || sort.cellStart[targetCell] == 0xffffffff) {
+				continue;
+			}
+
+			int s = grid.splitIndex[targetCell];
+			if (s < 0) {
+				// Whole cell
+				uint32_t endIndex = sort.cellEnd[targetCell];
+				for (uint32_t checkIdx = sort.cellStart[targetCell]; checkIdx < endIndex; checkIdx++) {
+					if (checkIdx != (uint32_t)currIdx) // Dont compute with its self
+					{
+						float3 p2pVec = make_float3(sortedLoc[checkIdx * 3 + 0] - thisLoc.x, sortedLoc[checkIdx * 3 + 1] - thisLoc.y, sortedLoc[checkIdx * 3 + 2] - thisLoc.z);
+						float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+						if (dist < cutoff)
+						{
+							++localCount;
+						}
+					}
+				}
+				continue;
+			}
+
+			// Squared gap between the particle and each subcell slab per axis, slabs out of reach are skipped
+			int split = grid.splitCount[s];
+			float width = cutoff / split;
+			float3 origin = grid.splitOrigin[s];
+			float gap2[3][8];
+			int lo[3], hi[3];
+			float p[3] = { thisLoc.x - origin.x, thisLoc.y - origin.y, thisLoc.z - origin.z };
+			for (int a = 0; a < 3; a++) {
+				lo[a] = std::max((int)floorf((p[a] - reach) / width), 0);
+				hi[a] = std::min((int)floorf((p[a] + reach) / width), split - 1);
+				for (int k = lo[a]; k <= hi[a]; k++) {
+					float gap = std::max(std::max(k * width - p[a], p[a] - (k + 1) * width), 0.0f);
+					gap2[a][k] = gap * gap;
+				}
+			}
+
+			const uint32_t* offsets = &grid.subOffsets[grid.subBase[s]];
+			for (int z = lo[2]; z <= hi[2]; z++) {
+				for (int y = lo[1]; y <= hi[1]; y++) {
+					if (gap2[2][z] + gap2[1][y] >= reach * reach) {
+						continue;
+					}
+					for (int x = lo[0]; x <= hi[0]; x++) {
+						if (gap2[2][z] + gap2[1][y] + gap2[0][x] >= reach * reach) {
+							continue;
+						}
+						int k = x + y * split + z * split * split;
+						for (uint32_t checkIdx = offsets[k]; checkIdx < offsets[k + 1]; checkIdx++) {
+							if (checkIdx != (uint32_t)currIdx) // Dont compute with its self
 							{
-								++localCount;
-#if !PERFORMANCE_TEST
-								// Get checkIdx's unsorted index to access unsorted data
-								int checkOrig = sort.cellIndexPair[checkIdx].index;
-								neighborList[originalIndex].push_back(checkOrig);
-#endif
+								float3 p2pVec = make_float3(sortedLoc[checkIdx * 3 + 0] - thisLoc.x, sortedLoc[checkIdx * 3 + 1] - thisLoc.y, sortedLoc[checkIdx * 3 + 2] - thisLoc.z);
+								float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+								if (dist < cutoff)
+								{
+									++localCount;
+								}
 							}
 						}
 					}
@@ -124,7 +710,193 @@ void Particle::countNeighbors(NNS& sort) {
 		}
 
 		neighborCount[originalIndex] = localCount;
+	}
+}
 
+// Distance test shared by the symmetric traversal, same math as countNeighbors
+template <bool Periodic>
+static inline bool withinCutoff(const float* loc, uint32_t a, uint32_t b, const float3& shift, float cutoff) {
+	float3 p2pVec = make_float3(loc[b * 3 + 0] - loc[a * 3 + 0], loc[b * 3 + 1] - loc[a * 3 + 1], loc[b * 3 + 2] - loc[a * 3 + 2]);
+	if constexpr (Periodic) {
+		p2pVec = make_float3(p2pVec.x + shift.x, p2pVec.y + shift.y, p2pVec.z + shift.z);
+	}
+	float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+	return dist < cutoff;
+}
+
+// Colors of one grid axis for the symmetric traversal, cells of a color are period cells apart, also
+// across a periodic wrap, and the cells after the last whole period get a color each
+struct AxisColors {
+	int period;
+	int full;  // Cells covered by whole periods
+	int count;
+
+	AxisColors(int cells, int minPeriod) {
+		period = std::min(minPeriod, cells);
+		full = cells - cells % period;
+		count = period + cells % period;
+	}
+	int first(int color) const {
+		return (color < period) ? color : full + color - period;
+	}
+	int cellsOf(int color) const {
+		return (color < period) ? (full - color + period - 1) / period : 1;
+	}
+};
+
+// Using the NNS with each unordered pair computed once
+// Cells only look at themselves and the 13 neighbor cells with a larger index (t = 14..26 of the
+// full stencil), the other 13 see this cell from their side. Results are added to both particles.
+// Those 13 cells are at most one cell back in x and y and none in z, so the cells are visited in
+// 3 x 3 x 2 colors (more if an axis is not a multiple of 3 or 2), and the cells of one color, threaded
+// over, never write to the same cell. The counts and list cursors then need no atomics or per-thread copies.
+// Periodic grids add the minimum image shift of the neighbor cell like countNeighbors.
+// Particles in the excluded out-of-bounds cell only count one way in countNeighbors, they keep that.
+void Particle::countNeighborsSymmetric(NNS& sort) {
+	if (sort.periodic) {
+		countNeighborsSymmetricImpl<false, true>(sort);
+	}
+	else {
+		countNeighborsSymmetricImpl<false, false>(sort);
+	}
+
+	if (recordLists) {
+		allocateLists(sort);
+		listCursor.assign(neighborOffsets.begin(), neighborOffsets.end() - 1);
+		if (sort.periodic) {
+			countNeighborsSymmetricImpl<true, true>(sort);
+		}
+		else {
+			countNeighborsSymmetricImpl<true, false>(sort);
+		}
+	}
+}
+
+template <bool Fill, bool Periodic>
+void Particle::countNeighborsSymmetricImpl(NNS& sort) {
+	const float* loc = sortedLoc.data();
+	float cutoff = (float)sort.cellLength;
+	int lastCell = sort.cellCount - 1; // Excluded out-of-bounds cell
+	int* cursor = listCursor.data();
+	int* list = neighborList.data();
+	bool sortedRows = sortedLists;
+
+	if (!Fill && threadNeighborCount.size() < (size_t)count) {
+		threadNeighborCount.resize(count);
+	}
+	int* sortedCount = threadNeighborCount.data(); // Sorted order
+
+	int dimx = sort.cellDimx;
+	int dimy = sort.cellDimy;
+	int dimz = sort.cellDimz;
+	AxisColors colorX(dimx, 3), colorY(dimy, 3), colorZ(dimz, 2);
+
+#pragma omp parallel
+	{
+		int currIdx = 0;
+		if constexpr (!Fill) {
+#pragma omp for
+			for (currIdx = 0; currIdx < count; currIdx++) {
+				sortedCount[currIdx] = 0;
+			}
+		}
+
+		for (int cz = 0; cz < colorZ.count; cz++) {
+			for (int cy = 0; cy < colorY.count; cy++) {
+				for (int cx = 0; cx < colorX.count; cx++) {
+					int nx = colorX.cellsOf(cx);
+					int ny = colorY.cellsOf(cy);
+					int colorCells = nx * ny * colorZ.cellsOf(cz);
+
+					int k = 0;
+#pragma omp for schedule(dynamic, 16)
+					for (k = 0; k < colorCells; k++) {
+						int x = colorX.first(cx) + (k % nx) * colorX.period;
+						int y = colorY.first(cy) + ((k / nx) % ny) * colorY.period;
+						int z = colorZ.first(cz) + (k / (nx * ny)) * colorZ.period;
+						int cell = sort.orderedCell(x + dimx * (y + dimy * z));
+						if (cell >= lastCell || sort.cellStart[cell] == 0xffffffff) {
+							continue;
+						}
+						uint32_t startIndex = sort.cellStart[cell];
+						uint32_t endIndex = sort.cellEnd[cell];
+
+						// The cell itself (t = 13) then the forward half of the stencil
+						for (int t = 13; t < 27; t++) {
+							if constexpr (!Periodic) {
+								// Row-major neighbors past a face of the grid are on the far side of it, out of range
+								int tx = x + (t % 3) - 1, ty = y + ((t % 9) / 3) - 1;
+								if (tx < 0 || tx >= dimx || ty < 0 || ty >= dimy || z + (t / 9) - 1 >= dimz) {
+									continue;
+								}
+							}
+							int targetCell = (t == 13) ? cell : sort.neighborCell(cell, t);
+							if (targetCell >= lastCell || sort.cellStart[targetCell] == 0xffffffff) {
+								continue;
+							}
+							uint32_t targetEnd = sort.cellEnd[targetCell];
+
+							float3 shift = make_float3(0.0f, 0.0f, 0.0f);
+							if constexpr (Periodic) {
+								shift = sort.neighborShift(cell, t);
+							}
+
+							for (uint32_t a = startIndex; a < endIndex; a++) {
+								uint32_t b = (t == 13) ? a + 1 : sort.cellStart[targetCell];
+								for (; b < targetEnd; b++) {
+									if (withinCutoff<Periodic>(loc, a, b, shift, cutoff)) {
+										if constexpr (Fill) {
+											// Rows and neighbors are both sorted or both original indexes
+											int rowA = sortedRows ? (int)a : sort.cellIndexPair[a].index;
+											int rowB = sortedRows ? (int)b : sort.cellIndexPair[b].index;
+											list[cursor[rowA]++] = rowB;
+											list[cursor[rowB]++] = rowA;
+										}
+										else {
+											++sortedCount[a];
+											++sortedCount[b];
+										}
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+
+		// Back to original order (implicit barrier above)
+		if constexpr (!Fill) {
+#pragma omp for
+			for (currIdx = 0; currIdx < count; currIdx++) {
+				neighborCount[sort.cellIndexPair[currIdx].index] = sortedCount[currIdx];
+			}
+		}
+	}
+
+	// One sided counts for particles in the out-of-bounds cell (always empty in periodic grids)
+	uint32_t lastStart = sort.cellStart[lastCell];
+	if (lastStart != 0xffffffff) {
+		float3 noShift = make_float3(0.0f, 0.0f, 0.0f);
+		for (uint32_t a = lastStart; a < sort.cellEnd[lastCell]; a++) {
+			int localCount = 0;
+			for (int t = 0; t < 27; t++) {
+				int targetCell = sort.neighborCell(lastCell, t);
+				if (targetCell >= lastCell || sort.cellStart[targetCell] == 0xffffffff) {
+					continue;
+				}
+				for (uint32_t b = sort.cellStart[targetCell]; b < sort.cellEnd[targetCell]; b++) {
+					if (withinCutoff<false>(loc, a, b, noShift, cutoff)) {
+						if constexpr (Fill) {
+							int row = sortedRows ? (int)a : sort.cellIndexPair[a].index;
+							list[cursor[row]++] = sortedRows ? (int)b : sort.cellIndexPair[b].index;
+						}
+						++localCount;
+					}
+				}
+			}
+			neighborCount[sort.cellIndexPair[a].index] = localCount;
+		}
 	}
 }
 
@@ -148,11 +920,12 @@ void Particle::printLoc(int printCount) {
 
 // Printing NNS results
 void Particle::printNeighborCount(int printCount) {
-#if PERFORMANCE_TEST
-	printNeighborLess(printCount);
-#else
-	printNeighborMore(printCount);
-#endif
+	if (recordLists) {
+		printNeighborMore(printCount);
+	}
+	else {
+		printNeighborLess(printCount);
+	}
 }
 void Particle::printNeighborLess(int printCount) {
 	int loop = (printCount) ? printCount : count;
@@ -166,10 +939,13 @@ void Particle::printNeighborMore(int printCount) {
 	int loop = (printCount) ? printCount : count;
 	loop = minimizePrinting(loop);
 
+	std::vector<int> rowOf, neighbors;
+	listRows(rowOf);
 	for (int i = 0; i < loop; i++) {
+		originalNeighbors(i, rowOf, neighbors);
 		printf("Particle %d, Neighbor count %d    \t { ", i, neighborCount[i]);
-		for (int n = 0; n < neighborList[i].size(); n++) {
-			printf("%d%s", neighborList[i][n], (n == neighborList[i].size() - 1) ? " }" : ", ");
+		for (size_t n = 0; n < neighbors.size(); n++) {
+			printf("%d%s", neighbors[n], (n == neighbors.size() - 1) ? " }" : ", ");
 		}
 		printf("\n");
 	}
@@ -177,11 +953,12 @@ void Particle::printNeighborMore(int printCount) {
 
 // Printing all-to-all results
 void Particle::printNeighborN2Count(int printCount) {
-#if PERFORMANCE_TEST
-	printNeighborN2Less(printCount);
-#else
-	printNeighborN2More(printCount);
-#endif
+	if (recordLists) {
+		printNeighborN2More(printCount);
+	}
+	else {
+		printNeighborN2Less(printCount);
+	}
 }
 void Particle::printNeighborN2Less(int printCount) {
 	int loop = (printCount) ? printCount : count;
@@ -197,35 +974,36 @@ void Particle::printNeighborN2More(int printCount) {
 
 	for (int i = 0; i < loop; i++) {
 		printf("Particle %d, NeighborN2 count %d  \t { ", i, neighborCountN2[i]);
-		for (int n = 0; n < neighborN2List[i].size(); n++) {
-			printf("%d%s", neighborN2List[i][n], (n == neighborN2List[i].size() -1) ? " }" : ", ");
+		for (int n = neighborN2Offsets[i]; n < neighborN2Offsets[i + 1]; n++) {
+			printf("%d%s", neighborN2List[n], (n == neighborN2Offsets[i + 1] - 1) ? " }" : ", ");
 		}
 		printf("\n");
 	}
 }
 
 // Testing: comparing NNS and all-to-all results
-void Particle::check() {
+bool Particle::check() {
 	int foundError = 0;
 	printf("Checking for differences between NNS and all-to-all\n");
 
+	// Each NNS list is sorted once so the all-to-all neighbors are binary searched
+	std::vector<int> rowOf, neighbors;
+	listRows(rowOf);
+
 	for (int i = 0; i < count; i++) {
 		int firstMissing = 1;
+		originalNeighbors(i, rowOf, neighbors);
+		std::sort(neighbors.begin(), neighbors.end());
 		
-		for (int n = 0; n < neighborN2List[i].size(); n++) {
-			int found = 0;
-			int search = neighborN2List[i][n];
-			
-			for (int p = 0; p < neighborList[i].size(); p++) {
-				if (search == neighborList[i][p]) {
-					found = 1;
-				}
-			}
+		for (int n = neighborN2Offsets[i]; n < neighborN2Offsets[i + 1]; n++) {
+			int search = neighborN2List[n];
+			int found = std::binary_search(neighbors.begin(), neighbors.end(), search);
 			
 			if (!found) {
 				++foundError;
 				if (firstMissing) {
 					printf("Particle %d\n", i);
+					firstMissing = 0;
 				}
 				float3 iLoc = make_float3(locations[i * 3 + 0], locations[i * 3 + 1], locations[i * 3 + 2]);
 				float3 nLoc = make_float3(locations[search * 3 + 0], locations[search * 3 + 1], locations[search * 3 + 2]);
@@ -242,6 +1020,53 @@ void Particle::check() {
 	else {
 		printf("\tSuccess!\n");
 	}
+	return foundError == 0;
+}
+
+void Particle::allocateLists(NNS& sort) {
+	neighborOffsets.resize(count + 1);
+	int i = 0;
+
+	if (sortedLists) {
+		listOriginalIndex.resize(count);
+#pragma omp parallel for
+		for (i = 0; i < count; i++) {
+			listOriginalIndex[i] = sort.cellIndexPair[i].index;
+			neighborOffsets[i + 1] = neighborCount[listOriginalIndex[i]];
+		}
+	}
+	else {
+		listOriginalIndex.clear();
+#pragma omp parallel for
+		for (i = 0; i < count; i++) {
+			neighborOffsets[i + 1] = neighborCount[i];
+		}
+	}
+
+	neighborList.resize(exclusiveScan(neighborOffsets.data(), count));
+}
+
+void Particle::allocateN2Lists() {
+	neighborN2Offsets.resize(count + 1);
+	std::copy(neighborCountN2.begin(), neighborCountN2.begin() + count, neighborN2Offsets.begin() + 1);
+	neighborN2List.resize(exclusiveScan(neighborN2Offsets.data(), count));
+}
+
+void Particle::listRows(std::vector<int>& rowOf) {
+	rowOf.resize(count);
+	for (int row = 0; row < count; row++) {
+		rowOf[listOriginalIndex.empty() ? row : listOriginalIndex[row]] = row;
+	}
+}
+
+void Particle::originalNeighbors(int i, const std::vector<int>& rowOf, std::vector<int>& out) {
+	int row = rowOf[i];
+	out.assign(neighborList.begin() + neighborOffsets[row], neighborList.begin() + neighborOffsets[row + 1]);
+	if (!listOriginalIndex.empty()) {
+		for (int& n : out) {
+			n = listOriginalIndex[n];
+		}
+	}
 }
 
 int Particle::getParticleCount() {
@@ -0,0 +1,122 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <particleStore.hpp>
+#include <topology.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <utility>
+
+void ParticleStore::init(int count, bool keepSorted) {
+	particleCount = count;
+	staySorted = keepSorted;
+	fields.clear();
+	simdLevel = detectSimdLevel();
+
+	externalId.resize(count);
+	slotOf.resize(count);
+	for (int i = 0; i < count; i++) {
+		externalId[i] = i;
+		slotOf[i] = i;
+	}
+}
+
+int ParticleStore::addField(const std::string& name, int components) {
+	ParticleField field;
+	field.name = name;
+	field.components = std::min(std::max(components, 1), 4);
+	field.values.resize((size_t)particleCount * field.components);
+	firstTouch(field.values);
+	if (!staySorted) {
+		field.sorted.resize(field.values.size());
+		firstTouch(field.sorted);
+	}
+	fields.push_back(std::move(field));
+	return (int)fields.size() - 1;
+}
+
+int ParticleStore::findField(const std::string& name) const {
+	for (size_t f = 0; f < fields.size(); f++) {
+		if (fields[f].name == name) {
+			return (int)f;
+		}
+	}
+	return -1;
+}
+
+// Each thread gathers its static share of the sorted slots for every field, the shares start on a
+// multiple of 4 particles so the streaming stores stay aligned
+void ParticleStore::reorder(NNS& sort) {
+	if (particleCount == 0) {
+		return;
+	}
+	GatherFunc gather = getGatherFunc(simdLevel);
+	const KeyValuePair* pairs = sort.cellIndexPair.data();
+
+	if (!staySorted) {
+#pragma omp parallel
+		{
+			int threads = omp_get_num_threads();
+			int blocks = (particleCount + 3) / 4;
+			int begin = std::min(blocks * omp_get_thread_num() / threads * 4, particleCount);
+			int end = std::min(blocks * (omp_get_thread_num() + 1) / threads * 4, particleCount);
+
+			for (ParticleField& field : fields) {
+				gather(field.sorted.data(), field.values.data(), pairs, field.components, begin, end);
+			}
+		}
+		return;
+	}
+
+	// Stay sorted, one field at a time through the scratch array. A parallel gather needs a second
+	// buffer, an in place cycle walk would be serial and read in random order twice
+	for (ParticleField& field : fields) {
+		scratch.resize(field.values.size());
+#pragma omp parallel
+		{
+			int threads = omp_get_num_threads();
+			int blocks = (particleCount + 3) / 4;
+			int begin = std::min(blocks * omp_get_thread_num() / threads * 4, particleCount);
+			int end = std::min(blocks * (omp_get_thread_num() + 1) / threads * 4, particleCount);
+			gather(scratch.data(), field.values.data(), pairs, field.components, begin, end);
+		}
+		std::swap(field.values, scratch);
+	}
+
+	idScratch.resize(particleCount);
+	int i = 0;
+#pragma omp parallel for
+	for (i = 0; i < particleCount; i++) {
+		idScratch[i] = externalId[sort.cellIndexPair[i].index];
+	}
+	std::swap(externalId, idScratch);
+
+#pragma omp parallel for
+	for (i = 0; i < particleCount; i++) {
+		slotOf[externalId[i]] = i;
+		sort.cellIndexPair[i].index = i;
+	}
+}
+
+void ParticleStore::scatter(const NNS& sort, const std::vector<float>& in, std::vector<float>& out, int components) {
+	out.resize((size_t)particleCount * components);
+	int i = 0;
+#pragma omp parallel for
+	for (i = 0; i < particleCount; i++) {
+		size_t to = (size_t)sort.cellIndexPair[i].index * components;
+		for (int k = 0; k < components; k++) {
+			out[to + k] = in[(size_t)i * components + k];
+		}
+	}
+}
+
+size_t ParticleStore::memoryBytes() const {
+	size_t bytes = (externalId.capacity() + slotOf.capacity() + idScratch.capacity()) * sizeof(int)
+		+ scratch.capacity() * sizeof(float);
+	for (const ParticleField& field : fields) {
+		bytes += (field.values.capacity() + field.sorted.capacity()) * sizeof(float);
+	}
+	return bytes;
+}
@@ -0,0 +1,50 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <pipeline.hpp>
+#include <topology.hpp>
+
+void FramePipeline::init(int count, int dimx, int dimy, int dimz, int cell, int buffer, bool periodicBox) {
+	for (int s = 0; s < 2; s++) {
+		grids[s].init(count, dimx, dimy, dimz, cell, buffer, periodicBox);
+		sortedLoc[s].resize((size_t)count * 3);
+		firstTouch(sortedLoc[s]);
+	}
+
+	// The build is mostly serial, start it small and let balance move threads
+	totalThreads = omp_get_max_threads();
+	buildThreads = 1;
+	rebalance = true;
+	buildTime = kernelTime = 0.0;
+}
+
+void FramePipeline::build(int slot, const float* locations) {
+	NNS& grid = grids[slot];
+	grid.hash(locations);
+	grid.kvSort();
+	grid.findCellStartEnd();
+	grid.reorder(locations, sortedLoc[slot]);
+}
+
+// The kernel reads Particle::sortedLoc, the slot's buffer is swapped in for the call
+void FramePipeline::kernel(int slot, Particle& part) {
+	std::swap(part.sortedLoc, sortedLoc[slot]);
+	part.countNeighbors(grids[slot]);
+	std::swap(part.sortedLoc, sortedLoc[slot]);
+}
+
+// Moves one thread towards the slower stage when the difference is above 10%
+void FramePipeline::balance(double stageBuild, double stageKernel) {
+	if (!rebalance) {
+		return;
+	}
+
+	if (stageBuild > stageKernel * 1.1 && totalThreads - buildThreads > 1) {
+		++buildThreads;
+	}
+	else if (stageKernel > stageBuild * 1.1 && buildThreads > 1) {
+		--buildThreads;
+	}
+}
@@ -0,0 +1,133 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <radiusQuery.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+
+RadiusQuery::RadiusQuery() {
+	storeDistances = false;
+}
+
+// Row-major cell coordinates of a point, clamped to the grid
+static inline void pointCell(NNS& sort, float px, float py, float pz, int& cx, int& cy, int& cz) {
+	cx = std::min(std::max((int)(px + sort.simDimx_buffered / 2.0f) / sort.cellLength, 0), sort.cellDimx - 1);
+	cy = std::min(std::max((int)(py + sort.simDimy_buffered / 2.0f) / sort.cellLength, 0), sort.cellDimy - 1);
+	cz = std::min(std::max((int)(pz + sort.simDimz_buffered / 2.0f) / sort.cellLength, 0), sort.cellDimz - 1);
+}
+
+template <bool Fill>
+void RadiusQuery::visit(NNS& sort, const float* loc, const float* points, float radius) {
+	float radius2 = squaredCutoff(radius);
+	int reach = (int)ceilf(radius / (float)sort.cellLength);
+	int lastCell = sort.cellCount - 1; // Excluded out-of-bounds cell
+	int queryCount = (int)queryOrder.size();
+
+	int i = 0;
+#pragma omp parallel for schedule(dynamic, 64)
+	for (i = 0; i < queryCount; i++) {
+		int q = queryOrder[i].index;
+		float px = points[q * 3 + 0];
+		float py = points[q * 3 + 1];
+		float pz = points[q * 3 + 2];
+		int cx, cy, cz;
+		pointCell(sort, px, py, pz, cx, cy, cz);
+
+		int found = 0;
+		int* outIndex = Fill ? indices.data() + offsets[q] : nullptr;
+		float* outDist = (Fill && storeDistances) ? distances.data() + offsets[q] : nullptr;
+
+		for (int z = std::max(cz - reach, 0); z <= std::min(cz + reach, sort.cellDimz - 1); z++) {
+			for (int y = std::max(cy - reach, 0); y <= std::min(cy + reach, sort.cellDimy - 1); y++) {
+				for (int x = std::max(cx - reach, 0); x <= std::min(cx + reach, sort.cellDimx - 1); x++) {
+					int target = sort.orderedCell(x + y * sort.cellDimx + z * sort.cellDimx * sort.cellDimy);
+					if (target >= lastCell || sort.cellStart[target] == 0xffffffff) {
+						continue;
+					}
+
+					uint32_t endIndex = sort.cellEnd[target];
+					for (uint32_t j = sort.cellStart[target]; j < endIndex; j++) {
+						float dx = loc[j * 3 + 0] - px;
+						float dy = loc[j * 3 + 1] - py;
+						float dz = loc[j * 3 + 2] - pz;
+						float r2 = (dx * dx) + (dy * dy) + (dz * dz);
+						if (r2 < radius2) {
+							if constexpr (Fill) {
+								outIndex[found] = sort.cellIndexPair[j].index;
+								if (outDist) {
+									outDist[found] = sqrtf(r2);
+								}
+							}
+							++found;
+						}
+					}
+				}
+			}
+		}
+
+		if constexpr (!Fill) {
+			offsets[q + 1] = found;
+		}
+	}
+}
+
+void RadiusQuery::query(NNS& sort, std::vector<float>& sortedLoc, const std::vector<float>& points, float radius) {
+	int queryCount = (int)(points.size() / 3);
+
+	// Sort the points by cell (in the grid's cell order)
+	queryOrder.resize(queryCount);
+	int q = 0;
+#pragma omp parallel for
+	for (q = 0; q < queryCount; q++) {
+		int cx, cy, cz;
+		pointCell(sort, points[q * 3 + 0], points[q * 3 + 1], points[q * 3 + 2], cx, cy, cz);
+		queryOrder[q] = sort.makeKeyValue(sort.orderedCell(cx + cy * sort.cellDimx + cz * sort.cellDimx * sort.cellDimy), q);
+	}
+	std::sort(queryOrder.begin(), queryOrder.end(), [](const KeyValuePair& a, const KeyValuePair& b) {
+		return a.cellID < b.cellID;
+	});
+
+	// Count, prefix sum, fill
+	offsets.resize(queryCount + 1);
+	visit<false>(sort, sortedLoc.data(), points.data(), radius);
+
+	indices.resize(exclusiveScan(offsets.data(), queryCount));
+	if (storeDistances) {
+		distances.resize(offsets[queryCount]);
+	}
+	visit<true>(sort, sortedLoc.data(), points.data(), radius);
+}
+
+void RadiusQuery::queryBruteForce(std::vector<float>& locations, const std::vector<float>& points, float radius) {
+	int queryCount = (int)(points.size() / 3);
+	int particleCount = (int)(locations.size() / 3);
+	float radius2 = squaredCutoff(radius);
+
+	offsets.resize(queryCount + 1);
+	offsets[0] = 0;
+	indices.clear();
+	distances.clear();
+
+	for (int q = 0; q < queryCount; q++) {
+		for (int j = 0; j < particleCount; j++) {
+			float dx = locations[j * 3 + 0] - points[q * 3 + 0];
+			float dy = locations[j * 3 + 1] - points[q * 3 + 1];
+			float dz = locations[j * 3 + 2] - points[q * 3 + 2];
+			float r2 = (dx * dx) + (dy * dy) + (dz * dz);
+			if (r2 < radius2) {
+				indices.push_back(j);
+				if (storeDistances) {
+					distances.push_back(sqrtf(r2));
+				}
+			}
+		}
+		offsets[q + 1] = (int)indices.size();
+	}
+}
+
+int RadiusQuery::getQueryCount() {
+	return (int)offsets.size() - 1;
+}
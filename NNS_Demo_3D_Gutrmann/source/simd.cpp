@@ -0,0 +1,373 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+* SIMD kernels for counting neighbors in contiguous ranges of SoA positions
+*/
+
+#include <simd.hpp>
+#include <sort.hpp>
+#include <algorithm>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+#if SIMD_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE
+#define TARGET_AVX2
+#define TARGET_AVX512
+static inline int popCount(unsigned int v) { return (int)__popcnt(v); }
+#elif SIMD_X86
+// GCC/Clang compile these functions for the given ISA without changing the global flags
+#define TARGET_SSE __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+static inline int popCount(unsigned int v) { return __builtin_popcount(v); }
+#endif
+
+static int countInRangesScalar(const float* x, const float* y, const float* z,
+	const uint32_t* ranges, int rangeCount, float px, float py, float pz, float cutoff2) {
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++) {
+		for (uint32_t j = ranges[r * 2 + 0]; j < ranges[r * 2 + 1]; j++) {
+			float dx = x[j] - px;
+			float dy = y[j] - py;
+			float dz = z[j] - pz;
+			float dist2 = (dx * dx) + (dy * dy) + (dz * dz);
+			count += (dist2 < cutoff2);
+		}
+	}
+	return count;
+}
+
+static void gatherScalar(float* dst, const float* src, const KeyValuePair* pairs,
+	int components, int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		const float* from = src + (size_t)pairs[i].index * components;
+		for (int k = 0; k < components; k++) {
+			dst[(size_t)i * components + k] = from[k];
+		}
+	}
+}
+
+// Same float operations as Particle::countNeighbors (neighbor minus particle, x + y then z)
+template <int S>
+static void countClusterPairsScalar(const float* x, const float* y, const float* z, int iCluster,
+	const int* jClusters, int jCount, float cutoff2, int* counts) {
+	const float* ix = x + (size_t)iCluster * S;
+	const float* iy = y + (size_t)iCluster * S;
+	const float* iz = z + (size_t)iCluster * S;
+	int local[S] = {};
+
+	for (int n = 0; n < jCount; n++) {
+		size_t j = (size_t)jClusters[n] * S;
+		for (int k = 0; k < S; k++) {
+			for (int l = 0; l < S; l++) {
+				float dx = x[j + l] - ix[k];
+				float dy = y[j + l] - iy[k];
+				float dz = z[j + l] - iz[k];
+				float dist2 = (dx * dx) + (dy * dy) + (dz * dz);
+				local[k] += (dist2 < cutoff2);
+			}
+		}
+	}
+	for (int k = 0; k < S; k++) {
+		counts[k] = local[k];
+	}
+}
+
+#if SIMD_X86
+
+// Scalar up to a 4 particle boundary, so each block of 4 particles is 4 * C floats on a 16 byte
+// boundary (when dst is), then the blocks are assembled in registers and streamed out
+template <int C>
+TARGET_SSE
+static void gatherStreamSSE(float* dst, const float* src, const KeyValuePair* pairs, int begin, int end) {
+	int head = std::min((begin + 3) / 4 * 4, end);
+	gatherScalar(dst, src, pairs, C, begin, head);
+
+	int i = head;
+	for (; i + 4 <= end; i += 4) {
+		const float* p0 = src + (size_t)pairs[i + 0].index * C;
+		const float* p1 = src + (size_t)pairs[i + 1].index * C;
+		const float* p2 = src + (size_t)pairs[i + 2].index * C;
+		const float* p3 = src + (size_t)pairs[i + 3].index * C;
+		float* to = dst + (size_t)i * C;
+
+		if constexpr (C == 1) {
+			_mm_stream_ps(to, _mm_setr_ps(p0[0], p1[0], p2[0], p3[0]));
+		}
+		else if constexpr (C == 2) {
+			_mm_stream_ps(to + 0, _mm_setr_ps(p0[0], p0[1], p1[0], p1[1]));
+			_mm_stream_ps(to + 4, _mm_setr_ps(p2[0], p2[1], p3[0], p3[1]));
+		}
+		else if constexpr (C == 3) {
+			_mm_stream_ps(to + 0, _mm_setr_ps(p0[0], p0[1], p0[2], p1[0]));
+			_mm_stream_ps(to + 4, _mm_setr_ps(p1[1], p1[2], p2[0], p2[1]));
+			_mm_stream_ps(to + 8, _mm_setr_ps(p2[2], p3[0], p3[1], p3[2]));
+		}
+		else {
+			_mm_stream_ps(to + 0, _mm_loadu_ps(p0));
+			_mm_stream_ps(to + 4, _mm_loadu_ps(p1));
+			_mm_stream_ps(to + 8, _mm_loadu_ps(p2));
+			_mm_stream_ps(to + 12, _mm_loadu_ps(p3));
+		}
+	}
+	_mm_sfence(); // Streaming stores are weakly ordered
+
+	gatherScalar(dst, src, pairs, C, i, end);
+}
+
+TARGET_SSE
+static void gatherSSE(float* dst, const float* src, const KeyValuePair* pairs,
+	int components, int begin, int end) {
+	if (((uintptr_t)dst & 15) != 0) {
+		gatherScalar(dst, src, pairs, components, begin, end);
+		return;
+	}
+
+	switch (components) {
+	case 1:  gatherStreamSSE<1>(dst, src, pairs, begin, end); break;
+	case 2:  gatherStreamSSE<2>(dst, src, pairs, begin, end); break;
+	case 3:  gatherStreamSSE<3>(dst, src, pairs, begin, end); break;
+	default: gatherStreamSSE<4>(dst, src, pairs, begin, end); break;
+	}
+}
+
+TARGET_SSE
+static int countInRangesSSE(const float* x, const float* y, const float* z,
+	const uint32_t* ranges, int rangeCount, float px, float py, float pz, float cutoff2) {
+	__m128 vpx = _mm_set1_ps(px);
+	__m128 vpy = _mm_set1_ps(py);
+	__m128 vpz = _mm_set1_ps(pz);
+	__m128 vcut = _mm_set1_ps(cutoff2);
+	int count = 0;
+
+	for (int r = 0; r < rangeCount; r++) {
+		uint32_t end = ranges[r * 2 + 1];
+		for (uint32_t j = ranges[r * 2 + 0]; j < end; j += 4) {
+			__m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), vpx);
+			__m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), vpy);
+			__m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), vpz);
+			__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+			unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_cmplt_ps(dist2, vcut));
+			uint32_t remaining = end - j;
+			if (remaining < 4) {
+				mask &= (1u << remaining) - 1; // Lanes past the range belong to other cells
+			}
+			count += popCount(mask);
+		}
+	}
+	return count;
+}
+
+// The i cluster stays in registers, each j particle is broadcast and compared with all of it, and the
+// compare masks (-1 per lane) are subtracted from the per lane counts. No branches or popcounts per pair
+TARGET_SSE
+static void countClusterPairsSSE(const float* x, const float* y, const float* z, int iCluster,
+	const int* jClusters, int jCount, float cutoff2, int* counts) {
+	__m128 ix = _mm_load_ps(x + (size_t)iCluster * 4);
+	__m128 iy = _mm_load_ps(y + (size_t)iCluster * 4);
+	__m128 iz = _mm_load_ps(z + (size_t)iCluster * 4);
+	__m128 vcut = _mm_set1_ps(cutoff2);
+	__m128i acc = _mm_setzero_si128();
+
+	for (int n = 0; n < jCount; n++) {
+		size_t j = (size_t)jClusters[n] * 4;
+		for (int l = 0; l < 4; l++) {
+			__m128 dx = _mm_sub_ps(_mm_set1_ps(x[j + l]), ix);
+			__m128 dy = _mm_sub_ps(_mm_set1_ps(y[j + l]), iy);
+			__m128 dz = _mm_sub_ps(_mm_set1_ps(z[j + l]), iz);
+			__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			acc = _mm_sub_epi32(acc, _mm_castps_si128(_mm_cmplt_ps(dist2, vcut)));
+		}
+	}
+	_mm_storeu_si128((__m128i*)counts, acc);
+}
+
+TARGET_AVX2
+static int countInRangesAVX2(const float* x, const float* y, const float* z,
+	const uint32_t* ranges, int rangeCount, float px, float py, float pz, float cutoff2) {
+	__m256 vpx = _mm256_set1_ps(px);
+	__m256 vpy = _mm256_set1_ps(py);
+	__m256 vpz = _mm256_set1_ps(pz);
+	__m256 vcut = _mm256_set1_ps(cutoff2);
+	int count = 0;
+
+	for (int r = 0; r < rangeCount; r++) {
+		uint32_t end = ranges[r * 2 + 1];
+		for (uint32_t j = ranges[r * 2 + 0]; j < end; j += 8) {
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), vpx);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), vpy);
+			__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), vpz);
+			__m256 dist2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+			unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(dist2, vcut, _CMP_LT_OQ));
+			uint32_t remaining = end - j;
+			if (remaining < 8) {
+				mask &= (1u << remaining) - 1;
+			}
+			count += popCount(mask);
+		}
+	}
+	return count;
+}
+
+TARGET_AVX2
+static void countClusterPairsAVX2(const float* x, const float* y, const float* z, int iCluster,
+	const int* jClusters, int jCount, float cutoff2, int* counts) {
+	__m256 ix = _mm256_load_ps(x + (size_t)iCluster * 8);
+	__m256 iy = _mm256_load_ps(y + (size_t)iCluster * 8);
+	__m256 iz = _mm256_load_ps(z + (size_t)iCluster * 8);
+	__m256 vcut = _mm256_set1_ps(cutoff2);
+	__m256i acc = _mm256_setzero_si256();
+
+	for (int n = 0; n < jCount; n++) {
+		size_t j = (size_t)jClusters[n] * 8;
+		for (int l = 0; l < 8; l++) {
+			__m256 dx = _mm256_sub_ps(_mm256_broadcast_ss(x + j + l), ix);
+			__m256 dy = _mm256_sub_ps(_mm256_broadcast_ss(y + j + l), iy);
+			__m256 dz = _mm256_sub_ps(_mm256_broadcast_ss(z + j + l), iz);
+			__m256 dist2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			acc = _mm256_sub_epi32(acc, _mm256_castps_si256(_mm256_cmp_ps(dist2, vcut, _CMP_LT_OQ)));
+		}
+	}
+	_mm256_storeu_si256((__m256i*)counts, acc);
+}
+
+TARGET_AVX512
+static int countInRangesAVX512(const float* x, const float* y, const float* z,
+	const uint32_t* ranges, int rangeCount, float px, float py, float pz, float cutoff2) {
+	__m512 vpx = _mm512_set1_ps(px);
+	__m512 vpy = _mm512_set1_ps(py);
+	__m512 vpz = _mm512_set1_ps(pz);
+	__m512 vcut = _mm512_set1_ps(cutoff2);
+	int count = 0;
+
+	for (int r = 0; r < rangeCount; r++) {
+		uint32_t end = ranges[r * 2 + 1];
+		for (uint32_t j = ranges[r * 2 + 0]; j < end; j += 16) {
+			__m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + j), vpx);
+			__m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + j), vpy);
+			__m512 dz = _mm512_sub_ps(_mm512_loadu_ps(z + j), vpz);
+			__m512 dist2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+
+			unsigned int mask = (unsigned int)_mm512_cmp_ps_mask(dist2, vcut, _CMP_LT_OQ);
+			uint32_t remaining = end - j;
+			if (remaining < 16) {
+				mask &= (1u << remaining) - 1;
+			}
+			count += popCount(mask);
+		}
+	}
+	return count;
+}
+
+static bool cpuSupports(SimdLevel level) {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool avxState = (xcr0 & 0x6) == 0x6;
+	bool avx512State = (xcr0 & 0xe6) == 0xe6;
+
+	int ebx7 = 0;
+	if (maxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		ebx7 = info[1];
+	}
+
+	switch (level) {
+	case SIMD_SSE:    return true; // Baseline on x86-64
+	case SIMD_AVX2:   return avxState && (ebx7 & (1 << 5)) != 0;
+	case SIMD_AVX512: return avx512State && (ebx7 & (1 << 16)) != 0;
+	default:          return true;
+	}
+#else
+	switch (level) {
+	case SIMD_SSE:    return __builtin_cpu_supports("sse2");
+	case SIMD_AVX2:   return __builtin_cpu_supports("avx2");
+	case SIMD_AVX512: return __builtin_cpu_supports("avx512f");
+	default:          return true;
+	}
+#endif
+}
+
+#endif // SIMD_X86
+
+SimdLevel detectSimdLevel() {
+#if SIMD_X86
+	if (cpuSupports(SIMD_AVX512)) return SIMD_AVX512;
+	if (cpuSupports(SIMD_AVX2)) return SIMD_AVX2;
+	if (cpuSupports(SIMD_SSE)) return SIMD_SSE;
+#endif
+	return SIMD_SCALAR;
+}
+
+const char* simdLevelName(SimdLevel level) {
+	switch (level) {
+	case SIMD_SSE:    return "SSE";
+	case SIMD_AVX2:   return "AVX2";
+	case SIMD_AVX512: return "AVX-512";
+	default:          return "scalar";
+	}
+}
+
+CountInRangesFunc getCountInRangesFunc(SimdLevel level) {
+#if SIMD_X86
+	if (level > detectSimdLevel()) {
+		level = detectSimdLevel();
+	}
+
+	switch (level) {
+	case SIMD_AVX512: return countInRangesAVX512;
+	case SIMD_AVX2:   return countInRangesAVX2;
+	case SIMD_SSE:    return countInRangesSSE;
+	default:          break;
+	}
+#else
+	(void)level;
+#endif
+	return countInRangesScalar;
+}
+
+// The gather is bound by the random reads, wider stores don't help
+GatherFunc getGatherFunc(SimdLevel level) {
+#if SIMD_X86
+	if (level >= SIMD_SSE && cpuSupports(SIMD_SSE)) {
+		return gatherSSE;
+	}
+#else
+	(void)level;
+#endif
+	return gatherScalar;
+}
+
+// AVX-512 uses the 8x8 kernel, 16 particle clusters would be mostly padding at low densities
+ClusterPairFunc getClusterPairFunc(SimdLevel level, int clusterSize) {
+#if SIMD_X86
+	if (level > detectSimdLevel()) {
+		level = detectSimdLevel();
+	}
+
+	if (clusterSize == 8 && level >= SIMD_AVX2) {
+		return countClusterPairsAVX2;
+	}
+	if (clusterSize == 4 && level >= SIMD_SSE) {
+		return countClusterPairsSSE;
+	}
+#else
+	(void)level;
+#endif
+	return (clusterSize == 8) ? countClusterPairsScalar<8> : countClusterPairsScalar<4>;
+}
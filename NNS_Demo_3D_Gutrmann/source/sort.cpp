@@ -4,8 +4,12 @@
 */
 
 #include <sort.hpp>
+#include <instrument.hpp>
+#include <topology.hpp>
 #include <iostream>
+#include <cstring>
 #include <algorithm> // for sort function
+#include <omp.h>
 
 KeyValuePair NNS::makeKeyValue(int cell, int idx) {
 	KeyValuePair temp;
@@ -15,20 +19,44 @@ KeyValuePair NNS::makeKeyValue(int cell, int idx) {
 }
 
 /// WARNING: A lot of the values around cell assume friendly evenly divisible numbers here
-void NNS::init(int count, int dimx, int dimy, int dimz, int cell, int buffer) {
-	// Multiply buffer by two to get that amount of buffer on all sides
-	simDimx_buffered = dimx + (float)buffer * 2.0f;
-	simDimy_buffered = dimy + (float)buffer * 2.0f;
-	simDimz_buffered = dimz + (float)buffer * 2.0f;
+void NNS::init(int count, int dimx, int dimy, int dimz, int cell, int buffer, bool periodicBox) {
+	// Each axis needs 3 cells so the 27 wrapped neighbor cells are different cells
+	if (periodicBox && (dimx / cell < 3 || dimy / cell < 3 || dimz / cell < 3)) {
+		printf("NNS::init Error: a periodic box needs at least 3 cells per axis, using an open domain\n");
+		periodicBox = false;
+	}
+	periodic = periodicBox;
+
+	if (periodic) {
+		// No buffer, cells are stretched to fill the box exactly
+		simDimx_buffered = (float)dimx;
+		simDimy_buffered = (float)dimy;
+		simDimz_buffered = (float)dimz;
+
+		cellDimx = dimx / cell;
+		cellDimy = dimy / cell;
+		cellDimz = dimz / cell;
+	}
+	else {
+		// Multiply buffer by two to get that amount of buffer on all sides
+		simDimx_buffered = dimx + (float)buffer * 2.0f;
+		simDimy_buffered = dimy + (float)buffer * 2.0f;
+		simDimz_buffered = dimz + (float)buffer * 2.0f;
 
-	//Truncation will likely occure here, be careful
-	cellDimx = (int)simDimx_buffered / cell;
-	cellDimy = (int)simDimy_buffered / cell;
-	cellDimz = (int)simDimz_buffered / cell;
+		//Truncation will likely occure here, be careful
+		cellDimx = (int)simDimx_buffered / cell;
+		cellDimy = (int)simDimy_buffered / cell;
+		cellDimz = (int)simDimz_buffered / cell;
+	}
+	boxSize = make_float3((float)dimx, (float)dimy, (float)dimz);
+	cellWidth = make_float3(simDimx_buffered / cellDimx, simDimy_buffered / cellDimy, simDimz_buffered / cellDimz);
 
 	cellLength = cell;
 	bufferSize = buffer;
 	cellCount = cellDimx * cellDimy * cellDimz;
+	if (periodic) {
+		++cellCount; // The excluded last cell is kept, and stays empty, so the loops stay the same
+	}
 
 	nonBufferCellEstimate = (dimx / cell) * (dimy / cell) * (dimz / cell); // Not used in algorithm
 
@@ -37,6 +65,224 @@ void NNS::init(int count, int dimx, int dimy, int dimz, int cell, int buffer) {
 
 	particleCount = count;
 	cellIndexPair.resize(particleCount);
+	cellIndexPairTemp.resize(particleCount);
+
+	// Placed on the NUMA node of the threads that use them, call init after setting the thread count
+	firstTouch(cellStart);
+	firstTouch(cellEnd);
+	firstTouch(cellIndexPair);
+	firstTouch(cellIndexPairTemp);
+
+	// Only use as many radix digits as the largest cell ID needs
+	int keyBits = 1;
+	while (keyBits < 31 && (1 << keyBits) < cellCount) {
+		++keyBits;
+	}
+	radixPasses = (keyBits + 10) / 11; // At most 2048 buckets per digit
+	radixBits = (keyBits + radixPasses - 1) / radixPasses;
+	radixHistogram.resize((size_t)omp_get_max_threads() * ((size_t)1 << radixBits));
+
+	sortMethod = KV_SORT_RADIX;
+	reusePreviousOrder = false;
+	hashedOnce = false;
+
+#if defined(DEBUG) | defined(_DEBUG)
+	hashMode = HASH_DEBUG;
+#else
+	hashMode = HASH_SAFE;
+#endif
+
+	for (int t = 0; t < 27; t++) {
+		stencilOffset[t] = (cellDimy * cellDimx * ((t / 9) - 1)) + (cellDimx * (((t % 9) / 3) - 1)) + ((t % 3) - 1);
+	}
+	cellOrder = CELL_ORDER_ROW_MAJOR;
+	if (periodic) {
+		buildPeriodicStencil();
+	}
+
+	gridValid = false;
+	slotMapValid = false;
+	maxMoverFraction = 0.1f;
+	particleCell.resize(particleCount);
+	particleSlot.resize(particleCount);
+}
+
+void NNS::setSortMethod(KvSortMethod method, bool keepPreviousOrder) {
+	sortMethod = method;
+	reusePreviousOrder = keepPreviousOrder;
+}
+
+// Spreads the lower 21 bits of v to every third bit
+static uint64_t spreadBits3(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffULL;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+	v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
+}
+
+static uint64_t mortonKey(uint32_t x, uint32_t y, uint32_t z) {
+	return spreadBits3(x) | (spreadBits3(y) << 1) | (spreadBits3(z) << 2);
+}
+
+// Hilbert index of a point on a 2^bits grid (Skilling, "Programming the Hilbert curve", 2004)
+static uint64_t hilbertKey(uint32_t x, uint32_t y, uint32_t z, int bits) {
+	uint32_t X[3] = { x, y, z };
+	uint32_t M = 1u << (bits - 1);
+
+	// Inverse undo excess work
+	for (uint32_t Q = M; Q > 1; Q >>= 1) {
+		uint32_t P = Q - 1;
+		for (int i = 0; i < 3; i++) {
+			if (X[i] & Q) {
+				X[0] ^= P;
+			}
+			else {
+				uint32_t t = (X[0] ^ X[i]) & P;
+				X[0] ^= t;
+				X[i] ^= t;
+			}
+		}
+	}
+
+	// Gray encode
+	for (int i = 1; i < 3; i++) {
+		X[i] ^= X[i - 1];
+	}
+	uint32_t t = 0;
+	for (uint32_t Q = M; Q > 1; Q >>= 1) {
+		if (X[2] & Q) {
+			t ^= Q - 1;
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		X[i] ^= t;
+	}
+
+	// Interleave the transposed bits, x holds the most significant bit of each triple
+	uint64_t key = 0;
+	for (int b = bits - 1; b >= 0; b--) {
+		for (int i = 0; i < 3; i++) {
+			key = (key << 1) | ((X[i] >> b) & 1);
+		}
+	}
+	return key;
+}
+
+std::vector<int> NNS::curveOrder(int count, CellOrder order) const {
+	int bits = 1;
+	while ((1 << bits) < std::max(cellDimx, std::max(cellDimy, cellDimz))) {
+		++bits;
+	}
+
+	std::vector<std::pair<uint64_t, int>> keys(count);
+	for (int c = 0; c < count; c++) {
+		uint32_t x = c % cellDimx;
+		uint32_t y = (c / cellDimx) % cellDimy;
+		uint32_t z = c / (cellDimx * cellDimy);
+		uint64_t key = c;
+		if (order == CELL_ORDER_MORTON) {
+			key = mortonKey(x, y, z);
+		}
+		else if (order == CELL_ORDER_HILBERT) {
+			key = hilbertKey(x, y, z, bits);
+		}
+		keys[c] = std::make_pair(key, c);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<int> cells(count);
+	for (int r = 0; r < count; r++) {
+		cells[r] = keys[r].second;
+	}
+	return cells;
+}
+
+void NNS::setCellOrder(CellOrder order) {
+	cellOrder = order;
+	gridValid = false;
+	if (order == CELL_ORDER_ROW_MAJOR) {
+		cellRank.clear();
+		cellRowMajor.clear();
+		orderedNeighbor.clear();
+		if (periodic) {
+			buildPeriodicStencil();
+		}
+		return;
+	}
+
+	// Rank cells by their curve key, the last cell stays last since it is the excluded cell
+	std::vector<int> curve = curveOrder(cellCount - 1, order);
+
+	cellRank.resize(cellCount);
+	cellRowMajor.resize(cellCount);
+	for (int r = 0; r < cellCount - 1; r++) {
+		cellRank[curve[r]] = r;
+		cellRowMajor[r] = curve[r];
+	}
+	cellRank[cellCount - 1] = cellCount - 1;
+	cellRowMajor[cellCount - 1] = cellCount - 1;
+
+	if (periodic) {
+		buildPeriodicStencil();
+	}
+	else {
+		buildOrderedStencil();
+	}
+}
+
+// Neighbor cells of the curve orders looked up once, offsetCell maps each one through cellRowMajor
+// and cellRank, two dependent loads per neighbor in the inner loops
+void NNS::buildOrderedStencil() {
+	orderedNeighbor.resize((size_t)cellCount * 27);
+	int cell = 0;
+
+#pragma omp parallel for
+	for (cell = 0; cell < cellCount; cell++) {
+		for (int t = 0; t < 27; t++) {
+			orderedNeighbor[(size_t)cell * 27 + t] = offsetCell(cell, stencilOffset[t]);
+		}
+	}
+}
+
+// Wrapped neighbor cells and the image shift of each, so the inner loops don't wrap anything
+// A neighbor across a face is on the other side of the box, shifting it by the box size gives 
+// the minimum image (cells are at least cellLength wide and there are 3 or more per axis)
+void NNS::buildPeriodicStencil() {
+	periodicNeighbor.resize((size_t)cellCount * 27);
+	periodicShift.resize((size_t)cellCount * 27);
+
+	for (int rowMajor = 0; rowMajor < cellCount - 1; rowMajor++) {
+		int x = rowMajor % cellDimx;
+		int y = (rowMajor / cellDimx) % cellDimy;
+		int z = rowMajor / (cellDimx * cellDimy);
+		int cell = orderedCell(rowMajor);
+
+		for (int t = 0; t < 27; t++) {
+			int nx = x + (t % 3) - 1;
+			int ny = y + ((t % 9) / 3) - 1;
+			int nz = z + (t / 9) - 1;
+			float3 shift = make_float3(0.0f, 0.0f, 0.0f);
+
+			if (nx < 0)              { nx += cellDimx; shift.x = -boxSize.x; }
+			else if (nx >= cellDimx) { nx -= cellDimx; shift.x = boxSize.x; }
+			if (ny < 0)              { ny += cellDimy; shift.y = -boxSize.y; }
+			else if (ny >= cellDimy) { ny -= cellDimy; shift.y = boxSize.y; }
+			if (nz < 0)              { nz += cellDimz; shift.z = -boxSize.z; }
+			else if (nz >= cellDimz) { nz -= cellDimz; shift.z = boxSize.z; }
+
+			periodicNeighbor[(size_t)cell * 27 + t] = orderedCell(nx + ny * cellDimx + nz * cellDimx * cellDimy);
+			periodicShift[(size_t)cell * 27 + t] = shift;
+		}
+	}
+
+	// The empty last cell has no neighbors
+	for (int t = 0; t < 27; t++) {
+		periodicNeighbor[(size_t)(cellCount - 1) * 27 + t] = cellCount - 1;
+		periodicShift[(size_t)(cellCount - 1) * 27 + t] = make_float3(0.0f, 0.0f, 0.0f);
+	}
 }
 
 // Utility comparator function to pass to the sort() module
@@ -46,11 +292,11 @@ bool sortByCellID(const KeyValuePair& a, const KeyValuePair& b)
 }
 
 // Contains bounds checking and reporting
-void NNS::hashingLogicDebug(int i, std::vector<float>& locations, float xShift, float yShift, float zShift) {
+void NNS::hashingLogicDebug(int i, int idx, const float* locations, float xShift, float yShift, float zShift) {
 	int yCube, xCube, zCube;
-	xCube = (int)(locations[i * 3 + 0] + xShift) / cellLength;
-	yCube = (int)(locations[i * 3 + 1] + yShift) / cellLength;
-	zCube = (int)(locations[i * 3 + 2] + zShift) / cellLength;
+	xCube = (int)(locations[idx * 3 + 0] + xShift) / cellLength;
+	yCube = (int)(locations[idx * 3 + 1] + yShift) / cellLength;
+	zCube = (int)(locations[idx * 3 + 2] + zShift) / cellLength;
 
 
 	// Safty check
@@ -60,12 +306,12 @@ void NNS::hashingLogicDebug(int i, std::vector<float>& locations, float xShift,
 	{
 		// Object is out of bounds
 		printf("NNS::hashingLogicDebug Error: Object is out of bounds loc(% f, % f, % f)\n",
-			locations[i * 3 + 0],
-			locations[i * 3 + 1],
-			locations[i * 3 + 2]);
+			locations[idx * 3 + 0],
+			locations[idx * 3 + 1],
+			locations[idx * 3 + 2]);
 
 		cellIndexPair[i].cellID = cellCount - 1;
-		cellIndexPair[i].index = i;
+		cellIndexPair[i].index = idx;
 	}
 	else {
 		// Object is in bounds
@@ -79,24 +325,24 @@ void NNS::hashingLogicDebug(int i, std::vector<float>& locations, float xShift,
 				"\tcellIdx % u - Max cellCount % u   c(% d, % d, % d) l(% f, % f, % f)\n",
 				cellIdx, cellCount,
 				xCube, yCube, zCube,
-				locations[i * 3 + 0],
-				locations[i * 3 + 1],
-				locations[i * 3 + 2]);
+				locations[idx * 3 + 0],
+				locations[idx * 3 + 1],
+				locations[idx * 3 + 2]);
 
 			cellIdx = cellCount - 1;		// In calculation this cell is excluded (it is in the outter buffer region)
 		}
 
-		cellIndexPair[i].cellID = cellIdx;
-		cellIndexPair[i].index = i;
+		cellIndexPair[i].cellID = orderedCell(cellIdx);
+		cellIndexPair[i].index = idx;
 	}
 }
 
 // Contains bounds checking
-void NNS::hashingLogicSafe(int i, std::vector<float>& locations, float xShift, float yShift, float zShift) {
+int NNS::hashingCellSafe(int idx, const float* locations, float xShift, float yShift, float zShift) {
 	int yCube, xCube, zCube;
-	xCube = (int)(locations[i * 3 + 0] + xShift) / cellLength;
-	yCube = (int)(locations[i * 3 + 1] + yShift) / cellLength;
-	zCube = (int)(locations[i * 3 + 2] + zShift) / cellLength;
+	xCube = (int)(locations[idx * 3 + 0] + xShift) / cellLength;
+	yCube = (int)(locations[idx * 3 + 1] + yShift) / cellLength;
+	zCube = (int)(locations[idx * 3 + 2] + zShift) / cellLength;
 
 
 	// Safty check
@@ -105,40 +351,102 @@ void NNS::hashingLogicSafe(int i, std::vector<float>& locations, float xShift, f
 		zCube < 0 || zCube >= cellDimz)
 	{
 		// Object is out of bounds
-		cellIndexPair[i].cellID = cellCount - 1;
-		cellIndexPair[i].index = i;
+		return cellCount - 1;
 	}
-	else {
-		// Object is in bounds
 
-		// Neighbooring x cells are close in value, therefore their data will be too after sorting
-		int cellIdx = xCube + yCube * cellDimx + zCube * cellDimx * cellDimy;
+	// Object is in bounds
 
-		if (cellIdx >= cellCount || cellIdx < 0) {
-			cellIdx = cellCount - 1;		// In calculation this cell is excluded (it is in the outter buffer region)
-		}
+	// Neighbooring x cells are close in value, therefore their data will be too after sorting
+	int cellIdx = xCube + yCube * cellDimx + zCube * cellDimx * cellDimy;
 
-		cellIndexPair[i].cellID = cellIdx;
-		cellIndexPair[i].index = i;
+	if (cellIdx >= cellCount || cellIdx < 0) {
+		cellIdx = cellCount - 1;		// In calculation this cell is excluded (it is in the outter buffer region)
 	}
+
+	return orderedCell(cellIdx);
+}
+
+// Contains bounds checking
+void NNS::hashingLogicSafe(int i, int idx, const float* locations, float xShift, float yShift, float zShift) {
+	cellIndexPair[i].cellID = hashingCellSafe(idx, locations, xShift, yShift, zShift);
+	cellIndexPair[i].index = idx;
 }
 
 // Contains no error handling
-void NNS::hashingLogicFast(int i, std::vector<float>& locations, float xShift, float yShift, float zShift) {
+void NNS::hashingLogicFast(int i, int idx, const float* locations, float xShift, float yShift, float zShift) {
 	int yCube, xCube, zCube;
-	xCube = (int)(locations[i * 3 + 0] + xShift) / cellLength;
-	yCube = (int)(locations[i * 3 + 1] + yShift) / cellLength;
-	zCube = (int)(locations[i * 3 + 2] + zShift) / cellLength;
+	xCube = (int)(locations[idx * 3 + 0] + xShift) / cellLength;
+	yCube = (int)(locations[idx * 3 + 1] + yShift) / cellLength;
+	zCube = (int)(locations[idx * 3 + 2] + zShift) / cellLength;
 
 	// Neighbooring x cells are close in value, therefore their data will be too after sorting
 	int cellIdx = xCube + yCube * cellDimx + zCube * cellDimx * cellDimy;
 
-	cellIndexPair[i].cellID = cellIdx;
-	cellIndexPair[i].index = i;
+	cellIndexPair[i].cellID = orderedCell(cellIdx);
+	cellIndexPair[i].index = idx;
+}
+
+// Wraps into the periodic box, there is no out of bounds
+int NNS::hashingCellPeriodic(int idx, const float* locations) {
+	float3 wrapped = wrapPosition(locations[idx * 3 + 0], locations[idx * 3 + 1], locations[idx * 3 + 2]);
+
+	int xCube = std::min((int)((wrapped.x + boxSize.x * 0.5f) / cellWidth.x), cellDimx - 1);
+	int yCube = std::min((int)((wrapped.y + boxSize.y * 0.5f) / cellWidth.y), cellDimy - 1);
+	int zCube = std::min((int)((wrapped.z + boxSize.z * 0.5f) / cellWidth.z), cellDimz - 1);
+
+	return orderedCell(xCube + yCube * cellDimx + zCube * cellDimx * cellDimy);
+}
+
+void NNS::hashingLogicPeriodic(int i, int idx, const float* locations) {
+	cellIndexPair[i].cellID = hashingCellPeriodic(idx, locations);
+	cellIndexPair[i].index = idx;
+}
+
+// Picks the hashing logic at compile time, no branch per particle
+template <HashMode Mode>
+inline void NNS::hashingLogic(int i, int idx, const float* locations, float xShift, float yShift, float zShift) {
+	if constexpr (Mode == HASH_DEBUG) {
+		hashingLogicDebug(i, idx, locations, xShift, yShift, zShift);
+	}
+	else if constexpr (Mode == HASH_SAFE) {
+		hashingLogicSafe(i, idx, locations, xShift, yShift, zShift);
+	}
+	else if constexpr (Mode == HASH_PERIODIC) {
+		hashingLogicPeriodic(i, idx, locations);
+	}
+	else {
+		hashingLogicFast(i, idx, locations, xShift, yShift, zShift);
+	}
 }
 
 // In use
 void NNS::hash(std::vector<float>& locations) {
+	hash(locations.data());
+}
+
+// Pointer form for locations that are not in a vector, e.g. a mapped trajectory frame
+void NNS::hash(const float* locations) {
+#if NNS_INSTRUMENT
+	instrument.beginFrame();
+#endif
+	// cellIndexPair is unsorted until kvSort and findCellStartEnd, updateIncremental has to start over
+	gridValid = false;
+	slotMapValid = false;
+
+	switch (periodic ? HASH_PERIODIC : hashMode) {
+	case HASH_DEBUG:    hashImpl<HASH_DEBUG>(locations); break;
+	case HASH_SAFE:     hashImpl<HASH_SAFE>(locations); break;
+	case HASH_FAST:     hashImpl<HASH_FAST>(locations); break;
+	case HASH_PERIODIC: hashImpl<HASH_PERIODIC>(locations); break;
+	}
+
+#if NNS_INSTRUMENT
+	instrument.recordDumped(countDumped());
+#endif
+}
+
+template <HashMode Mode>
+void NNS::hashImpl(const float* locations) {
 
 	// simDim{axis}_buffered is the simulation boundary in floating point units
 	// {axis}Shift is used to shift all corrdinates to a positive corrdinate space
@@ -147,21 +455,22 @@ void NNS::hash(std::vector<float>& locations) {
 	float zShift = simDimz_buffered / 2.0f;
 	int i = 0;
 
-#if PERFORMANCE_TEST && MULTI_THREAD
 #pragma omp parallel for
-#endif
 	for (i = 0; i < particleCount; i++) {
-#if defined(DEBUG) | defined(_DEBUG)
-		hashingLogicDebug(i, locations, xShift, yShift, zShift);
-#else
-		hashingLogicSafe(i, locations, xShift, yShift, zShift);
-		//hashingLogicFast(i, locations, xShift, yShift, zShift);
-#endif
+		// Either hash in original order or keep the slot order of the previous frame
+		int idx = (reusePreviousOrder && hashedOnce) ? cellIndexPair[i].index : i;
+		hashingLogic<Mode>(i, idx, locations, xShift, yShift, zShift);
 	}
+	hashedOnce = true;
 }
 
 // Testing
 int NNS::hash(float3 location) {
+	if (periodic) {
+		std::vector<float> single = { location.x, location.y, location.z };
+		return hashingCellPeriodic(0, single.data());
+	}
+
 	float xShift = simDimx_buffered / 2.0f;
 	float yShift = simDimy_buffered / 2.0f;
 	float zShift = simDimz_buffered / 2.0f;
@@ -173,19 +482,85 @@ int NNS::hash(float3 location) {
 	int hash = xCube + yCube * cellDimx + zCube * cellDimx * cellDimy;
 
 	if (hash >= cellCount || hash < 0) {
-#if defined(DEBUG) | defined(_DEBUG)
-		printf("Hash ERROR: HashVal %u - Max HashVal %u   c(%d,%d,%d) l(%f,%f,%f)\n",
-			hash, cellCount, xCube, yCube, zCube, location.x, location.y, location.z);
-#endif
+		if (hashMode == HASH_DEBUG) {
+			printf("Hash ERROR: HashVal %u - Max HashVal %u   c(%d,%d,%d) l(%f,%f,%f)\n",
+				hash, cellCount, xCube, yCube, zCube, location.x, location.y, location.z);
+		}
 		hash = cellCount - 1;		// In calculation this cell is excluded (it is in the outter buffer region)
 	}
 
-	return hash;
+	return orderedCell(hash);
 }
 
 void NNS::kvSort() {
-	// sort the vector by increasing order of its cell ID
-	sort(cellIndexPair.begin(), cellIndexPair.end(), sortByCellID);
+	if (sortMethod == KV_SORT_RADIX) {
+		radixSort();
+	}
+	else if (reusePreviousOrder) {
+		// Stable so the previous frame's order is kept within a cell
+		stable_sort(cellIndexPair.begin(), cellIndexPair.end(), sortByCellID);
+	}
+	else {
+		// sort the vector by increasing order of its cell ID
+		sort(cellIndexPair.begin(), cellIndexPair.end(), sortByCellID);
+	}
+}
+
+// LSD radix sort on cellID, each pass is a stable counting sort on one digit
+// Threads own a contiguous chunk of the input, count their digits, then scatter 
+// to offsets from a prefix sum ordered by (digit, thread) which keeps it stable
+void NNS::radixSort() {
+	int bucketCount = 1 << radixBits;
+	int mask = bucketCount - 1;
+
+	// Thread count may have changed since init
+	size_t histogramSize = (size_t)omp_get_max_threads() * bucketCount;
+	if (radixHistogram.size() < histogramSize) {
+		radixHistogram.resize(histogramSize);
+	}
+
+	for (int pass = 0; pass < radixPasses; pass++) {
+		int shift = pass * radixBits;
+		KeyValuePair* src = cellIndexPair.data();
+		KeyValuePair* dst = cellIndexPairTemp.data();
+
+#pragma omp parallel
+		{
+			int threadCount = omp_get_num_threads();
+			int thread = omp_get_thread_num();
+			int chunk = (particleCount + threadCount - 1) / threadCount;
+			int begin = std::min(particleCount, thread * chunk);
+			int end = std::min(particleCount, begin + chunk);
+
+			int* histogram = &radixHistogram[(size_t)thread * bucketCount];
+			for (int b = 0; b < bucketCount; b++) {
+				histogram[b] = 0;
+			}
+			for (int i = begin; i < end; i++) {
+				++histogram[(src[i].cellID >> shift) & mask];
+			}
+
+#pragma omp barrier
+#pragma omp single
+			{
+				// Exclusive prefix sum, digit major then thread, turns counts into offsets
+				int offset = 0;
+				for (int b = 0; b < bucketCount; b++) {
+					for (int t = 0; t < threadCount; t++) {
+						int temp = radixHistogram[(size_t)t * bucketCount + b];
+						radixHistogram[(size_t)t * bucketCount + b] = offset;
+						offset += temp;
+					}
+				}
+			}
+
+			for (int i = begin; i < end; i++) {
+				dst[histogram[(src[i].cellID >> shift) & mask]++] = src[i];
+			}
+		}
+
+		cellIndexPair.swap(cellIndexPairTemp);
+	}
 }
 
 void NNS::findCellStartEnd() {
@@ -193,7 +568,9 @@ void NNS::findCellStartEnd() {
 	// Mem set to signal cells are empty if not set in this function
 	memset(cellStart.data(), 0xffffffff, cellStart.size() * sizeof(uint32_t));
 
-	uint32_t current = 0;
+	// The first cell is opened here, cell 0 can be occupied in periodic grids (no buffer region)
+	uint32_t current = (particleCount > 0) ? cellIndexPair[0].cellID : 0;
+	cellStart[current] = 0;
 	for (int i = 0; i < particleCount; i++) {
 		uint32_t cell = cellIndexPair[i].cellID;
 		if (cell != current) { // Found entry in new cell
@@ -203,9 +580,32 @@ void NNS::findCellStartEnd() {
 		}
 	}
 	cellEnd[current] = particleCount; // Handle last item
+	gridValid = true;
+	slotMapValid = false;
+
+#if NNS_INSTRUMENT
+	instrument.recordCellOccupancy(*this);
+#endif
 }
 
 void NNS::reorder(std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	reorder(locations.data(), sortedLoc);
+}
+
+// Periodic grids store the wrapped positions, the minimum image shifts assume them
+void NNS::reorder(const float* locations, std::vector<float>& sortedLoc) {
+	if (periodic) {
+		for (int i = 0; i < particleCount; ++i) {
+			int originalIndex = cellIndexPair[i].index;
+			float3 wrapped = wrapPosition(locations[originalIndex * 3 + 0], locations[originalIndex * 3 + 1], locations[originalIndex * 3 + 2]);
+
+			sortedLoc[i * 3 + 0] = wrapped.x;
+			sortedLoc[i * 3 + 1] = wrapped.y;
+			sortedLoc[i * 3 + 2] = wrapped.z;
+		}
+		return;
+	}
+
 	for (int i = 0; i < particleCount; ++i) {
 		int originalIndex = cellIndexPair[i].index;
 
@@ -215,6 +615,704 @@ void NNS::reorder(std::vector<float>& locations, std::vector<float>& sortedLoc)
 	}
 }
 
+// Same gather into separate x, y, z arrays
+void NNS::reorder(std::vector<float>& locations, Float3SoA& sortedSoA) {
+	int i = 0;
+
+	if (periodic) {
+#pragma omp parallel for
+		for (i = 0; i < particleCount; ++i) {
+			int originalIndex = cellIndexPair[i].index;
+			float3 wrapped = wrapPosition(locations[originalIndex * 3 + 0], locations[originalIndex * 3 + 1], locations[originalIndex * 3 + 2]);
+
+			sortedSoA.x[i] = wrapped.x;
+			sortedSoA.y[i] = wrapped.y;
+			sortedSoA.z[i] = wrapped.z;
+		}
+		return;
+	}
+
+#pragma omp parallel for
+	for (i = 0; i < particleCount; ++i) {
+		int originalIndex = cellIndexPair[i].index;
+
+		sortedSoA.x[i] = locations[originalIndex * 3 + 0];
+		sortedSoA.y[i] = locations[originalIndex * 3 + 1];
+		sortedSoA.z[i] = locations[originalIndex * 3 + 2];
+	}
+}
+
+// The cell of a particle is known from cellIndexPair, its corner is subtracted and the rest scaled 
+// to 2^bits steps per cellLength
+void NNS::reorder(std::vector<float>& locations, QuantizedPositions& quantized) {
+	int bits = quantized.bits;
+	int maxStep = (1 << bits) - 1;
+	float scale = (float)(1 << bits) / cellLength;
+	float xShift = simDimx_buffered / 2.0f;
+	float yShift = simDimy_buffered / 2.0f;
+	float zShift = simDimz_buffered / 2.0f;
+	int lastCell = cellCount - 1;
+	bool packed = quantized.isPacked();
+
+	int i = 0;
+
+#pragma omp parallel for
+	for (i = 0; i < particleCount; ++i) {
+		int originalIndex = cellIndexPair[i].index;
+		int cell = cellIndexPair[i].cellID;
+		int qx = 0, qy = 0, qz = 0;
+
+		if (cell != lastCell) {
+			int rowMajor = (cellOrder == CELL_ORDER_ROW_MAJOR) ? cell : cellRowMajor[cell];
+			int cx = rowMajor % cellDimx;
+			int cy = (rowMajor / cellDimx) % cellDimy;
+			int cz = rowMajor / (cellDimx * cellDimy);
+
+			qx = (int)((locations[originalIndex * 3 + 0] + xShift - (float)(cx * cellLength)) * scale);
+			qy = (int)((locations[originalIndex * 3 + 1] + yShift - (float)(cy * cellLength)) * scale);
+			qz = (int)((locations[originalIndex * 3 + 2] + zShift - (float)(cz * cellLength)) * scale);
+			qx = std::min(std::max(qx, 0), maxStep);
+			qy = std::min(std::max(qy, 0), maxStep);
+			qz = std::min(std::max(qz, 0), maxStep);
+		}
+
+		if (packed) {
+			quantized.packed[i] = (uint32_t)qx | ((uint32_t)qy << bits) | ((uint32_t)qz << (2 * bits));
+		}
+		else {
+			quantized.wide[(size_t)i * 3 + 0] = (uint16_t)qx;
+			quantized.wide[(size_t)i * 3 + 1] = (uint16_t)qy;
+			quantized.wide[(size_t)i * 3 + 2] = (uint16_t)qz;
+		}
+	}
+}
+
+// Above this many per thread histogram entries per particle (threads x cells / particles) build uses
+// buildShared. Clearing and scanning the per thread histograms touches 3 x threads x cells entries, the
+// shared histogram 3 x cells entries plus 2 atomic increments, a cell sort and a gather per particle
+// The two took the same time at 40 to 60 entries per particle with 2 and 4 threads
+static const size_t sharedHistogramRatio = 32;
+
+// Counting sort over cell IDs, does the work of hash, kvSort, findCellStartEnd and reorder
+// 1. Hash each particle and count it in the thread's cell histogram
+// 2. Exclusive prefix sum over (cell, thread) gives cellStart/cellEnd and scatter offsets
+// 3. Scatter the key value pairs and the locations to their sorted position
+// Threads keep the same particle chunk in steps 1 and 3 so the result is stable
+// Grids with many more cells than particles go to buildShared, which gives the same result
+void NNS::build(std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	build(locations.data(), sortedLoc);
+}
+
+void NNS::build(const float* locations, std::vector<float>& sortedLoc) {
+#if NNS_INSTRUMENT
+	instrument.beginFrame();
+#endif
+
+	switch (periodic ? HASH_PERIODIC : hashMode) {
+	case HASH_DEBUG:    buildImpl<HASH_DEBUG>(locations, sortedLoc); break;
+	case HASH_SAFE:     buildImpl<HASH_SAFE>(locations, sortedLoc); break;
+	case HASH_FAST:     buildImpl<HASH_FAST>(locations, sortedLoc); break;
+	case HASH_PERIODIC: buildImpl<HASH_PERIODIC>(locations, sortedLoc); break;
+	}
+
+#if NNS_INSTRUMENT
+	instrument.recordDumped(countDumped());
+	instrument.recordCellOccupancy(*this);
+#endif
+}
+
+template <HashMode Mode>
+void NNS::buildImpl(const float* locations, std::vector<float>& sortedLoc) {
+	float xShift = simDimx_buffered / 2.0f;
+	float yShift = simDimy_buffered / 2.0f;
+	float zShift = simDimz_buffered / 2.0f;
+
+	size_t histogramSize = (size_t)omp_get_max_threads() * cellCount;
+	if (omp_get_max_threads() > 1 && histogramSize > sharedHistogramRatio * particleCount) {
+		buildShared<Mode>(locations, sortedLoc);
+		return;
+	}
+	if (cellHistogram.size() < histogramSize) {
+		cellHistogram.resize(histogramSize);
+	}
+	std::vector<uint32_t> blockOffset(omp_get_max_threads() + 1);
+
+#pragma omp parallel
+	{
+		int threadCount = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+		int chunk = (particleCount + threadCount - 1) / threadCount;
+		int begin = std::min(particleCount, thread * chunk);
+		int end = std::min(particleCount, begin + chunk);
+
+		int cellChunk = (cellCount + threadCount - 1) / threadCount;
+		int cellBegin = std::min(cellCount, thread * cellChunk);
+		int cellEndIdx = std::min(cellCount, cellBegin + cellChunk);
+
+		uint32_t* histogram = &cellHistogram[(size_t)thread * cellCount];
+		memset(histogram, 0, cellCount * sizeof(uint32_t));
+
+		// 1. Hash and count
+		for (int i = begin; i < end; i++) {
+			hashingLogic<Mode>(i, i, locations, xShift, yShift, zShift);
+			++histogram[cellIndexPair[i].cellID];
+		}
+
+#pragma omp barrier
+		// 2a. Particles in this thread's block of cells
+		uint32_t blockTotal = 0;
+		for (int c = cellBegin; c < cellEndIdx; c++) {
+			for (int t = 0; t < threadCount; t++) {
+				blockTotal += cellHistogram[(size_t)t * cellCount + c];
+			}
+		}
+		blockOffset[thread + 1] = blockTotal;
+
+#pragma omp barrier
+#pragma omp single
+		{
+			blockOffset[0] = 0;
+			for (int t = 0; t < threadCount; t++) {
+				blockOffset[t + 1] += blockOffset[t];
+			}
+		}
+
+		// 2b. Exclusive prefix sum within the block of cells
+		uint32_t offset = blockOffset[thread];
+		for (int c = cellBegin; c < cellEndIdx; c++) {
+			uint32_t start = offset;
+			for (int t = 0; t < threadCount; t++) {
+				uint32_t temp = cellHistogram[(size_t)t * cellCount + c];
+				cellHistogram[(size_t)t * cellCount + c] = offset;
+				offset += temp;
+			}
+			// Empty cells are signaled the same way as in findCellStartEnd
+			cellStart[c] = (offset != start) ? start : 0xffffffff;
+			cellEnd[c] = offset;
+		}
+
+#pragma omp barrier
+		// 3. Scatter
+		for (int i = begin; i < end; i++) {
+			KeyValuePair pair = cellIndexPair[i];
+			uint32_t dst = histogram[pair.cellID]++;
+
+			cellIndexPairTemp[dst] = pair;
+			if constexpr (Mode == HASH_PERIODIC) {
+				float3 wrapped = wrapPosition(locations[i * 3 + 0], locations[i * 3 + 1], locations[i * 3 + 2]);
+				sortedLoc[dst * 3 + 0] = wrapped.x;
+				sortedLoc[dst * 3 + 1] = wrapped.y;
+				sortedLoc[dst * 3 + 2] = wrapped.z;
+			}
+			else {
+				sortedLoc[dst * 3 + 0] = locations[i * 3 + 0];
+				sortedLoc[dst * 3 + 1] = locations[i * 3 + 1];
+				sortedLoc[dst * 3 + 2] = locations[i * 3 + 2];
+			}
+		}
+	}
+
+	cellIndexPair.swap(cellIndexPairTemp);
+	hashedOnce = true;
+	gridValid = true;
+	slotMapValid = false;
+}
+
+// Counting sort with one histogram of cellCount entries shared by the threads
+// 1. Hash each particle and count it with an atomic increment
+// 2. Exclusive prefix sum over the cells, one block of cells per thread
+// 3. Scatter the key value pairs, the atomic offsets place particles of a cell in any order
+// 4. Sort each cell by particle index, which is the stable order of buildImpl, then gather the locations
+template <HashMode Mode>
+void NNS::buildShared(const float* locations, std::vector<float>& sortedLoc) {
+	float xShift = simDimx_buffered / 2.0f;
+	float yShift = simDimy_buffered / 2.0f;
+	float zShift = simDimz_buffered / 2.0f;
+
+	if (cellHistogram.size() < (size_t)cellCount) {
+		cellHistogram.resize(cellCount);
+	}
+	uint32_t* histogram = cellHistogram.data();
+	std::vector<uint32_t> blockOffset(omp_get_max_threads() + 1);
+
+#pragma omp parallel
+	{
+		int threadCount = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+		int chunk = (particleCount + threadCount - 1) / threadCount;
+		int begin = std::min(particleCount, thread * chunk);
+		int end = std::min(particleCount, begin + chunk);
+
+		int cellChunk = (cellCount + threadCount - 1) / threadCount;
+		int cellBegin = std::min(cellCount, thread * cellChunk);
+		int cellEndIdx = std::min(cellCount, cellBegin + cellChunk);
+
+		memset(histogram + cellBegin, 0, (cellEndIdx - cellBegin) * sizeof(uint32_t));
+#pragma omp barrier
+
+		// 1. Hash and count
+		for (int i = begin; i < end; i++) {
+			hashingLogic<Mode>(i, i, locations, xShift, yShift, zShift);
+#pragma omp atomic
+			++histogram[cellIndexPair[i].cellID];
+		}
+
+#pragma omp barrier
+		// 2a. Particles in this thread's block of cells
+		uint32_t blockTotal = 0;
+		for (int c = cellBegin; c < cellEndIdx; c++) {
+			blockTotal += histogram[c];
+		}
+		blockOffset[thread + 1] = blockTotal;
+
+#pragma omp barrier
+#pragma omp single
+		{
+			blockOffset[0] = 0;
+			for (int t = 0; t < threadCount; t++) {
+				blockOffset[t + 1] += blockOffset[t];
+			}
+		}
+
+		// 2b. Exclusive prefix sum within the block of cells
+		uint32_t offset = blockOffset[thread];
+		for (int c = cellBegin; c < cellEndIdx; c++) {
+			uint32_t start = offset;
+			offset += histogram[c];
+			histogram[c] = start;
+			cellStart[c] = (offset != start) ? start : 0xffffffff;
+			cellEnd[c] = offset;
+		}
+
+#pragma omp barrier
+		// 3. Scatter
+		for (int i = begin; i < end; i++) {
+			KeyValuePair pair = cellIndexPair[i];
+			uint32_t dst;
+#pragma omp atomic capture
+			dst = histogram[pair.cellID]++;
+			cellIndexPairTemp[dst] = pair;
+		}
+
+#pragma omp barrier
+		// 4. The block's cells are its slots blockOffset[thread] to blockOffset[thread + 1]
+		for (int c = cellBegin; c < cellEndIdx; c++) {
+			if (cellStart[c] != 0xffffffff && cellEnd[c] - cellStart[c] > 1) {
+				std::sort(cellIndexPairTemp.begin() + cellStart[c], cellIndexPairTemp.begin() + cellEnd[c],
+					[](const KeyValuePair& a, const KeyValuePair& b) { return a.index < b.index; });
+			}
+		}
+		for (uint32_t dst = blockOffset[thread]; dst < blockOffset[thread + 1]; dst++) {
+			int i = cellIndexPairTemp[dst].index;
+			if constexpr (Mode == HASH_PERIODIC) {
+				float3 wrapped = wrapPosition(locations[i * 3 + 0], locations[i * 3 + 1], locations[i * 3 + 2]);
+				sortedLoc[dst * 3 + 0] = wrapped.x;
+				sortedLoc[dst * 3 + 1] = wrapped.y;
+				sortedLoc[dst * 3 + 2] = wrapped.z;
+			}
+			else {
+				sortedLoc[dst * 3 + 0] = locations[i * 3 + 0];
+				sortedLoc[dst * 3 + 1] = locations[i * 3 + 1];
+				sortedLoc[dst * 3 + 2] = locations[i * 3 + 2];
+			}
+		}
+	}
+
+	cellIndexPair.swap(cellIndexPairTemp);
+	hashedOnce = true;
+	gridValid = true;
+	slotMapValid = false;
+}
+
+// Swaps two slots of cellIndexPair and keeps particleSlot current
+void NNS::swapSlots(uint32_t a, uint32_t b) {
+	std::swap(cellIndexPair[a], cellIndexPair[b]);
+
+	particleSlot[cellIndexPair[a].index] = a;
+	particleSlot[cellIndexPair[b].index] = b;
+}
+
+// Moves the particle in slot to newCell keeping cellIndexPair packed and sorted
+// The particle is swapped to the edge of its cell, then each occupied cell between the old 
+// and new cell is rotated by one slot (its edge particle moves to the other side) 
+// Cost is the number of occupied cells in between, not the particle count
+void NNS::moveToCell(uint32_t slot, int newCell) {
+	int oldCell = cellIndexPair[slot].cellID;
+
+	if (newCell > oldCell) {
+		// Remove from the end of the old cell
+		uint32_t hole = cellEnd[oldCell] - 1;
+		swapSlots(slot, hole);
+		cellEnd[oldCell] = hole;
+		if (cellEnd[oldCell] == cellStart[oldCell]) cellStart[oldCell] = 0xffffffff;
+
+		// Cell of hole + 1 is the next occupied cell
+		while (hole + 1 < (uint32_t)particleCount && cellIndexPair[hole + 1].cellID < newCell) {
+			int cell = cellIndexPair[hole + 1].cellID;
+			uint32_t last = cellEnd[cell] - 1;
+			swapSlots(hole, last);
+			cellStart[cell] = hole;
+			cellEnd[cell] = last;
+			hole = last;
+		}
+
+		if (hole + 1 < (uint32_t)particleCount && cellIndexPair[hole + 1].cellID == newCell) {
+			cellStart[newCell] = hole;
+		}
+		else {
+			cellStart[newCell] = hole;
+			cellEnd[newCell] = hole + 1;
+		}
+		cellIndexPair[hole].cellID = newCell;
+	}
+	else {
+		// Remove from the start of the old cell
+		uint32_t hole = cellStart[oldCell];
+		swapSlots(slot, hole);
+		cellStart[oldCell] = hole + 1;
+		if (cellEnd[oldCell] == cellStart[oldCell]) cellStart[oldCell] = 0xffffffff;
+
+		// Cell of hole - 1 is the previous occupied cell
+		while (hole > 0 && cellIndexPair[hole - 1].cellID > newCell) {
+			int cell = cellIndexPair[hole - 1].cellID;
+			uint32_t first = cellStart[cell];
+			swapSlots(hole, first);
+			cellStart[cell] = first + 1;
+			cellEnd[cell] = hole + 1;
+			hole = first;
+		}
+
+		if (hole > 0 && cellIndexPair[hole - 1].cellID == newCell) {
+			cellEnd[newCell] = hole + 1;
+		}
+		else {
+			cellStart[newCell] = hole;
+			cellEnd[newCell] = hole + 1;
+		}
+		cellIndexPair[hole].cellID = newCell;
+	}
+}
+
+// Time of one rotation step of moveToCell over the time of one slot of the merge pass on one thread
+// (about 6 and 13 ns), the merge pass is split over the threads and the rotations are serial
+static const double rotationCost = 0.5;
+
+int NNS::updateIncremental(std::vector<float>& locations) {
+	if (!gridValid) {
+		hash(locations);
+		kvSort();
+		findCellStartEnd();
+		return particleCount;
+	}
+
+	int i = 0;
+
+	if (!slotMapValid) {
+		// Cell and slot of each particle after the last full update
+#pragma omp parallel for
+		for (i = 0; i < particleCount; i++) {
+			particleCell[cellIndexPair[i].index] = cellIndexPair[i].cellID;
+			particleSlot[cellIndexPair[i].index] = i;
+		}
+		slotMapValid = true;
+	}
+
+	float xShift = simDimx_buffered / 2.0f;
+	float yShift = simDimy_buffered / 2.0f;
+	float zShift = simDimz_buffered / 2.0f;
+
+	// Find particles whose cell changed, reads the locations in order like hash
+	movers.clear();
+	double crossedCells = 0.0;
+#pragma omp parallel reduction(+:crossedCells)
+	{
+		std::vector<KeyValuePair> localMovers;
+
+#pragma omp for nowait
+		for (i = 0; i < particleCount; i++) {
+			int newCell = periodic ? hashingCellPeriodic(i, locations.data()) : hashingCellSafe(i, locations.data(), xShift, yShift, zShift);
+			if (newCell != particleCell[i]) {
+				localMovers.push_back(makeKeyValue(newCell, i));
+				crossedCells += std::abs(newCell - particleCell[i]);
+			}
+		}
+
+#pragma omp critical
+		movers.insert(movers.end(), localMovers.begin(), localMovers.end());
+	}
+
+	// Each move rotates the occupied cells between the old and new cell, estimate that against one
+	// merge pass over all slots and take the full update above maxMoverFraction
+	int moverCount = (int)movers.size();
+	double estimatedSwaps = crossedCells * std::min(1.0, particleCount / (double)cellCount);
+	if (moverCount > maxMoverFraction * particleCount) {
+		// Only the movers' cells changed, so finish with a full sort of the current order
+		for (int m = 0; m < moverCount; m++) {
+			cellIndexPair[particleSlot[movers[m].index]].cellID = movers[m].cellID;
+		}
+		kvSort();
+		findCellStartEnd();
+		return moverCount;
+	}
+
+	if (estimatedSwaps * rotationCost * omp_get_max_threads() > particleCount) {
+		mergeMovers();
+		return moverCount;
+	}
+
+	for (int m = 0; m < moverCount; m++) {
+		int idx = movers[m].index;
+		moveToCell(particleSlot[idx], movers[m].cellID);
+		particleCell[idx] = movers[m].cellID;
+	}
+
+	return moverCount;
+}
+
+// Rebuilds cellIndexPair from the particles that stayed, already in cell order, and the movers sorted
+// by their new cell, like the merge step of a merge sort
+// 1. Each thread takes a block of cells, the blocks split the old slots evenly
+// 2. The movers' old slots are marked and their old cells emptied, cells that still hold a particle
+//    are set again by the merge
+// 3. Each thread merges the unmarked slots of its block with the movers into its block of cells,
+//    writing cellStart/cellEnd and the particles' new slots
+void NNS::mergeMovers() {
+	std::sort(movers.begin(), movers.end(), [](const KeyValuePair& a, const KeyValuePair& b) {
+		return (a.cellID != b.cellID) ? a.cellID < b.cellID : a.index < b.index;
+	});
+	int moverCount = (int)movers.size();
+
+	std::vector<int> blockCell(omp_get_max_threads() + 1);
+	std::vector<uint32_t> blockSlot(omp_get_max_threads() + 1);
+	std::vector<int> blockMover(omp_get_max_threads() + 1);
+	std::vector<uint32_t> blockOut(omp_get_max_threads() + 1);
+
+#pragma omp parallel
+	{
+		int threadCount = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+
+		// 1.
+#pragma omp single
+		{
+			blockCell[0] = 0;
+			blockSlot[0] = 0;
+			for (int t = 1; t < threadCount; t++) {
+				blockCell[t] = std::max(blockCell[t - 1], cellIndexPair[(size_t)particleCount * t / threadCount].cellID);
+				blockSlot[t] = cellStart[blockCell[t]];
+			}
+			blockCell[threadCount] = cellCount;
+			blockSlot[threadCount] = particleCount;
+
+			// Output start of each block, the slots minus the movers leaving plus the movers arriving
+			std::vector<int> leaving(threadCount + 1, 0);
+			for (int m = 0; m < moverCount; m++) {
+				uint32_t slot = particleSlot[movers[m].index];
+				int t = (int)(std::upper_bound(blockSlot.begin(), blockSlot.begin() + threadCount + 1, slot) - blockSlot.begin()) - 1;
+				++leaving[t + 1];
+			}
+			blockOut[0] = 0;
+			for (int t = 0; t <= threadCount; t++) {
+				KeyValuePair key = makeKeyValue(blockCell[t], -1);
+				blockMover[t] = (int)(std::lower_bound(movers.begin(), movers.end(), key, [](const KeyValuePair& a, const KeyValuePair& b) {
+					return a.cellID < b.cellID;
+				}) - movers.begin());
+				if (t > 0) {
+					leaving[t] += leaving[t - 1];
+					blockOut[t] = blockSlot[t] - leaving[t] + blockMover[t];
+				}
+			}
+		}
+
+		// 2.
+		int m = 0;
+#pragma omp for
+		for (m = 0; m < moverCount; m++) {
+			int idx = movers[m].index;
+			cellStart[particleCell[idx]] = 0xffffffff;
+			cellIndexPair[particleSlot[idx]].cellID = -1;
+		}
+
+		// 3.
+		uint32_t slot = blockSlot[thread];
+		uint32_t slotEnd = blockSlot[thread + 1];
+		int mover = blockMover[thread];
+		int moverEnd = blockMover[thread + 1];
+		uint32_t dst = blockOut[thread];
+		int lastCell = -1;
+
+		// A cell's first particle sets its start, every particle its end
+		auto place = [&](KeyValuePair pair) {
+			cellIndexPairTemp[dst] = pair;
+			particleSlot[pair.index] = dst;
+			cellStart[pair.cellID] = (pair.cellID != lastCell) ? dst : cellStart[pair.cellID];
+			cellEnd[pair.cellID] = ++dst;
+			lastCell = pair.cellID;
+		};
+
+		for (; slot < slotEnd; slot++) {
+			KeyValuePair pair = cellIndexPair[slot];
+			if (pair.cellID < 0) {
+				continue;
+			}
+			// Particles that stayed go first in their cell
+			while (mover < moverEnd && movers[mover].cellID < pair.cellID) {
+				place(movers[mover++]);
+			}
+			place(pair);
+		}
+		while (mover < moverEnd) {
+			place(movers[mover++]);
+		}
+
+#pragma omp for
+		for (m = 0; m < moverCount; m++) {
+			particleCell[movers[m].index] = movers[m].cellID;
+		}
+	}
+
+	cellIndexPair.swap(cellIndexPairTemp);
+}
+
+size_t NNS::memoryBytes() const {
+	return (cellStart.capacity() + cellEnd.capacity() + cellHistogram.capacity()) * sizeof(uint32_t)
+		+ (cellIndexPair.capacity() + cellIndexPairTemp.capacity()) * sizeof(KeyValuePair)
+		+ (cellRank.capacity() + cellRowMajor.capacity() + orderedNeighbor.capacity() + radixHistogram.capacity()) * sizeof(int);
+}
+
+// Threads take blocks of slots of cellIndexPair and the cells that start in them, the cell and cost
+// positions come from a scan of the block totals like the radix sort histograms
+// 1. Non-empty cells in sorted order, from the cell changes in cellIndexPair
+// 2. Cost of each cell, then an inclusive prefix sum
+// 3. Chunk boundaries at equal steps of the total cost, a cell is never split
+void NNS::buildSchedule(int threadCount, int chunksPerThread) {
+	std::vector<int> blockCells(omp_get_max_threads() + 1, 0);
+	std::vector<uint64_t> blockCost(omp_get_max_threads() + 1, 0);
+
+#pragma omp parallel
+	{
+		int teamSize = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+		int chunk = (particleCount + teamSize - 1) / teamSize;
+		int begin = std::min(particleCount, thread * chunk);
+		int end = std::min(particleCount, begin + chunk);
+
+		// 1.
+		int localCells = 0;
+		for (int i = begin; i < end; i++) {
+			if (i == 0 || cellIndexPair[i].cellID != cellIndexPair[i - 1].cellID) {
+				++localCells;
+			}
+		}
+		blockCells[thread + 1] = localCells;
+
+#pragma omp barrier
+#pragma omp single
+		{
+			for (int t = 0; t < teamSize; t++) {
+				blockCells[t + 1] += blockCells[t];
+			}
+			workCells.resize(blockCells[teamSize]);
+			workCost.resize(blockCells[teamSize]);
+		}
+
+		// 2. Same stencil tests as countNeighbors
+		int w = blockCells[thread];
+		uint64_t cost = 0;
+		for (int i = begin; i < end; i++) {
+			if (i > 0 && cellIndexPair[i].cellID == cellIndexPair[i - 1].cellID) {
+				continue;
+			}
+			int cell = cellIndexPair[i].cellID;
+			uint64_t stencilCount = 0;
+			for (int t = 0; t < 27; t++) {
+				int targetCell = neighborCell(cell, t);
+				if (targetCell < cellCount - 1 && cellStart[targetCell] != 0xffffffff) {
+					stencilCount += cellEnd[targetCell] - cellStart[targetCell];
+				}
+			}
+			cost += (uint64_t)(cellEnd[cell] - cellStart[cell]) * stencilCount;
+			workCells[w] = cell;
+			workCost[w++] = cost;
+		}
+		blockCost[thread + 1] = cost;
+
+#pragma omp barrier
+#pragma omp single
+		{
+			for (int t = 0; t < teamSize; t++) {
+				blockCost[t + 1] += blockCost[t];
+			}
+		}
+
+		for (w = blockCells[thread]; w < blockCells[thread + 1]; w++) {
+			workCost[w] += blockCost[thread];
+		}
+	}
+	int cells = (int)workCells.size();
+
+	// 3.
+	int chunkCount = std::max(1, std::min(threadCount * chunksPerThread, cells));
+	uint64_t total = cells ? workCost[cells - 1] : 0;
+	workChunks.assign(1, 0);
+	for (int c = 1; c < chunkCount; c++) {
+		uint64_t target = total * c / chunkCount;
+		int boundary = (int)(std::upper_bound(workCost.begin(), workCost.end(), target) - workCost.begin());
+		if (boundary > workChunks.back() && boundary < cells) {
+			workChunks.push_back(boundary);
+		}
+	}
+	workChunks.push_back(cells);
+}
+
+void NNS::scheduleImbalance(int threadCount, double& particleStatic, double& cellDynamic) {
+	particleStatic = cellDynamic = 1.0;
+	int cells = (int)workCells.size();
+	if (cells == 0 || threadCount < 2) {
+		return;
+	}
+	double mean = workCost[cells - 1] / (double)threadCount;
+	if (mean == 0.0) {
+		return;
+	}
+
+	// Static schedule, contiguous blocks of ceil(particleCount / threadCount) particles
+	std::vector<double> load(threadCount, 0.0);
+	int block = (particleCount + threadCount - 1) / threadCount;
+	for (int w = 0; w < cells; w++) {
+		int cell = workCells[w];
+		uint32_t count = cellEnd[cell] - cellStart[cell];
+		double perParticle = (workCost[w] - (w ? workCost[w - 1] : 0)) / (double)count;
+		for (uint32_t i = cellStart[cell]; i < cellEnd[cell]; i++) {
+			load[i / block] += perParticle;
+		}
+	}
+	particleStatic = *std::max_element(load.begin(), load.end()) / mean;
+
+	// Dynamic schedule, chunks in order to the least loaded thread
+	std::fill(load.begin(), load.end(), 0.0);
+	for (size_t c = 0; c + 1 < workChunks.size(); c++) {
+		uint64_t before = workChunks[c] ? workCost[workChunks[c] - 1] : 0;
+		double cost = (double)(workCost[workChunks[c + 1] - 1] - before);
+		*std::min_element(load.begin(), load.end()) += cost;
+	}
+	cellDynamic = *std::max_element(load.begin(), load.end()) / mean;
+}
+
+// Particles hashed into the out-of-bounds cell
+int NNS::countDumped() {
+	int dumped = 0;
+	int i = 0;
+
+#pragma omp parallel for reduction(+:dumped)
+	for (i = 0; i < particleCount; i++) {
+		if (cellIndexPair[i].cellID == cellCount - 1) {
+			++dumped;
+		}
+	}
+	return dumped;
+}
+
 // Helper
 int minimizePrint(int loop) {
 	if (loop > 100) {
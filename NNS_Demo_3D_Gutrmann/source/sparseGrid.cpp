@@ -0,0 +1,204 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <sparseGrid.hpp>
+#include <algorithm>
+#include <cmath>
+
+// 21 bits per axis, coordinates are shifted so the origin is in the middle of the range
+#define SPARSE_AXIS_BITS 21
+#define SPARSE_AXIS_MASK ((1ULL << SPARSE_AXIS_BITS) - 1)
+#define SPARSE_AXIS_ORIGIN (1LL << (SPARSE_AXIS_BITS - 1))
+
+static uint64_t packCell(int64_t cx, int64_t cy, int64_t cz) {
+	return ((uint64_t)(cx + SPARSE_AXIS_ORIGIN) & SPARSE_AXIS_MASK)
+		| (((uint64_t)(cy + SPARSE_AXIS_ORIGIN) & SPARSE_AXIS_MASK) << SPARSE_AXIS_BITS)
+		| (((uint64_t)(cz + SPARSE_AXIS_ORIGIN) & SPARSE_AXIS_MASK) << (SPARSE_AXIS_BITS * 2));
+}
+
+void SparseGrid::init(int count, float cell) {
+	cellLength = cell;
+	particleCount = count;
+
+	// At most one occupied cell per particle, half full at worst keeps the probes short
+	tableBits = 4;
+	while ((1ULL << tableBits) < 2ULL * (uint64_t)count) {
+		++tableBits;
+	}
+	tableMask = (1ULL << tableBits) - 1;
+	SparseCell empty = { emptyKey, 0, 0 };
+	table.assign((size_t)1 << tableBits, empty);
+	bitMask = (1ULL << (tableBits + 3)) - 1;
+	occupiedBits.assign(((size_t)1 << (tableBits + 3)) / 64, 0);
+
+	// Adding a delta to a packed key moves each axis, no carries as long as the cells stay in range
+	for (int t = 0; t < 27; t++) {
+		int64_t dx = (t % 3) - 1;
+		int64_t dy = ((t % 9) / 3) - 1;
+		int64_t dz = (t / 9) - 1;
+		stencilDelta[t] = (uint64_t)dx + ((uint64_t)dy << SPARSE_AXIS_BITS) + ((uint64_t)dz << (SPARSE_AXIS_BITS * 2));
+	}
+
+	sortedKey.resize(particleCount);
+	sortedIndex.resize(particleCount);
+	particleKey.resize(particleCount);
+	particleSlot.resize(particleCount);
+	occupiedSlots.clear();
+	occupiedSlots.reserve(particleCount);
+	occupiedCount = 0;
+}
+
+uint64_t SparseGrid::cellKey(float x, float y, float z) const {
+	// floor, not truncation, so negative coordinates get their own cells
+	return packCell((int64_t)floorf(x / cellLength), (int64_t)floorf(y / cellLength), (int64_t)floorf(z / cellLength));
+}
+
+// Returns the slot of key, adding it with a count of 0 if it is new
+uint32_t SparseGrid::insert(uint64_t key) {
+	uint64_t slot = slotOf(key);
+	while (table[slot].key != key) {
+		if (table[slot].key == emptyKey) {
+			table[slot].key = key;
+			table[slot].start = 0;
+			table[slot].end = 0;
+			occupiedSlots.push_back((uint32_t)slot);
+			uint64_t bit = bitOf(key);
+			occupiedBits[bit >> 6] |= 1ULL << (bit & 63);
+			break;
+		}
+		slot = (slot + 1) & tableMask;
+	}
+	return (uint32_t)slot;
+}
+
+static int bitsFor(uint64_t v) {
+	int bits = 0;
+	while (v >> bits) {
+		++bits;
+	}
+	return bits;
+}
+
+// Fills occupiedOrder with the occupied cells in key order
+// The packed keys span ~60 bits, but relative to the bounding box of the occupied cells 
+// a key only needs the bits of the box size per axis, so an LSD radix sort takes a few passes
+void SparseGrid::sortOccupiedCells() {
+	uint64_t lo[3] = { SPARSE_AXIS_MASK, SPARSE_AXIS_MASK, SPARSE_AXIS_MASK };
+	uint64_t hi[3] = { 0, 0, 0 };
+	for (int c = 0; c < occupiedCount; c++) {
+		uint64_t key = table[occupiedSlots[c]].key;
+		for (int a = 0; a < 3; a++) {
+			uint64_t v = (key >> (a * SPARSE_AXIS_BITS)) & SPARSE_AXIS_MASK;
+			lo[a] = std::min(lo[a], v);
+			hi[a] = std::max(hi[a], v);
+		}
+	}
+
+	int axisShift[3];
+	int keyBits = 0;
+	for (int a = 0; a < 3; a++) {
+		axisShift[a] = keyBits;
+		keyBits += (occupiedCount > 0) ? bitsFor(hi[a] - lo[a]) : 0;
+	}
+
+	// (z, y, x) order is kept since each axis keeps its place and is only shifted down
+	occupiedOrder.resize(occupiedCount);
+	occupiedOrderTemp.resize(occupiedCount);
+	for (int c = 0; c < occupiedCount; c++) {
+		uint64_t key = table[occupiedSlots[c]].key;
+		uint64_t compact = 0;
+		for (int a = 0; a < 3; a++) {
+			compact |= (((key >> (a * SPARSE_AXIS_BITS)) & SPARSE_AXIS_MASK) - lo[a]) << axisShift[a];
+		}
+		occupiedOrder[c] = std::make_pair(compact, occupiedSlots[c]);
+	}
+
+	// Same digit layout as NNS::radixSort, at most 2048 buckets per digit
+	int passes = (keyBits + 10) / 11;
+	int digitBits = passes ? (keyBits + passes - 1) / passes : 0;
+	uint32_t bucketCount = 1u << digitBits;
+	radixHistogram.resize(bucketCount);
+
+	for (int pass = 0; pass < passes; pass++) {
+		int shift = pass * digitBits;
+		std::fill(radixHistogram.begin(), radixHistogram.end(), 0);
+		for (int c = 0; c < occupiedCount; c++) {
+			++radixHistogram[(occupiedOrder[c].first >> shift) & (bucketCount - 1)];
+		}
+		uint32_t offset = 0;
+		for (uint32_t b = 0; b < bucketCount; b++) {
+			uint32_t temp = radixHistogram[b];
+			radixHistogram[b] = offset;
+			offset += temp;
+		}
+		for (int c = 0; c < occupiedCount; c++) {
+			occupiedOrderTemp[radixHistogram[(occupiedOrder[c].first >> shift) & (bucketCount - 1)]++] = occupiedOrder[c];
+		}
+		occupiedOrder.swap(occupiedOrderTemp);
+	}
+}
+
+// Counting sort through the hash table
+// 1. Compute each particle's cell key
+// 2. Insert the keys and count the particles per cell
+// 3. Order the occupied cells by key (z, y, x like row-major) and prefix sum the counts
+// 4. Scatter the particles to their sorted position
+void SparseGrid::build(std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	// Only the slots used last frame need clearing
+	for (uint32_t slot : occupiedSlots) {
+		uint64_t bit = bitOf(table[slot].key);
+		occupiedBits[bit >> 6] &= ~(1ULL << (bit & 63));
+		table[slot].key = emptyKey;
+	}
+	occupiedSlots.clear();
+
+	int i = 0;
+
+	// 1.
+#pragma omp parallel for
+	for (i = 0; i < particleCount; i++) {
+		particleKey[i] = cellKey(locations[i * 3 + 0], locations[i * 3 + 1], locations[i * 3 + 2]);
+	}
+
+	// 2. Serial, a shared table would need atomics on every insert
+	for (i = 0; i < particleCount; i++) {
+		uint32_t slot = insert(particleKey[i]);
+		particleSlot[i] = slot;
+		++table[slot].end;
+	}
+	occupiedCount = (int)occupiedSlots.size();
+
+	// 3. Sorting the cells keeps neighboring cells close in the sorted data
+	sortOccupiedCells();
+	uint32_t offset = 0;
+	for (int c = 0; c < occupiedCount; c++) {
+		uint32_t slot = occupiedOrder[c].second;
+		uint32_t cellCount = table[slot].end;
+		table[slot].start = offset;
+		table[slot].end = offset; // Used as the scatter cursor, ends at start + count
+		offset += cellCount;
+	}
+
+	// 4. In particle order so each cell keeps the original order
+	for (i = 0; i < particleCount; i++) {
+		uint32_t dst = table[particleSlot[i]].end++;
+
+		sortedKey[dst] = particleKey[i];
+		sortedIndex[dst] = i;
+		sortedLoc[dst * 3 + 0] = locations[i * 3 + 0];
+		sortedLoc[dst * 3 + 1] = locations[i * 3 + 1];
+		sortedLoc[dst * 3 + 2] = locations[i * 3 + 2];
+	}
+}
+
+size_t SparseGrid::memoryBytes() const {
+	return table.capacity() * sizeof(SparseCell)
+		+ (sortedKey.capacity() + particleKey.capacity()) * sizeof(uint64_t)
+		+ sortedIndex.capacity() * sizeof(int)
+		+ (particleSlot.capacity() + occupiedSlots.capacity()) * sizeof(uint32_t)
+		+ occupiedBits.capacity() * sizeof(uint64_t)
+		+ (occupiedOrder.capacity() + occupiedOrderTemp.capacity()) * sizeof(std::pair<uint64_t, uint32_t>)
+		+ radixHistogram.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,130 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <subcellGrid.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+void SubcellGrid::init(int count, float cutoffDist, int cellDivisions) {
+	cutoff = cutoffDist;
+	particleCount = count;
+	cellDimx = cellDimy = cellDimz = 0;
+	cellCount = 0;
+
+	sortedCell.resize(particleCount);
+	sortedIndex.resize(particleCount);
+	particleCell.resize(particleCount);
+
+	autotuneInterval = 0;
+	framesSinceTune = 0;
+	tuned = false;
+
+	setDivisions(cellDivisions);
+}
+
+// Closest distance between the center cell and the cell k cells away along one axis, in cells
+static inline int axisGap(int k) {
+	return std::max(std::abs(k) - 1, 0);
+}
+
+void SubcellGrid::setDivisions(int cellDivisions) {
+	divisions = std::max(cellDivisions, 1);
+	cellWidth = cutoff / divisions;
+	// Offsets depend on the grid size, build fills them in
+	stencil.clear();
+}
+
+// 1. Bounding box of the particles
+// 2. Cell of each particle, the grid and stencil follow the size of the box
+// 3. Count per cell, prefix sum into cellOffsets
+// 4. Scatter the particles to their sorted position
+void SubcellGrid::build(std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	int i = 0;
+
+	// 1.
+	float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
+	float maxX = -FLT_MAX, maxY = -FLT_MAX, maxZ = -FLT_MAX;
+#pragma omp parallel for reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ)
+	for (i = 0; i < particleCount; i++) {
+		minX = std::min(minX, locations[i * 3 + 0]);
+		minY = std::min(minY, locations[i * 3 + 1]);
+		minZ = std::min(minZ, locations[i * 3 + 2]);
+		maxX = std::max(maxX, locations[i * 3 + 0]);
+		maxY = std::max(maxY, locations[i * 3 + 1]);
+		maxZ = std::max(maxZ, locations[i * 3 + 2]);
+	}
+	if (particleCount == 0) {
+		minX = minY = minZ = maxX = maxY = maxZ = 0.0f;
+	}
+
+	// 2. divisions cells of padding on each side
+	int pad = divisions;
+	int dimx = (int)((maxX - minX) / cellWidth) + 1 + 2 * pad;
+	int dimy = (int)((maxY - minY) / cellWidth) + 1 + 2 * pad;
+	int dimz = (int)((maxZ - minZ) / cellWidth) + 1 + 2 * pad;
+	if (dimx != cellDimx || dimy != cellDimy || dimz != cellDimz || stencil.empty()) {
+		cellDimx = dimx;
+		cellDimy = dimy;
+		cellDimz = dimz;
+		cellCount = dimx * dimy * dimz;
+
+		stencil.clear();
+		int d = divisions;
+		for (int z = -d; z <= d; z++) {
+			for (int y = -d; y <= d; y++) {
+				for (int x = -d; x <= d; x++) {
+					if (axisGap(x) * axisGap(x) + axisGap(y) * axisGap(y) + axisGap(z) * axisGap(z) < d * d) {
+						stencil.push_back(x + y * cellDimx + z * cellDimx * cellDimy);
+					}
+				}
+			}
+		}
+	}
+	cellOffsets.assign(cellCount + 1, 0);
+	cellCursor.resize(cellCount);
+
+	float invWidth = 1.0f / cellWidth;
+#pragma omp parallel for
+	for (i = 0; i < particleCount; i++) {
+		// Clamped against rounding at the top of the box
+		int cx = std::min((int)((locations[i * 3 + 0] - minX) * invWidth), cellDimx - 2 * pad - 1) + pad;
+		int cy = std::min((int)((locations[i * 3 + 1] - minY) * invWidth), cellDimy - 2 * pad - 1) + pad;
+		int cz = std::min((int)((locations[i * 3 + 2] - minZ) * invWidth), cellDimz - 2 * pad - 1) + pad;
+		particleCell[i] = cx + cy * cellDimx + cz * cellDimx * cellDimy;
+	}
+
+	// 3. Serial like SparseGrid, counts per cell are small
+	for (i = 0; i < particleCount; i++) {
+		++cellOffsets[particleCell[i] + 1];
+	}
+	for (int c = 0; c < cellCount; c++) {
+		cellOffsets[c + 1] += cellOffsets[c];
+		cellCursor[c] = cellOffsets[c];
+	}
+
+	// 4. In particle order so each cell keeps the original order
+	for (i = 0; i < particleCount; i++) {
+		int cell = particleCell[i];
+		uint32_t dst = cellCursor[cell]++;
+
+		sortedCell[dst] = cell;
+		sortedIndex[dst] = i;
+		sortedLoc[dst * 3 + 0] = locations[i * 3 + 0];
+		sortedLoc[dst * 3 + 1] = locations[i * 3 + 1];
+		sortedLoc[dst * 3 + 2] = locations[i * 3 + 2];
+	}
+}
+
+bool SubcellGrid::tuneDue() {
+	bool due = !tuned || (autotuneInterval > 0 && framesSinceTune >= autotuneInterval);
+	++framesSinceTune;
+	return due;
+}
+
+size_t SubcellGrid::memoryBytes() const {
+	return (cellOffsets.capacity() + cellCursor.capacity()) * sizeof(uint32_t)
+		+ (sortedCell.capacity() + sortedIndex.capacity() + particleCell.capacity() + stencil.capacity()) * sizeof(int);
+}
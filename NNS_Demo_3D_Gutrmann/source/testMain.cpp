@@ -0,0 +1,364 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+* Correctness tests, each kernel and grid against countNeighbors or all-to-all. Takes the settings
+* of the demo (run with --help for the keys), ctest runs it with the settings in CMakeLists.txt
+*/
+
+#include <globals.hpp>
+#include <sort.hpp>
+#include <particle.hpp>
+#include <verlet.hpp>
+#include <sparseGrid.hpp>
+#include <radiusQuery.hpp>
+#include <subcellGrid.hpp>
+#include <adaptiveGrid.hpp>
+#include <particleStore.hpp>
+#include <clusterPairs.hpp>
+#include <algorithm>
+#include <config.hpp>
+#include <omp.h>
+
+// Failed checks, the exit code is 1 if there are any
+static int failures = 0;
+
+// Word printed for a check, counts it if it failed
+static const char* verdict(bool ok, const char* pass, const char* fail) {
+	if (!ok) {
+		++failures;
+	}
+	return ok ? pass : fail;
+}
+
+static int report() {
+	if (failures) {
+		printf("%d checks FAILED\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	Config config;
+	if (!config.parseArgs(argc, argv)) {
+		return 1;
+	}
+	config.print();
+
+	if (!config.multiThread) {
+		omp_set_num_threads(1);
+	}
+	else if (config.threads > 0) {
+		omp_set_num_threads(config.threads);
+	}
+
+	int xDimension = config.xDim;
+	int yDimension = config.yDim;
+	int zDimension = config.zDim;
+	int cellSize = config.cellSize;
+	int gridBuffer = config.gridBuffer;
+	int particleCount = config.particleCount;
+
+	NNS sortObject;
+	Particle partObject;
+
+	sortObject.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer, config.periodic);
+	partObject.init(particleCount, xDimension, yDimension, zDimension);
+
+	sortObject.hashMode = config.hashMode;
+	sortObject.setSortMethod(config.sortMethod, config.keepPreviousOrder);
+	sortObject.setCellOrder(config.cellOrder);
+	partObject.recordLists = config.recordLists;
+	partObject.sortedLists = config.sortedLists;
+	partObject.cellSchedule = config.cellSchedule;
+
+	sortObject.hash(partObject.locations);
+	sortObject.kvSort();
+	sortObject.findCellStartEnd();
+	sortObject.reorder(partObject.locations, partObject.sortedLoc);
+	partObject.countNeighbors(sortObject);
+
+	// Reference counts of countNeighbors, the other kernels have to give exactly these
+	std::vector<int> handwritten = partObject.neighborCount;
+	partObject.countNeighborsGeneric(sortObject);
+	printf("forEachNeighbor counts %s countNeighbors\n", verdict(partObject.neighborCount == handwritten, "match", "do NOT match"));
+	partObject.countNeighborsPairwiseGeneric(sortObject);
+	printf("forEachPair counts %s countNeighbors\n", verdict(partObject.neighborCount == handwritten, "match", "do NOT match"));
+	partObject.cellSchedule = !config.cellSchedule;
+	partObject.countNeighbors(sortObject);
+	printf("%s schedule counts %s countNeighbors\n\n", partObject.cellSchedule ? "Cell chunk" : "Particle",
+		verdict(partObject.neighborCount == handwritten, "match", "do NOT match"));
+	partObject.cellSchedule = config.cellSchedule;
+
+	// Particle store: the gathered positions are sortedLoc, and the stay sorted store gives the same
+	// counts per external ID over a few frames of re-sorting (velocity is a function of the ID)
+	{
+		ParticleStore gathered, resident;
+		gathered.init(particleCount);
+		resident.init(particleCount, true);
+		for (ParticleStore* store : { &gathered, &resident }) {
+			int pos = store->addField("position", 3);
+			int vel = store->addField("velocity", 3);
+			store->values(pos) = partObject.locations;
+			for (size_t v = 0; v < store->values(vel).size(); v++) {
+				store->values(vel)[v] = (float)v;
+			}
+		}
+		gathered.reorder(sortObject);
+		bool gatherMatch = (gathered.sorted(0) == partObject.sortedLoc);
+
+		NNS residentGrid;
+		residentGrid.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer, config.periodic);
+		bool recordLists = partObject.recordLists;
+		partObject.recordLists = false;
+		bool staySortedMatch = true;
+		for (int frame = 0; frame < 3; frame++) {
+			residentGrid.hash(resident.values(0));
+			residentGrid.kvSort();
+			residentGrid.findCellStartEnd();
+			resident.reorder(residentGrid);
+
+			std::swap(partObject.sortedLoc, resident.values(0));
+			partObject.countNeighbors(residentGrid);
+			std::swap(partObject.sortedLoc, resident.values(0));
+			for (int slot = 0; slot < particleCount; slot++) {
+				int id = resident.externalId[slot];
+				staySortedMatch = staySortedMatch && partObject.neighborCount[slot] == handwritten[id]
+					&& resident.slotOf[id] == slot && resident.values(1)[slot * 3] == (float)(id * 3);
+			}
+		}
+		partObject.recordLists = recordLists;
+		printf("Particle store gather %s NNS::reorder, stay sorted counts %s countNeighbors\n\n",
+			verdict(gatherMatch, "matches", "does NOT match"), verdict(staySortedMatch, "match", "do NOT match"));
+	}
+	partObject.neighborCount = handwritten;
+
+	if (sortObject.periodic) {
+		partObject.countNeighborsN2Periodic(sortObject);
+	}
+	else {
+		partObject.countNeighborsN2(cellSize);
+	}
+	printf("NNS counts %s the%s all-to-all\n", verdict(partObject.neighborCount == partObject.neighborCountN2, "match", "do NOT match"),
+		sortObject.periodic ? " minimum image" : "");
+	if (config.recordLists && !partObject.check()) {
+		++failures;
+	}
+	printf("\n");
+
+	// Half stencil kernel, also for periodic grids
+	partObject.countNeighborsSymmetric(sortObject);
+	printf("Symmetric counts %s countNeighbors\n", verdict(partObject.neighborCount == handwritten, "match", "do NOT match"));
+	if (config.recordLists) {
+		printf("Symmetric lists: ");
+		if (!partObject.check()) {
+			++failures;
+		}
+		printf("\n");
+	}
+	partObject.neighborCount = handwritten;
+
+	// The kernels and grids below are for open domains
+	if (sortObject.periodic) {
+		return report();
+	}
+
+	// SoA kernel at every SIMD level this CPU runs, they must give the counts of countNeighbors exactly
+	{
+		sortObject.reorder(partObject.locations, partObject.sortedSoA);
+		SimdLevel simdLevel = partObject.simdLevel;
+		for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+			partObject.simdLevel = (SimdLevel)level;
+			partObject.countNeighborsSIMD(sortObject);
+			printf("SoA %s counts %s countNeighbors\n", simdLevelName(partObject.simdLevel),
+				verdict(partObject.neighborCount == handwritten, "match", "do NOT match"));
+		}
+		partObject.simdLevel = simdLevel;
+		partObject.neighborCount = handwritten;
+	}
+
+	// Verlet lists over jittered frames, counts from the lists against a fresh grid and countNeighbors
+	// after each rebuild and each frame that reuses the lists
+	{
+		std::vector<float> original = partObject.locations;
+		std::vector<float> listSorted(partObject.sortedLoc.size());
+		VerletList verlet;
+		verlet.init(particleCount, (float)cellSize, config.verletSkin);
+		NNS verletGrid;
+		verletGrid.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer);
+		verletGrid.setCellOrder(config.cellOrder);
+		bool recordLists = partObject.recordLists;
+		partObject.recordLists = false;
+
+		std::vector<int> listCounts(particleCount);
+		int frames = 60, mismatchFrames = 0, rebuilds = 0;
+		for (int frame = 0; frame < frames; frame++) {
+			partObject.jitter(config.verletSkin * 0.05f);
+			partObject.confine(xDimension, yDimension, zDimension);
+			rebuilds += verlet.update(verletGrid, partObject.locations, listSorted) ? 1 : 0;
+			verlet.countNeighbors(verletGrid, listSorted, listCounts);
+
+			sortObject.build(partObject.locations, partObject.sortedLoc);
+			partObject.countNeighbors(sortObject);
+			mismatchFrames += (listCounts == partObject.neighborCount) ? 0 : 1;
+		}
+		printf("Verlet list counts %s countNeighbors (%d frames, %d rebuilds, %d mismatched frames)\n",
+			verdict(!mismatchFrames, "match", "do NOT match"), frames, rebuilds, mismatchFrames);
+
+		partObject.recordLists = recordLists;
+		partObject.locations = original;
+		sortObject.build(partObject.locations, partObject.sortedLoc);
+		partObject.neighborCount = handwritten;
+	}
+
+	// Incremental grid updates over jittered frames against a full hash, kvSort and findCellStartEnd in every
+	// cell order. Particles of a cell can be in another order, so each particle's cell is compared
+	{
+		std::vector<float> original = partObject.locations;
+		const CellOrder orders[3] = { CELL_ORDER_ROW_MAJOR, CELL_ORDER_MORTON, CELL_ORDER_HILBERT };
+		const char* orderNames[3] = { "row", "morton", "hilbert" };
+		for (int o = 0; o < 3; o++) {
+			NNS incremental, full;
+			incremental.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer);
+			full.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer);
+			incremental.setCellOrder(orders[o]);
+			full.setCellOrder(orders[o]);
+
+			// The first update has no grid to start from and does the full update
+			partObject.locations = original;
+			incremental.updateIncremental(partObject.locations);
+
+			std::vector<int> incrementalCell(particleCount), fullCell(particleCount);
+			int frames = 30, mismatchFrames = 0, movers = 0;
+			for (int frame = 0; frame < frames; frame++) {
+				// Every tenth frame moves enough particles for the fallback to the full sort
+				partObject.jitter(cellSize * ((frame % 10 == 9) ? 0.5f : 0.05f));
+				partObject.confine(xDimension, yDimension, zDimension);
+				// A hash alone leaves the grid unsorted, the update after it has to start over
+				if (frame == 15) {
+					incremental.hash(partObject.locations);
+				}
+				movers += incremental.updateIncremental(partObject.locations);
+				full.hash(partObject.locations);
+				full.kvSort();
+				full.findCellStartEnd();
+
+				bool match = true;
+				for (int i = 0; i < particleCount; i++) {
+					match = match && incremental.cellIndexPair[i].cellID == full.cellIndexPair[i].cellID;
+					incrementalCell[incremental.cellIndexPair[i].index] = incremental.cellIndexPair[i].cellID;
+					fullCell[full.cellIndexPair[i].index] = full.cellIndexPair[i].cellID;
+				}
+				for (int c = 0; c < full.cellCount; c++) {
+					match = match && incremental.cellStart[c] == full.cellStart[c]
+						&& (full.cellStart[c] == 0xffffffff || incremental.cellEnd[c] == full.cellEnd[c]);
+				}
+				mismatchFrames += (match && incrementalCell == fullCell) ? 0 : 1;
+			}
+			printf("Incremental grid (%s order, %d frames, %d movers) %s the full rebuild\n", orderNames[o], frames, movers,
+				verdict(!mismatchFrames, "matches", "does NOT match"));
+		}
+		partObject.locations = original;
+		printf("\n");
+	}
+
+	// Cluster pairs, both cluster sizes against the counts of countNeighbors, then over jittered frames
+	// against a fresh grid after each rebuild and each frame that reuses the lists
+	{
+		std::vector<float> original = partObject.locations;
+		std::vector<float> listSorted(partObject.sortedLoc.size());
+		NNS clusterGrid;
+		clusterGrid.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer);
+		clusterGrid.setCellOrder(config.cellOrder);
+		bool recordLists = partObject.recordLists;
+		partObject.recordLists = false;
+
+		std::vector<int> listCounts(particleCount);
+		for (int width : { 4, 8 }) {
+			ClusterPairList clusters;
+			clusters.init(particleCount, (float)cellSize, config.verletSkin, width);
+			clusters.update(clusterGrid, partObject.locations, listSorted);
+			clusters.countNeighbors(clusterGrid, listCounts);
+			printf("Cluster pairs %dx%d (%d clusters, %d pairs) %s countNeighbors\n", clusters.clusterSize, clusters.clusterSize,
+				clusters.clusterCount, (int)clusters.pairs.size(), verdict(listCounts == handwritten, "match", "do NOT match"));
+
+			int frames = 60, mismatchFrames = 0, rebuilds = 0;
+			for (int frame = 0; frame < frames; frame++) {
+				partObject.jitter(config.verletSkin * 0.05f);
+				partObject.confine(xDimension, yDimension, zDimension);
+				rebuilds += clusters.update(clusterGrid, partObject.locations, listSorted) ? 1 : 0;
+				clusters.countNeighbors(clusterGrid, listCounts);
+
+				sortObject.build(partObject.locations, partObject.sortedLoc);
+				partObject.countNeighbors(sortObject);
+				mismatchFrames += (listCounts == partObject.neighborCount) ? 0 : 1;
+			}
+			printf("Cluster pair %dx%d list counts %s countNeighbors (%d frames, %d rebuilds, %d mismatched frames)\n",
+				clusters.clusterSize, clusters.clusterSize, verdict(!mismatchFrames, "match", "do NOT match"), frames, rebuilds, mismatchFrames);
+			partObject.locations = original;
+		}
+
+		partObject.recordLists = recordLists;
+		sortObject.build(partObject.locations, partObject.sortedLoc);
+		partObject.neighborCount = handwritten;
+	}
+
+	// External points with a radius larger than a cell, against brute force (order within a point can differ)
+	{
+		std::vector<float> points;
+		for (int q = 0; q < particleCount; q++) {
+			points.push_back(((rand() % (xDimension * 10)) / 10.0f) - xDimension / 2.0f);
+			points.push_back(((rand() % (yDimension * 10)) / 10.0f) - yDimension / 2.0f);
+			points.push_back(((rand() % (zDimension * 10)) / 10.0f) - zDimension / 2.0f);
+		}
+		RadiusQuery grid, brute;
+		grid.query(sortObject, partObject.sortedLoc, points, cellSize * 1.5f);
+		brute.queryBruteForce(partObject.locations, points, cellSize * 1.5f);
+		for (int q = 0; q < grid.getQueryCount(); q++) {
+			std::sort(grid.indices.begin() + grid.offsets[q], grid.indices.begin() + grid.offsets[q + 1]);
+		}
+		printf("Radius queries (%d results) %s brute force\n", (int)grid.indices.size(),
+			verdict(grid.offsets == brute.offsets && grid.indices == brute.indices, "match", "do NOT match"));
+	}
+
+	// Sparse hashed grid, has no out-of-bounds cell so it should agree with all-to-all
+	SparseGrid grid;
+	grid.init(particleCount, (float)cellSize);
+	grid.build(partObject.locations, partObject.sortedLoc);
+	partObject.countNeighbors(grid);
+	printf("Sparse grid (%d occupied cells) %s all-to-all\n", grid.occupiedCount,
+		verdict(partObject.neighborCount == partObject.neighborCountN2, "matches", "does NOT match"));
+
+	// Subcell grids, also without an out-of-bounds cell
+	SubcellGrid subcell;
+	subcell.init(particleCount, (float)cellSize);
+	for (int d = 1; d <= 3; d++) {
+		subcell.setDivisions(d);
+		subcell.build(partObject.locations, partObject.sortedLoc);
+		partObject.countNeighbors(subcell);
+		printf("Subcell grid (%d divisions, %d stencil cells) %s all-to-all\n", d, (int)subcell.stencil.size(),
+			verdict(partObject.neighborCount == partObject.neighborCountN2, "matches", "does NOT match"));
+	}
+
+	// Quantized positions, counts near the cutoff can differ by the error bound
+	sortObject.build(partObject.locations, partObject.sortedLoc);
+	for (int bits : { 8, 10, 16 }) {
+		partObject.sortedQuantized.resize(particleCount, bits);
+		sortObject.reorder(partObject.locations, partObject.sortedQuantized);
+		if (!partObject.validateQuantized(sortObject)) {
+			++failures;
+		}
+	}
+
+	// Adaptive grid, a low threshold so the small demo splits cells
+	AdaptiveGrid adaptive;
+	adaptive.init(particleCount, xDimension, yDimension, zDimension, cellSize, gridBuffer);
+	adaptive.denseThreshold = 4;
+	adaptive.minDenseFraction = 0.0f;
+	adaptive.build(partObject.locations, partObject.sortedLoc);
+	partObject.countNeighbors(adaptive);
+	printf("Adaptive grid (%d split cells) %s all-to-all\n\n", adaptive.splitCells,
+		verdict(partObject.neighborCount == partObject.neighborCountN2, "matches", "does NOT match"));
+	return report();
+}
@@ -0,0 +1,224 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <topology.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+static int readSysInt(const char* path, int fallback) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return fallback;
+	}
+	int value = fallback;
+	if (fscanf(f, "%d", &value) != 1) {
+		value = fallback;
+	}
+	fclose(f);
+	return value;
+}
+
+// "0-3,8-11" style list
+static std::vector<int> readCpuList(const char* path) {
+	std::vector<int> list;
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return list;
+	}
+	int first, last;
+	while (fscanf(f, "%d", &first) == 1) {
+		last = first;
+		int c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &last) != 1) {
+				break;
+			}
+			c = fgetc(f);
+		}
+		for (int cpu = first; cpu <= last; cpu++) {
+			list.push_back(cpu);
+		}
+		if (c != ',') {
+			break;
+		}
+	}
+	fclose(f);
+	return list;
+}
+
+#endif
+
+void CpuTopology::detect() {
+	cpus.clear();
+
+#ifdef __linux__
+	// Only the CPUs of the affinity mask (taskset, cgroups), not every CPU of the machine
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	std::map<int, int> nodeOfCpu;
+	char path[128];
+	for (int node = 0; node < 1024; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		std::vector<int> list = readCpuList(path);
+		if (list.empty() && node > 0) {
+			break;
+		}
+		for (int cpu : list) {
+			nodeOfCpu[cpu] = node;
+		}
+	}
+
+	for (int cpu : readCpuList("/sys/devices/system/cpu/online")) {
+		if (haveMask && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		int core = readSysInt(path, cpu);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		int package = readSysInt(path, 0);
+		int node = nodeOfCpu.count(cpu) ? nodeOfCpu[cpu] : 0;
+		cpus.push_back({ cpu, core, package, node, 0 });
+	}
+#endif
+
+	if (cpus.empty()) {
+		int logical = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int cpu = 0; cpu < logical; cpu++) {
+			cpus.push_back({ cpu, cpu, 0, 0, 0 });
+		}
+	}
+
+	// core_id is only unique inside a package, renumber (package, core) pairs and count the siblings
+	std::sort(cpus.begin(), cpus.end(), [](const Cpu& a, const Cpu& b) {
+		if (a.node != b.node) return a.node < b.node;
+		if (a.package != b.package) return a.package < b.package;
+		if (a.core != b.core) return a.core < b.core;
+		return a.id < b.id;
+	});
+	std::map<std::pair<int, int>, int> coreIndex;
+	std::map<int, int> packages, nodes;
+	for (Cpu& cpu : cpus) {
+		std::pair<int, int> key(cpu.package, cpu.core);
+		auto found = coreIndex.find(key);
+		if (found == coreIndex.end()) {
+			found = coreIndex.insert({ key, (int)coreIndex.size() }).first;
+			cpu.sibling = 0;
+		}
+		else {
+			cpu.sibling = (&cpu - 1)->sibling + 1; // Siblings are adjacent after the sort
+		}
+		cpu.core = found->second;
+		packages[cpu.package] = 1;
+		nodes[cpu.node] = 1;
+	}
+	coreCount = (int)coreIndex.size();
+	packageCount = (int)packages.size();
+	nodeCount = (int)nodes.size();
+}
+
+void CpuTopology::print() {
+	printf("CPU topology: %d logical CPUs available, %d cores, %d packages, %d NUMA nodes\n",
+		(int)cpus.size(), coreCount, packageCount, nodeCount);
+}
+
+std::vector<int> CpuTopology::placement(int threadCount, bool smt) const {
+	std::vector<int> order;
+	if (smt) {
+		for (const Cpu& cpu : cpus) {
+			order.push_back(cpu.id);
+		}
+	}
+	else {
+		int maxSibling = 0;
+		for (const Cpu& cpu : cpus) {
+			maxSibling = std::max(maxSibling, cpu.sibling);
+		}
+		for (int s = 0; s <= maxSibling; s++) {
+			for (const Cpu& cpu : cpus) {
+				if (cpu.sibling == s) {
+					order.push_back(cpu.id);
+				}
+			}
+		}
+	}
+
+	std::vector<int> result(threadCount);
+	for (int t = 0; t < threadCount; t++) {
+		result[t] = order[t % order.size()];
+	}
+	return result;
+}
+
+bool applyThreads(const CpuTopology& topology, ThreadSetting setting, bool pin) {
+	int threads = std::max(setting.threads, 1);
+	omp_set_num_threads(threads);
+
+	if (!pin || getenv("OMP_PROC_BIND") || getenv("OMP_PLACES")) {
+		return false;
+	}
+
+#ifdef __linux__
+	// The runtime keeps its threads between parallel regions of the same size, so the binding stays
+	std::vector<int> cpuOf = topology.placement(threads, setting.smt);
+	bool pinned = true;
+#pragma omp parallel reduction(&&:pinned)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpuOf[omp_get_thread_num()], &set);
+		pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+	return pinned;
+#else
+	(void)topology;
+	return false;
+#endif
+}
+
+void unpinThreads(const CpuTopology& topology) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (const CpuTopology::Cpu& cpu : topology.cpus) {
+		CPU_SET(cpu.id, &set);
+	}
+#pragma omp parallel
+	{
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+#else
+	(void)topology;
+#endif
+}
+
+void releasePages(void* data, size_t bytes) {
+#ifdef __linux__
+	// Whole pages inside the buffer only, the partial pages at the ends may hold other data
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	uintptr_t begin = ((uintptr_t)data + pageSize - 1) / pageSize * pageSize;
+	uintptr_t end = ((uintptr_t)data + bytes) / pageSize * pageSize;
+	if (end > begin) {
+		madvise((void*)begin, end - begin, MADV_DONTNEED);
+	}
+#else
+	(void)data;
+	(void)bytes;
+#endif
+}
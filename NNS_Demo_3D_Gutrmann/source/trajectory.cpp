@@ -0,0 +1,378 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <trajectory.hpp>
+#include <particle.hpp>
+#include <pipeline.hpp>
+#include <timer.hpp>
+#include <cmath>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char trajectoryMagic[8] = { 'N', 'N', 'S', 'T', 'R', 'A', 'J', '1' };
+static const char countsMagic[8] = { 'N', 'N', 'S', 'C', 'N', 'T', '0', '1' };
+
+// --- Reader -------------------------------------------------------------------------
+
+TrajectoryReader::TrajectoryReader() {
+	memset(&header, 0, sizeof(header));
+	current = { -1, nullptr, 0, nullptr };
+	next = { -1, nullptr, 0, nullptr };
+#ifdef _WIN32
+	file = nullptr;
+#else
+	fd = -1;
+	pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+TrajectoryReader::~TrajectoryReader() {
+	close();
+}
+
+bool TrajectoryReader::open(const char* path) {
+	close();
+
+#ifdef _WIN32
+	file = fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+	bool headerRead = fread(&header, sizeof(header), 1, file) == 1;
+#else
+	fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool headerRead = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+#endif
+
+	bool valid = headerRead && memcmp(header.magic, trajectoryMagic, sizeof(trajectoryMagic)) == 0 && header.version == 1
+		&& (header.layout == TRAJ_LAYOUT_XYZ || header.layout == TRAJ_LAYOUT_SOA)
+		&& header.frameBytes == header.particleCount * 3 * sizeof(float);
+
+#ifndef _WIN32
+	// The frames must all be there, a truncated file would fault inside the mapping instead
+	struct stat info;
+	valid = valid && fstat(fd, &info) == 0
+		&& (uint64_t)info.st_size >= sizeof(header) + header.frameCount * header.frameBytes;
+#endif
+
+	if (!valid) {
+		printf("%s is not a trajectory file or is truncated\n", path);
+		close();
+		return false;
+	}
+
+	if (header.layout == TRAJ_LAYOUT_SOA) {
+		staging.resize(header.particleCount * 3);
+	}
+	return true;
+}
+
+void TrajectoryReader::close() {
+	unmap(current);
+	unmap(next);
+#ifdef _WIN32
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+#else
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+#endif
+}
+
+#ifdef _WIN32
+
+// No mmap, frames are read into a buffer
+bool TrajectoryReader::mapFrame(int f, Window& w) {
+	readBuffer.resize(header.particleCount * 3);
+	long long offset = (long long)sizeof(header) + (long long)f * header.frameBytes;
+	if (_fseeki64(file, offset, SEEK_SET) != 0 || fread(readBuffer.data(), 1, header.frameBytes, file) != header.frameBytes) {
+		return false;
+	}
+	w = { f, nullptr, 0, readBuffer.data() };
+	return true;
+}
+
+void TrajectoryReader::unmap(Window& w) {
+	w = { -1, nullptr, 0, nullptr };
+}
+
+void TrajectoryReader::prefetch(int) {
+}
+
+#else
+
+// mmap offsets must be page aligned, frames generally are not
+bool TrajectoryReader::mapFrame(int f, Window& w) {
+	size_t offset = sizeof(header) + (size_t)f * header.frameBytes;
+	size_t aligned = offset / pageSize * pageSize;
+	size_t length = offset - aligned + header.frameBytes;
+
+	void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, (off_t)aligned);
+	if (base == MAP_FAILED) {
+		return false;
+	}
+	w = { f, base, length, (const float*)((const char*)base + (offset - aligned)) };
+	return true;
+}
+
+void TrajectoryReader::unmap(Window& w) {
+	if (w.base) {
+		munmap(w.base, w.length);
+	}
+	w = { -1, nullptr, 0, nullptr };
+}
+
+void TrajectoryReader::prefetch(int f) {
+	if (f < 0 || f >= frameCount() || f == current.frame || f == next.frame) {
+		return;
+	}
+	unmap(next);
+	if (mapFrame(f, next)) {
+		// Queues the reads and returns, the pages are in the page cache by the time frame(f) touches them
+		madvise(next.base, next.length, MADV_WILLNEED);
+	}
+}
+
+#endif
+
+const float* TrajectoryReader::frame(int f) {
+	if (f < 0 || f >= frameCount()) {
+		return nullptr;
+	}
+
+	if (f != current.frame) {
+		unmap(current);
+		if (f == next.frame) {
+			current = next;
+			next = { -1, nullptr, 0, nullptr };
+		}
+		else if (!mapFrame(f, current)) {
+			return nullptr;
+		}
+#ifndef _WIN32
+		madvise(current.base, current.length, MADV_SEQUENTIAL);
+#endif
+	}
+
+	if (header.layout == TRAJ_LAYOUT_XYZ) {
+		return current.data;
+	}
+
+	// SoA, interleave into x y z per particle
+	int n = particleCount();
+	const float* blocks = current.data;
+	int i = 0;
+#pragma omp parallel for
+	for (i = 0; i < n; i++) {
+		staging[i * 3 + 0] = blocks[i];
+		staging[i * 3 + 1] = blocks[n + i];
+		staging[i * 3 + 2] = blocks[2 * n + i];
+	}
+	return staging.data();
+}
+
+// --- Writer -------------------------------------------------------------------------
+
+TrajectoryWriter::TrajectoryWriter() {
+	file = nullptr;
+	memset(&header, 0, sizeof(header));
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+	close();
+}
+
+bool TrajectoryWriter::open(const char* path, int particleCount, float boxx, float boxy, float boxz, TrajectoryLayout layout) {
+	close();
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, trajectoryMagic, sizeof(header.magic));
+	header.version = 1;
+	header.layout = layout;
+	header.particleCount = particleCount;
+	header.frameBytes = (uint64_t)particleCount * 3 * sizeof(float);
+	header.box[0] = boxx;
+	header.box[1] = boxy;
+	header.box[2] = boxz;
+
+	file = fopen(path, "wb");
+	return file && writeHeader();
+}
+
+bool TrajectoryWriter::openCounts(const char* path, int particleCount) {
+	close();
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, countsMagic, sizeof(header.magic));
+	header.version = 1;
+	header.layout = TRAJ_LAYOUT_COUNTS;
+	header.particleCount = particleCount;
+	header.frameBytes = (uint64_t)particleCount * sizeof(int32_t);
+
+	file = fopen(path, "wb");
+	return file && writeHeader();
+}
+
+bool TrajectoryWriter::writeHeader() {
+	return fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+bool TrajectoryWriter::writeFrame(const float* locations) {
+	size_t n = header.particleCount;
+	const float* data = locations;
+
+	if (header.layout == TRAJ_LAYOUT_SOA) {
+		transposed.resize(n * 3);
+		for (size_t i = 0; i < n; i++) {
+			transposed[i] = locations[i * 3 + 0];
+			transposed[n + i] = locations[i * 3 + 1];
+			transposed[2 * n + i] = locations[i * 3 + 2];
+		}
+		data = transposed.data();
+	}
+
+	if (fwrite(data, sizeof(float), n * 3, file) != n * 3) {
+		return false;
+	}
+	++header.frameCount;
+	return true;
+}
+
+bool TrajectoryWriter::writeCounts(const std::vector<int>& counts) {
+	static_assert(sizeof(int) == sizeof(int32_t), "counts are written as int32");
+	size_t n = header.particleCount;
+	if (counts.size() < n || fwrite(counts.data(), sizeof(int32_t), n, file) != n) {
+		return false;
+	}
+	++header.frameCount;
+	return true;
+}
+
+// Rewrites the header with the final frame count
+bool TrajectoryWriter::close() {
+	if (!file) {
+		return true;
+	}
+	bool ok = writeHeader();
+	ok = (fclose(file) == 0) && ok;
+	file = nullptr;
+	return ok;
+}
+
+// --- Drivers ------------------------------------------------------------------------
+
+bool streamTrajectory(const char* path, const char* countsPath, int cellSize, int gridBuffer, HashMode hashMode, bool pipelined) {
+	TrajectoryReader reader;
+	if (!reader.open(path)) {
+		printf("Could not open trajectory %s\n", path);
+		return false;
+	}
+	int particleCount = reader.particleCount();
+	int frameCount = reader.frameCount();
+
+	TrajectoryWriter counts;
+	if (countsPath && !counts.openCounts(countsPath, particleCount)) {
+		printf("Could not open %s for writing\n", countsPath);
+		return false;
+	}
+
+	int dimx = (int)ceilf(reader.header.box[0]);
+	int dimy = (int)ceilf(reader.header.box[1]);
+	int dimz = (int)ceilf(reader.header.box[2]);
+	printf("Streaming %s: %d frames of %d particles, %d x %d x %d (%.1f MB per frame)\n", path, frameCount,
+		particleCount, dimx, dimy, dimz, reader.header.frameBytes / (1024.0 * 1024.0));
+
+	FramePipeline pipeline;
+	pipeline.init(particleCount, dimx, dimy, dimz, cellSize, gridBuffer);
+	for (NNS& grid : pipeline.grids) {
+		grid.hashMode = hashMode;
+	}
+
+	// Only sortedLoc and neighborCount are used, the frames replace the random locations
+	Particle partObject;
+	partObject.init(particleCount, dimx, dimy, dimz);
+
+	// A frame that can't be mapped is searched as the random locations so the run finishes, then reported
+	int failedFrame = -1;
+	bool writeFailed = false;
+	auto source = [&](int f) {
+		const float* locations = reader.frame(f);
+		reader.prefetch(f + 1);
+		if (!locations) {
+			failedFrame = f;
+			return (const float*)partObject.locations.data();
+		}
+		return locations;
+	};
+
+	long long totalCount = 0;
+	auto done = [&](int) {
+		for (int i = 0; i < particleCount; i++) {
+			totalCount += partObject.neighborCount[i];
+		}
+		if (countsPath && !writeFailed) {
+			writeFailed = !counts.writeCounts(partObject.neighborCount);
+		}
+	};
+
+	double total = pipelined ? pipeline.run(partObject, frameCount, source, done)
+		: pipeline.runSequential(partObject, frameCount, source, done);
+
+	if (failedFrame >= 0) {
+		printf("Could not read frame %d\n", failedFrame);
+		return false;
+	}
+	if (countsPath && (writeFailed || !counts.close())) {
+		printf("Could not write %s\n", countsPath);
+		return false;
+	}
+
+	printf("Streamed %d frames %s in %0.3f (build %0.3f, kernel %0.3f, %.1f frames/s), %.2f neighbors per particle\n",
+		frameCount, pipelined ? "pipelined" : "sequentially", total, pipeline.buildTime, pipeline.kernelTime, frameCount / total,
+		frameCount ? totalCount / ((double)frameCount * particleCount) : 0.0);
+	if (countsPath) {
+		printf("Neighbor counts written to %s\n", countsPath);
+	}
+	return true;
+}
+
+bool writeRandomTrajectory(const char* path, int particleCount, int dimx, int dimy, int dimz, int frameCount,
+	float maxStep, TrajectoryLayout layout) {
+	TrajectoryWriter writer;
+	if (!writer.open(path, particleCount, (float)dimx, (float)dimy, (float)dimz, layout)) {
+		printf("Could not open %s for writing\n", path);
+		return false;
+	}
+
+	Particle partObject;
+	partObject.init(particleCount, dimx, dimy, dimz);
+	for (int f = 0; f < frameCount; f++) {
+		if (f > 0) {
+			partObject.jitter(maxStep);
+		}
+		if (!writer.writeFrame(partObject.locations.data())) {
+			printf("Could not write frame %d\n", f);
+			return false;
+		}
+	}
+
+	if (!writer.close()) {
+		printf("Could not finish %s\n", path);
+		return false;
+	}
+	printf("Wrote %d frames of %d particles to %s\n", frameCount, particleCount, path);
+	return true;
+}
@@ -0,0 +1,129 @@
+/*
+* Author: Gregory Gutmann
+* Nearest neighbor search algorithm demo
+*/
+
+#include <verlet.hpp>
+#include <globals.hpp>
+#include <algorithm>
+
+void VerletList::init(int count, float cutoffDist, float skinDist) {
+	cutoff = cutoffDist;
+	particleCount = count;
+
+	offsets.resize(particleCount + 1);
+	initSkin(count, skinDist);
+}
+
+bool VerletList::update(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	if (!updateGrid(sort, locations, sortedLoc)) {
+		return false;
+	}
+	build(sort, locations, sortedLoc);
+	return true;
+}
+
+void VerletList::build(NNS& sort, std::vector<float>& locations, std::vector<float>& sortedLoc) {
+	// offsetCell does not wrap and the distances have no minimum image, the lists would miss pairs
+	if (sort.periodic) {
+		printf("VerletList::build Error: periodic grids are not supported, the lists are empty\n");
+		std::fill(offsets.begin(), offsets.end(), 0);
+		neighbors.clear();
+		return;
+	}
+
+	float listCutoff = cutoff + skin;
+
+	// The stencil has to reach as many cells as the list cutoff covers
+	int reach = (int)ceilf(listCutoff / (float)sort.cellLength);
+	std::vector<int> stencil;
+	for (int dz = -reach; dz <= reach; dz++) {
+		for (int dy = -reach; dy <= reach; dy++) {
+			for (int dx = -reach; dx <= reach; dx++) {
+				stencil.push_back((dz * sort.cellDimy * sort.cellDimx) + (dy * sort.cellDimx) + dx);
+			}
+		}
+	}
+	int stencilSize = (int)stencil.size();
+
+	// Two passes, count then fill, so the lists are one contiguous allocation
+	for (int pass = 0; pass < 2; pass++) {
+		int currIdx = 0;
+
+#pragma omp parallel for schedule(dynamic, 256)
+		for (currIdx = 0; currIdx < particleCount; currIdx++) {
+			float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
+			int thisCell = sort.cellIndexPair[currIdx].cellID;
+			int localCount = 0;
+			int* out = (pass == 1) ? neighbors.data() + offsets[currIdx] : nullptr;
+
+			for (int t = 0; t < stencilSize; t++) {
+				int targetCell = sort.offsetCell(thisCell, stencil[t]);
+
+				if (targetCell < 0 || targetCell >= sort.cellCount - 1) // Excludes the one out-of-bounds cell
+					continue;
+
+				uint32_t startIndex = sort.cellStart[targetCell];
+				if (startIndex == 0xffffffff)
+					continue;
+				uint32_t endIndex = sort.cellEnd[targetCell];
+
+				for (uint32_t checkIdx = startIndex; checkIdx < endIndex; checkIdx++) {
+					if (checkIdx != (uint32_t)currIdx) {
+						float3 p2pVec = make_float3(sortedLoc[checkIdx * 3 + 0] - thisLoc.x, sortedLoc[checkIdx * 3 + 1] - thisLoc.y, sortedLoc[checkIdx * 3 + 2] - thisLoc.z);
+						float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+
+						if (dist < listCutoff) {
+							if (out) {
+								out[localCount] = (int)checkIdx;
+							}
+							++localCount;
+						}
+					}
+				}
+			}
+
+			if (pass == 0) {
+				offsets[currIdx + 1] = localCount;
+			}
+		}
+
+		if (pass == 0) {
+			neighbors.resize(exclusiveScan(offsets.data(), particleCount));
+		}
+	}
+
+	recordBuild(locations);
+}
+
+void VerletList::countNeighbors(NNS& sort, std::vector<float>& sortedLoc, std::vector<int>& neighborCount) {
+	int currIdx = 0;
+
+#pragma omp parallel for
+	for (currIdx = 0; currIdx < particleCount; currIdx++) {
+		float3 thisLoc = make_float3(sortedLoc[currIdx * 3 + 0], sortedLoc[currIdx * 3 + 1], sortedLoc[currIdx * 3 + 2]);
+		int localCount = 0;
+
+		for (int n = offsets[currIdx]; n < offsets[currIdx + 1]; n++) {
+			int checkIdx = neighbors[n];
+			float3 p2pVec = make_float3(sortedLoc[checkIdx * 3 + 0] - thisLoc.x, sortedLoc[checkIdx * 3 + 1] - thisLoc.y, sortedLoc[checkIdx * 3 + 2] - thisLoc.z);
+			float dist = sqrtf((p2pVec.x * p2pVec.x) + (p2pVec.y * p2pVec.y) + (p2pVec.z * p2pVec.z));
+
+			if (dist < cutoff) {
+				++localCount;
+			}
+		}
+
+		neighborCount[sort.cellIndexPair[currIdx].index] = localCount;
+	}
+}
+
+void VerletList::printStats() {
+	printf("Verlet list: cutoff %.2f skin %.2f\n", cutoff, skin);
+	printf("\tRebuilds %d of %d frames (every %.1f frames)\n", buildCount, frameCount,
+		buildCount ? frameCount / (float)buildCount : 0.0f);
+	printf("\tList entries %zu (%.1f per particle, %.2f MB)\n", neighbors.size(),
+		neighbors.size() / (float)particleCount,
+		(neighbors.size() + offsets.size()) * sizeof(int) / (1024.0f * 1024.0f));
+	printf("\tLast max displacement %.3f (rebuild above %.3f)\n", lastMaxDisplacement, skin * 0.5f);
+}